@@ -19,6 +19,31 @@
 #include <cctype>
 #include <sys/wait.h> // for WEXITSTATUS
 #include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <map>
+#include <set>
+#include <condition_variable>
+#include <cstring>
+#include <cstddef>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <sys/resource.h>
+#include <sys/statvfs.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include <sys/sysmacros.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#include <arm_neon.h>
+#endif
 
 using json = nlohmann::json;
 using namespace httplib;
@@ -31,6 +56,21 @@ std::atomic<bool> stopTimerThread(false);
 bool isFfmpegRunning = false;
 bool isFfmpegRunning2 = false;
 
+// GPIO 事件触发源
+struct GpioTriggerConfig {
+    std::string path;   // sysfs value 文件，或测试用的普通文件
+    int channel;
+    std::string edge;   // rising / falling / both
+};
+
+// 每路的遮挡、失焦、黑屏检测阈值，某项为 0 表示不检测该项
+struct TamperConfig {
+    double black_mean = 16;          // 亮度均值 (0-255) 低于此值判定为黑屏
+    double defocus_ratio = 0.3;      // 清晰度低于该路正常画面基线的这一比例判定为失焦
+    double occlusion_ratio = 0.85;   // 亮度集中在相邻两个直方图区间 (共 32 个) 的像素比例高于此值判定为遮挡
+    int min_seconds = 10;            // 状态持续这么久才告警
+};
+
 // 录制配置结构体
 struct RecordingConfig {
     std::string rtsp_url1;
@@ -39,8 +79,51 @@ struct RecordingConfig {
     std::string save_path2;
     int segment_time;
     bool dual_stream_enabled;
+    std::string record_mode1;      // continuous: 持续写卡; loop: 只在内存中循环缓存，触发后落盘
+    std::string record_mode2;
+    std::string loop_buffer_path;  // 循环缓存目录，应位于 tmpfs
+    int loop_buffer_minutes;
+    int pre_roll_seconds;
+    int post_roll_seconds;
+    bool event_buffer_enabled;     // continuous 模式下同时维护事件预录缓存
+    std::vector<GpioTriggerConfig> gpio_triggers;
+    std::string s3_endpoint;
+    std::string s3_bucket;
+    std::string s3_access_key;
+    std::string s3_secret_key;
+    std::string s3_region;
+    int s3_part_size_mb;           // 分片大小，S3 要求至少 5MB
+    int s3_upload_workers;         // 同时执行的上传任务数
+    int s3_part_concurrency;       // 单个任务并行上传的分片数
+    std::string upload_policy1;    // 分段关闭后自动上传: off / all / events
+    std::string upload_policy2;
+    int upload_bandwidth_kbps;     // 上传带宽上限 (kbit/s)，0 表示不限
+    std::vector<std::string> upload_windows;   // 允许自动上传的时段 "HH:MM-HH:MM"，为空表示不限
+    bool checksum_sha256;          // 分段关闭时除 xxh3 外另算 SHA-256
+    bool fragmented_mp4;           // 以分片 MP4 录制，分段在写入过程中即可播放
+    int stall_timeout_ms;          // 录制进程这么久没有进展即判定卡住并重启该路，0 表示不检测
+    int freeze_threshold_seconds;  // 连续相同的关键帧持续这么久即判定画面冻结，0 表示不检测
+    bool keyframe_analysis;        // 分段关闭后解码其中的关键帧计算活动度和遮挡/失焦/黑屏指标
+    TamperConfig tamper1;
+    TamperConfig tamper2;
+    bool audio_analysis;           // 分段关闭后解码音频计算响度曲线
+    double audio_threshold_db;     // 0.5 秒窗口的 RMS 电平 (dBFS) 超过此值记为声音事件
+    std::string audio_policy1;     // 音频处理: copy / transcode / drop / auto
+    std::string audio_policy2;
+    int emergency_free_mb;         // 保存目录所在分区剩余空间低于此值 (MB) 时该路只录关键帧，0 表示不检测
+    int emergency_latency_ms;      // 保存目录所在分区写延迟 p99 超过此值时该路只录关键帧，0 表示不检测
     
-    RecordingConfig() : segment_time(600), dual_stream_enabled(true) {}
+    RecordingConfig() : segment_time(600), dual_stream_enabled(true),
+                        record_mode1("continuous"), record_mode2("continuous"),
+                        loop_buffer_path("/dev/shm/vrs_loop"), loop_buffer_minutes(3),
+                        pre_roll_seconds(30), post_roll_seconds(30), event_buffer_enabled(false),
+                        s3_region("us-east-1"), s3_part_size_mb(8), s3_upload_workers(1), s3_part_concurrency(2),
+                        upload_policy1("off"), upload_policy2("off"), upload_bandwidth_kbps(0),
+                        checksum_sha256(false), fragmented_mp4(false), stall_timeout_ms(5000),
+                        freeze_threshold_seconds(30), keyframe_analysis(false),
+                        audio_analysis(false), audio_threshold_db(-20),
+                        audio_policy1("auto"), audio_policy2("auto"),
+                        emergency_free_mb(512), emergency_latency_ms(0) {}
 };
 
 RecordingConfig config;
@@ -134,383 +217,6464 @@ bool waitForMountPoint(const std::string &mountPath, int maxWaitSeconds = 45) {
     return true;
 }
 
+void tamperFromJson(const json& j, TamperConfig& tamper) {
+    tamper.black_mean = j.value("black_mean", tamper.black_mean);
+    tamper.defocus_ratio = j.value("defocus_ratio", tamper.defocus_ratio);
+    tamper.occlusion_ratio = j.value("occlusion_ratio", tamper.occlusion_ratio);
+    tamper.min_seconds = j.value("min_seconds", tamper.min_seconds);
+}
+
+json tamperToJson(const TamperConfig& tamper) {
+    return {{"black_mean", tamper.black_mean}, {"defocus_ratio", tamper.defocus_ratio},
+            {"occlusion_ratio", tamper.occlusion_ratio}, {"min_seconds", tamper.min_seconds}};
+}
+
+// 从JSON读取配置项，缺省项保持当前值
+void applyConfigJson(const json& j) {
+    if (j.contains("rtsp_url1")) config.rtsp_url1 = j["rtsp_url1"];
+    if (j.contains("rtsp_url2")) config.rtsp_url2 = j["rtsp_url2"];
+    if (j.contains("save_path1")) config.save_path1 = j["save_path1"];
+    if (j.contains("save_path2")) config.save_path2 = j["save_path2"];
+    if (j.contains("segment_time")) config.segment_time = j["segment_time"];
+    if (j.contains("dual_stream_enabled")) config.dual_stream_enabled = j["dual_stream_enabled"];
+    if (j.contains("record_mode1")) config.record_mode1 = j["record_mode1"];
+    if (j.contains("record_mode2")) config.record_mode2 = j["record_mode2"];
+    if (j.contains("loop_buffer_path")) config.loop_buffer_path = j["loop_buffer_path"];
+    if (j.contains("loop_buffer_minutes")) config.loop_buffer_minutes = j["loop_buffer_minutes"];
+    if (j.contains("pre_roll_seconds")) config.pre_roll_seconds = j["pre_roll_seconds"];
+    if (j.contains("post_roll_seconds")) config.post_roll_seconds = j["post_roll_seconds"];
+    if (j.contains("event_buffer_enabled")) config.event_buffer_enabled = j["event_buffer_enabled"];
+    if (j.contains("gpio_triggers")) {
+        config.gpio_triggers.clear();
+        for (const auto& t : j["gpio_triggers"]) {
+            config.gpio_triggers.push_back({t.value("path", ""), t.value("channel", 1), t.value("edge", "rising")});
+        }
+    }
+    if (j.contains("s3_endpoint")) config.s3_endpoint = j["s3_endpoint"];
+    if (j.contains("s3_bucket")) config.s3_bucket = j["s3_bucket"];
+    if (j.contains("s3_access_key")) config.s3_access_key = j["s3_access_key"];
+    // 未提供或为空时保留已保存的密钥，GET /api/config 不返回密钥，回传的配置里没有它
+    if (j.contains("s3_secret_key") && j["s3_secret_key"].is_string() &&
+        !j["s3_secret_key"].get<std::string>().empty()) {
+        config.s3_secret_key = j["s3_secret_key"];
+    }
+    if (j.contains("s3_region")) config.s3_region = j["s3_region"];
+    if (j.contains("s3_part_size_mb")) config.s3_part_size_mb = j["s3_part_size_mb"];
+    if (j.contains("s3_upload_workers")) config.s3_upload_workers = j["s3_upload_workers"];
+    if (j.contains("s3_part_concurrency")) config.s3_part_concurrency = j["s3_part_concurrency"];
+    if (j.contains("upload_policy1")) config.upload_policy1 = j["upload_policy1"];
+    if (j.contains("upload_policy2")) config.upload_policy2 = j["upload_policy2"];
+    if (j.contains("upload_bandwidth_kbps")) config.upload_bandwidth_kbps = j["upload_bandwidth_kbps"];
+    if (j.contains("upload_windows")) config.upload_windows = j["upload_windows"].get<std::vector<std::string>>();
+    if (j.contains("checksum_sha256")) config.checksum_sha256 = j["checksum_sha256"];
+    if (j.contains("fragmented_mp4")) config.fragmented_mp4 = j["fragmented_mp4"];
+    if (j.contains("stall_timeout_ms")) config.stall_timeout_ms = j["stall_timeout_ms"];
+    if (j.contains("freeze_threshold_seconds")) config.freeze_threshold_seconds = j["freeze_threshold_seconds"];
+    if (j.contains("keyframe_analysis")) config.keyframe_analysis = j["keyframe_analysis"];
+    if (j.contains("tamper1")) tamperFromJson(j["tamper1"], config.tamper1);
+    if (j.contains("tamper2")) tamperFromJson(j["tamper2"], config.tamper2);
+    if (j.contains("audio_analysis")) config.audio_analysis = j["audio_analysis"];
+    if (j.contains("audio_threshold_db")) config.audio_threshold_db = j["audio_threshold_db"];
+    if (j.contains("audio_policy1")) config.audio_policy1 = j["audio_policy1"];
+    if (j.contains("audio_policy2")) config.audio_policy2 = j["audio_policy2"];
+    if (j.contains("emergency_free_mb")) config.emergency_free_mb = j["emergency_free_mb"];
+    if (j.contains("emergency_latency_ms")) config.emergency_latency_ms = j["emergency_latency_ms"];
+}
+
+json configToJson() {
+    json j;
+    j["rtsp_url1"] = config.rtsp_url1;
+    j["rtsp_url2"] = config.rtsp_url2;
+    j["save_path1"] = config.save_path1;
+    j["save_path2"] = config.save_path2;
+    j["segment_time"] = config.segment_time;
+    j["dual_stream_enabled"] = config.dual_stream_enabled;
+    j["record_mode1"] = config.record_mode1;
+    j["record_mode2"] = config.record_mode2;
+    j["loop_buffer_path"] = config.loop_buffer_path;
+    j["loop_buffer_minutes"] = config.loop_buffer_minutes;
+    j["pre_roll_seconds"] = config.pre_roll_seconds;
+    j["post_roll_seconds"] = config.post_roll_seconds;
+    j["event_buffer_enabled"] = config.event_buffer_enabled;
+    j["gpio_triggers"] = json::array();
+    for (const auto& t : config.gpio_triggers) {
+        j["gpio_triggers"].push_back({{"path", t.path}, {"channel", t.channel}, {"edge", t.edge}});
+    }
+    j["s3_endpoint"] = config.s3_endpoint;
+    j["s3_bucket"] = config.s3_bucket;
+    j["s3_access_key"] = config.s3_access_key;
+    j["s3_secret_key_set"] = !config.s3_secret_key.empty();
+    j["s3_region"] = config.s3_region;
+    j["s3_part_size_mb"] = config.s3_part_size_mb;
+    j["s3_upload_workers"] = config.s3_upload_workers;
+    j["s3_part_concurrency"] = config.s3_part_concurrency;
+    j["upload_policy1"] = config.upload_policy1;
+    j["upload_policy2"] = config.upload_policy2;
+    j["upload_bandwidth_kbps"] = config.upload_bandwidth_kbps;
+    j["upload_windows"] = config.upload_windows;
+    j["checksum_sha256"] = config.checksum_sha256;
+    j["fragmented_mp4"] = config.fragmented_mp4;
+    j["stall_timeout_ms"] = config.stall_timeout_ms;
+    j["freeze_threshold_seconds"] = config.freeze_threshold_seconds;
+    j["keyframe_analysis"] = config.keyframe_analysis;
+    j["tamper1"] = tamperToJson(config.tamper1);
+    j["tamper2"] = tamperToJson(config.tamper2);
+    j["audio_analysis"] = config.audio_analysis;
+    j["audio_threshold_db"] = config.audio_threshold_db;
+    j["audio_policy1"] = config.audio_policy1;
+    j["audio_policy2"] = config.audio_policy2;
+    j["emergency_free_mb"] = config.emergency_free_mb;
+    j["emergency_latency_ms"] = config.emergency_latency_ms;
+    return j;
+}
+
+// 密钥不写入 config.json，也不由 GET /api/config 返回：保存在程序目录下不纳入版本库的 secrets.json
+// （权限 0600），设置了环境变量 VRS_S3_SECRET_KEY 时以环境变量为准，且不写入文件。
+// 访问密钥同样可由 VRS_S3_ACCESS_KEY 提供，此时也不写入 config.json；post.py、upload_to_s3.py 读取同名变量
+const char* SECRETS_FILE = "secrets.json";
+const char* SECRET_KEY_ENV = "VRS_S3_SECRET_KEY";
+const char* ACCESS_KEY_ENV = "VRS_S3_ACCESS_KEY";
+
+void loadSecrets() {
+    std::ifstream file(SECRETS_FILE);
+    if (file.is_open()) {
+        try {
+            json j;
+            file >> j;
+            if (j.contains("s3_secret_key")) config.s3_secret_key = j["s3_secret_key"];
+        } catch (const std::exception& e) {
+            std::cerr << "密钥文件解析错误: " << e.what() << std::endl;
+        }
+    }
+    const char* secret = getenv(SECRET_KEY_ENV);
+    if (secret && *secret) config.s3_secret_key = secret;
+    const char* accessKey = getenv(ACCESS_KEY_ENV);
+    if (accessKey && *accessKey) config.s3_access_key = accessKey;
+}
+
+// 写出 config.json 和 secrets.json，调用者持有 configMutex
+void writeConfigFiles() {
+    json j = configToJson();
+    j.erase("s3_secret_key_set");
+    const char* accessKey = getenv(ACCESS_KEY_ENV);
+    if (accessKey && *accessKey) j.erase("s3_access_key");
+    std::ofstream file("config.json");
+    if (file.is_open()) {
+        file << j.dump(4);
+        file.close();
+    }
+
+    const char* secret = getenv(SECRET_KEY_ENV);
+    if ((secret && *secret) || config.s3_secret_key.empty()) return;
+    int fd = open(SECRETS_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        std::cerr << "无法写入密钥文件: " << strerror(errno) << std::endl;
+        return;
+    }
+    fchmod(fd, 0600);   // 文件已存在时 open 不修改权限
+    std::string content = json{{"s3_secret_key", config.s3_secret_key}}.dump(4);
+    if (write(fd, content.data(), content.size()) != (ssize_t)content.size()) {
+        std::cerr << "写入密钥文件失败: " << strerror(errno) << std::endl;
+    }
+    close(fd);
+}
+
 // 加载配置文件
 void loadConfig() {
     std::lock_guard<std::mutex> lock(configMutex);
+    config = RecordingConfig();
+    config.rtsp_url1 = "rtsp://192.168.1.63:554/media/video1";
+    config.rtsp_url2 = "rtsp://192.168.1.63:554/media/video2";
+    config.save_path1 = "/mnt/tfcard/videos1";
+    config.save_path2 = "/mnt/tfcard/videos2";
+    config.segment_time = 600;
+    config.dual_stream_enabled = true;
+
+    bool legacySecret = false;
     std::ifstream file("config.json");
     if (file.is_open()) {
         try {
             json j;
             file >> j;
-            config.rtsp_url1 = j.value("rtsp_url1", "rtsp://192.168.1.63:554/media/video1");
-            config.rtsp_url2 = j.value("rtsp_url2", "rtsp://192.168.1.63:554/media/video2");
-            config.save_path1 = j.value("save_path1", "/mnt/tfcard/videos1");
-            config.save_path2 = j.value("save_path2", "/mnt/tfcard/videos2");
-            config.segment_time = j.value("segment_time", 600);
-            config.dual_stream_enabled = j.value("dual_stream_enabled", true);
+            applyConfigJson(j);
+            legacySecret = j.contains("s3_secret_key");
             file.close();
         } catch (const std::exception& e) {
             std::cerr << "配置文件解析错误: " << e.what() << std::endl;
         }
-    } else {
-        config.rtsp_url1 = "rtsp://192.168.1.63:554/media/video1";
-        config.rtsp_url2 = "rtsp://192.168.1.63:554/media/video2";
-        config.save_path1 = "/mnt/tfcard/videos1";
-        config.save_path2 = "/mnt/tfcard/videos2";
-        config.segment_time = 600;
-        config.dual_stream_enabled = true;
     }
+    loadSecrets();
+    // 旧版本把密钥写在 config.json 中，移到 secrets.json
+    if (legacySecret) writeConfigFiles();
 }
 
 // 保存配置文件
 void saveConfig() {
     std::lock_guard<std::mutex> lock(configMutex);
-    json j;
-    j["rtsp_url1"] = config.rtsp_url1;
-    j["rtsp_url2"] = config.rtsp_url2;
-    j["save_path1"] = config.save_path1;
-    j["save_path2"] = config.save_path2;
-    j["segment_time"] = config.segment_time;
-    j["dual_stream_enabled"] = config.dual_stream_enabled;
-    
-    std::ofstream file("config.json");
-    if (file.is_open()) {
-        file << j.dump(4);
-        file.close();
-    }
+    writeConfigFiles();
 }
 
-// 前向声明
-void stopRecording();
+// 通道辅助函数，通道编号为 1 或 2
+std::string channelName(int channel) {
+    return "videos" + std::to_string(channel);
+}
 
-// 完全照搬 lintech 的 startRecording 函数
-void startRecording(const std::string &rtspStreamUrl = "", const std::string &saveLocation = "",
-                    const std::string &rtspStreamUrl2 = "", const std::string &saveLocation2 = "")
-{
-    loadConfig();
-    
-    // 使用 config 中的值作为实际参数
-    std::string actualRtspStreamUrl = rtspStreamUrl.empty() ? config.rtsp_url1 : rtspStreamUrl;
-    std::string actualSaveLocation = saveLocation.empty() ? config.save_path1 : saveLocation;
-    std::string actualRtspStreamUrl2 = rtspStreamUrl2.empty() ? config.rtsp_url2 : rtspStreamUrl2;
-    std::string actualSaveLocation2 = saveLocation2.empty() ? config.save_path2 : saveLocation2;
-    int segmentTime = config.segment_time;
+std::string channelRtspUrl(int channel) {
+    return channel == 2 ? config.rtsp_url2 : config.rtsp_url1;
+}
 
-    // 创建保存目录
-    std::string mkdirCmd1 = "sudo mkdir -p " + actualSaveLocation;
-    system(mkdirCmd1.c_str());
-    
-    // 如果启用双路录制，创建第二路的保存目录
-    if (config.dual_stream_enabled) {
-        std::string mkdirCmd2 = "sudo mkdir -p " + actualSaveLocation2;
-        system(mkdirCmd2.c_str());
-    }
+std::string channelSavePath(int channel) {
+    return channel == 2 ? config.save_path2 : config.save_path1;
+}
 
-    // 生成文件名相关逻辑
-    std::string fileNameFormat = "%Y-%m-%d_%H-%M-%S.mp4";
-    std::string fileNameFormat2 = "%Y-%m-%d_%H-%M-%S.mp4";
+std::string channelRecordMode(int channel) {
+    return channel == 2 ? config.record_mode2 : config.record_mode1;
+}
 
-    // 构建第一路ffmpeg命令字符串
-    std::string ffmpegCommand = "sudo ffmpeg -rtsp_transport tcp -i " + actualRtspStreamUrl + " -c:v copy -c:a aac -strict experimental -f segment -segment_time " + std::to_string(segmentTime) + " -reset_timestamps 1 -strftime 1 -segment_format mp4 " + actualSaveLocation + "/%Y-%m-%d_%H-%M-%S.mp4 2>/tmp/ffmpeg1.log";
-    std::cout << "第一路 ffmpeg command: " << ffmpegCommand << std::endl;
-    
-    // 如果启用双路录制，构建第二路视频流的ffmpeg命令字符串
-    std::string ffmpegCommand2;
-    if (config.dual_stream_enabled) {
-        ffmpegCommand2 = "sudo ffmpeg -rtsp_transport tcp -i " + actualRtspStreamUrl2 + " -c:v copy -c:a aac -strict experimental -f segment -segment_time " + std::to_string(segmentTime) + " -reset_timestamps 1 -strftime 1 -segment_format mp4 " + actualSaveLocation2 + "/%Y-%m-%d_%H-%M-%S.mp4 2>/tmp/ffmpeg2.log";
-        std::cout << "第二路 ffmpeg command: " << ffmpegCommand2 << std::endl;
-    } else {
-        std::cout << "双路录制已禁用，只录制第一路视频流" << std::endl;
+std::string channelUploadPolicy(int channel) {
+    return channel == 2 ? config.upload_policy2 : config.upload_policy1;
+}
+
+std::string channelAudioPolicy(int channel) {
+    return channel == 2 ? config.audio_policy2 : config.audio_policy1;
+}
+
+TamperConfig channelTamper(int channel) {
+    return channel == 2 ? config.tamper2 : config.tamper1;
+}
+
+// 解析 "1"/"2"/"videos1"/"videos2"，非法时返回 0
+int parseChannel(const std::string& value) {
+    if (value == "1" || value == "videos1") return 1;
+    if (value == "2" || value == "videos2") return 2;
+    return 0;
+}
+
+// 解析十进制整数参数，有多余字符或溢出时返回 false
+bool parseIntParam(const std::string& value, int64_t& out) {
+    if (value.empty()) return false;
+    char* end;
+    errno = 0;
+    long long parsed = strtoll(value.c_str(), &end, 10);
+    if (*end != '\0' || errno == ERANGE) return false;
+    out = parsed;
+    return true;
+}
+
+// 前向声明（定义见分段目录部分）
+void catalogRecordSegment(int channel, const std::string& name, long long size, std::time_t modifyTime);
+void autoUploadSegment(int channel, const std::string& name, bool isEvent, std::time_t modifyTime);
+void queueSegmentChecksum(int channel, const std::string& name);
+void queueSegmentAnalysis(int channel, const std::string& name);
+bool recorderSegmentBytes(int channel, std::string& name, int64_t& bytes);
+bool segmentWriting(int channel, const std::string& name);
+void catalogOpenSegment(int channel, const std::string& name);
+void publishSegmentEvent(const std::string& type, int channel, const std::string& name, int64_t size, double duration);
+
+// ==================== 事件录制与内存循环缓存 ====================
+// 循环缓存由录制进程把 mpegts 小分片循环写入 tmpfs：loop 模式下这是唯一输出，TF卡上不产生写入；
+// continuous 模式开启 event_buffer_enabled 后通过 tee 同时写入分段文件和缓存。
+// 触发后把预录和后录范围内的分片按字节拼接，再无损封装成 mp4 落盘，并记入事件索引。
+const int LOOP_CHUNK_SECONDS = 2;
+
+struct EventTrigger {
+    std::time_t time;
+    std::string source;  // api / gpio:<path> / 检测器名称
+    std::string note;
+};
+
+struct EventClip {
+    uint64_t id = 0;
+    int channel = 0;
+    std::time_t start = 0;        // 预录起点
+    std::time_t end = 0;          // 后录终点，重复触发时向后延长
+    std::vector<EventTrigger> triggers;
+    std::string fileName;
+    long long size = 0;
+    std::string status;           // recording / saved / failed
+};
+
+struct EventChannelState {
+    bool open = false;
+    EventClip clip;
+    std::vector<EventTrigger> overflow;  // 超出缓存容量的触发，顺延到下一个片段
+    std::time_t lastFlushEnd = 0;        // 上一次落盘的终点，避免新片段与之重叠
+};
+
+std::mutex eventMutex;
+EventChannelState eventState[3];
+std::vector<EventClip> eventIndex;   // 已落盘的事件片段，按 id 递增
+uint64_t nextEventId = 1;
+
+bool channelHasEventBuffer(int channel) {
+    return channelRecordMode(channel) == "loop" || config.event_buffer_enabled;
+}
+
+std::string loopRingDir(int channel) {
+    return config.loop_buffer_path + "/ch" + std::to_string(channel);
+}
+
+// 环形分片数量：覆盖配置的缓存时长，并额外留出落盘拷贝期间的余量
+int loopRingWrap() {
+    int minutes = std::max(1, config.loop_buffer_minutes);
+    return minutes * 60 / LOOP_CHUNK_SECONDS + 4;
+}
+
+// 单个事件片段的最大时长，超过后缓存中最早的分片会在落盘前被覆盖
+int maxEventSeconds() {
+    return (loopRingWrap() - 4) * LOOP_CHUNK_SECONDS - LOOP_CHUNK_SECONDS * 2;
+}
+
+std::string eventIndexPath(int channel) {
+    return channelSavePath(channel) + "/events.jsonl";
+}
+
+json eventToJson(const EventClip& clip) {
+    json j;
+    j["id"] = clip.id;
+    j["channel"] = clip.channel;
+    j["start"] = clip.start;
+    j["end"] = clip.end;
+    j["fileName"] = clip.fileName;
+    j["relativePath"] = clip.fileName.empty() ? "" : channelName(clip.channel) + "/" + clip.fileName;
+    j["size"] = clip.size;
+    j["status"] = clip.status;
+    j["triggers"] = json::array();
+    for (const auto& trigger : clip.triggers) {
+        json t;
+        t["time"] = trigger.time;
+        t["source"] = trigger.source;
+        t["note"] = trigger.note;
+        j["triggers"].push_back(t);
     }
+    return j;
+}
 
-    // 创建第一路录制线程
-    std::thread ffmpegThread([ffmpegCommand]() {
-        // 启动ffmpeg进程并获取PID
-        int result = system(ffmpegCommand.c_str());
-        
-        // 尝试获取ffmpeg进程PID并写入文件
-        std::string pidCmd = "pgrep -f 'ffmpeg.*" + config.rtsp_url1 + "' | head -1";
-        FILE* pipe = popen(pidCmd.c_str(), "r");
-        if (pipe) {
-            char buffer[128];
-            if (fgets(buffer, sizeof(buffer), pipe) != nullptr) {
-                std::string pidStr = buffer;
-                pidStr.erase(pidStr.find_last_not_of(" \n\r\t")+1);
-                std::ofstream pidFile("/tmp/recording1.pid");
-                if (pidFile.is_open()) {
-                    pidFile << pidStr;
-                    pidFile.close();
-                }
-            }
-            pclose(pipe);
+EventClip eventFromJson(const json& j) {
+    EventClip clip;
+    clip.id = j.value("id", 0ULL);
+    clip.channel = j.value("channel", 0);
+    clip.start = j.value("start", 0LL);
+    clip.end = j.value("end", 0LL);
+    clip.fileName = j.value("fileName", "");
+    clip.size = j.value("size", 0LL);
+    clip.status = j.value("status", "saved");
+    if (j.contains("triggers")) {
+        for (const auto& t : j["triggers"]) {
+            clip.triggers.push_back({t.value("time", 0LL), t.value("source", ""), t.value("note", "")});
         }
-        
-        if (result == -1) {
-            std::cerr << "Error starting ffmpeg process." << std::endl;
+    }
+    return clip;
+}
+
+// 启动时加载两路的事件索引
+void loadEventIndex() {
+    std::lock_guard<std::mutex> lock(eventMutex);
+    eventIndex.clear();
+    for (int channel = 1; channel <= 2; channel++) {
+        std::ifstream file(eventIndexPath(channel));
+        std::string line;
+        while (std::getline(file, line)) {
+            if (line.empty()) continue;
+            try {
+                EventClip clip = eventFromJson(json::parse(line));
+                clip.channel = channel;
+                nextEventId = std::max(nextEventId, clip.id + 1);
+                eventIndex.push_back(clip);
+            } catch (const std::exception& e) {
+                std::cerr << "事件索引解析错误: " << e.what() << std::endl;
+            }
         }
-        recording1.store(false);
+    }
+    std::sort(eventIndex.begin(), eventIndex.end(), [](const EventClip& a, const EventClip& b) {
+        return a.id < b.id;
     });
+    std::cout << "已加载 " << eventIndex.size() << " 条事件记录" << std::endl;
+}
 
-    // 立即设置第一路录制标志位
-    recording1.store(true);
-    
-    // 如果启用双路录制，创建第二路录制线程
-    if (config.dual_stream_enabled) {
-        std::thread ffmpegThread2([ffmpegCommand2]() {
-            // 启动ffmpeg进程并获取PID
-            int result2 = system(ffmpegCommand2.c_str());
-            
-            // 尝试获取ffmpeg进程PID并写入文件
-            std::string pidCmd = "pgrep -f 'ffmpeg.*" + config.rtsp_url2 + "' | head -1";
-            FILE* pipe = popen(pidCmd.c_str(), "r");
-            if (pipe) {
-                char buffer[128];
-                if (fgets(buffer, sizeof(buffer), pipe) != nullptr) {
-                    std::string pidStr = buffer;
-                    pidStr.erase(pidStr.find_last_not_of(" \n\r\t")+1);
-                    std::ofstream pidFile("/tmp/recording2.pid");
-                    if (pidFile.is_open()) {
-                        pidFile << pidStr;
-                        pidFile.close();
-                    }
-                }
-                pclose(pipe);
-            }
-            
-            if (result2 == -1) {
-                std::cerr << "Error starting ffmpeg process for stream 2." << std::endl;
-            }
-            recording2.store(false);
-        });
+void appendEventIndex(const EventClip& clip) {
+    std::ofstream file(eventIndexPath(clip.channel), std::ios::app);
+    if (file.is_open()) {
+        file << eventToJson(clip).dump() << "\n";
+    }
+}
 
-        // 立即设置第二路录制标志位
-        recording2.store(true);
+#ifndef EXFAT_SUPER_MAGIC
+#define EXFAT_SUPER_MAGIC 0x2011BAB0   // 较旧的内核头文件没有定义
+#endif
 
-        // 分离第二路线程，让它在后台运行
-        ffmpegThread2.detach();
-        
-        std::cout << "双路录制线程已启动并分离" << std::endl;
-    } else {
-        // 如果禁用双路录制，确保第二路标志位为false
-        recording2.store(false);
-        
-        std::cout << "单路录制线程已启动并分离" << std::endl;
+// 把参数包在单引号里交给 sh，路径来自可由 /api/config 修改的配置，不能直接拼进命令
+std::string shellQuote(const std::string& value) {
+    std::string quoted = "'";
+    for (char c : value) {
+        if (c == '\'') quoted += "'\\''";
+        else quoted += c;
     }
-    
-    // 分离第一路线程，让它在后台运行
-    ffmpegThread.detach();
+    return quoted + "'";
 }
 
-// 完全照搬 lintech 的 stopRecording 函数
-void stopRecording()
-{
-    std::cout << "准备停止录制..." << std::endl;
-    // Kill ffmpeg processes using pkill
-    system("pkill -f ffmpeg");
+// 创建保存目录。通常经 start.sh 以 root 运行，无需其他处理；以普通用户运行时，录制进程经 sudo 写出的文件属于 root，
+// 删除文件只需要目录的写权限，所以把目录交给本服务的用户。vfat/exfat 没有 Unix 属主（TF卡按 uid/dmask 挂载，
+// 本来就可写），chown 只会以 EPERM 失败，直接跳过
+void ensureServiceDirectory(const std::string& dirPath) {
+    std::string mkdirCmd = "sudo mkdir -p " + shellQuote(dirPath);
+    system(mkdirCmd.c_str());
+    if (geteuid() == 0) return;
+    struct statfs fs;
+    if (statfs(dirPath.c_str(), &fs) != 0) return;
+    if (fs.f_type == MSDOS_SUPER_MAGIC || fs.f_type == EXFAT_SUPER_MAGIC) return;
+    std::string chownCmd = "sudo chown " + std::to_string(geteuid()) + ":" + std::to_string(getegid()) + " " +
+                           shellQuote(dirPath);
+    system(chownCmd.c_str());
+}
 
-    // 清理PID文件
-    remove("/tmp/recording1.pid");
-    remove("/tmp/recording2.pid");
+// 清空并创建通道的循环缓存目录
+void prepareLoopRing(int channel) {
+    std::string dirPath = loopRingDir(channel);
+    ensureServiceDirectory(dirPath);
 
-    recording1.store(false);
-    recording2.store(false);
-    std::cout << "所有FFmpeg进程已停止，PID文件已清理。" << std::endl;
+    DIR* dir = opendir(dirPath.c_str());
+    if (dir) {
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != nullptr) {
+            std::string name = entry->d_name;
+            if (name.find(".ts") != std::string::npos) {
+                unlink((dirPath + "/" + name).c_str());
+            }
+        }
+        closedir(dir);
+    }
 }
 
-// 文件信息结构体
-struct FileInfo {
-    std::string name;
-    std::string fullPath;
-    std::string relativePath;
-    long long size;
-    std::time_t modifyTime;
-    std::string sizeStr;
-    std::string timeStr;
-    std::string channel;
-    bool isRecording;
-    std::string recordingDuration; // 新增：录制时长
+struct LoopChunk {
+    std::string path;
+    std::time_t mtime;
+    long mtimeNsec;
 };
 
-// 格式化文件大小
-std::string formatFileSize(long long bytes) {
-    const char* units[] = {"B", "KB", "MB", "GB", "TB"};
-    int unit = 0;
-    double size = bytes;
-    
-    while (size >= 1024 && unit < 4) {
-        size /= 1024;
-        unit++;
+// 把事件片段 [start, end] 范围内的环形分片落盘为 mp4，成功时填写文件名和大小
+bool flushEventClip(EventClip& clip) {
+    int channel = clip.channel;
+    std::string dirPath = loopRingDir(channel);
+    std::vector<LoopChunk> chunks;
+
+    DIR* dir = opendir(dirPath.c_str());
+    if (!dir) {
+        std::cerr << "循环缓存目录不存在: " << dirPath << std::endl;
+        return false;
     }
-    
-    char buffer[64];
-    if (unit == 0) {
-        snprintf(buffer, sizeof(buffer), "%lld %s", bytes, units[unit]);
-    } else {
-        snprintf(buffer, sizeof(buffer), "%.2f %s", size, units[unit]);
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        std::string name = entry->d_name;
+        if (name.compare(0, 5, "ring_") != 0) continue;
+        LoopChunk chunk;
+        chunk.path = dirPath + "/" + name;
+        struct stat st;
+        if (stat(chunk.path.c_str(), &st) != 0) continue;
+        chunk.mtime = st.st_mtim.tv_sec;
+        chunk.mtimeNsec = st.st_mtim.tv_nsec;
+        // 分片的 mtime 即其结束时间，覆盖约 [mtime - LOOP_CHUNK_SECONDS, mtime]
+        if (chunk.mtime >= clip.start && chunk.mtime <= clip.end + LOOP_CHUNK_SECONDS) {
+            chunks.push_back(chunk);
+        }
     }
-    return std::string(buffer);
-}
+    closedir(dir);
 
-// 格式化时间
-std::string formatTime(std::time_t time) {
-    char buffer[64];
-    std::strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", std::localtime(&time));
-    return std::string(buffer);
+    if (chunks.empty()) {
+        std::cerr << "通道" << channel << " 循环缓存中没有可落盘的分片" << std::endl;
+        return false;
+    }
+    std::sort(chunks.begin(), chunks.end(), [](const LoopChunk& a, const LoopChunk& b) {
+        return a.mtime != b.mtime ? a.mtime < b.mtime : a.mtimeNsec < b.mtimeNsec;
+    });
+
+    // 先在内存中拼接出暂存文件，避免转封装期间分片被环形覆盖
+    std::string staging = config.loop_buffer_path + "/flush_ch" + std::to_string(channel) + ".ts";
+    FILE* out = fopen(staging.c_str(), "wb");
+    if (!out) {
+        std::cerr << "无法创建暂存文件: " << staging << std::endl;
+        return false;
+    }
+    std::vector<char> buffer(1 << 16);
+    for (const auto& chunk : chunks) {
+        FILE* in = fopen(chunk.path.c_str(), "rb");
+        if (!in) continue;
+        size_t n;
+        while ((n = fread(buffer.data(), 1, buffer.size(), in)) > 0) {
+            fwrite(buffer.data(), 1, n, out);
+        }
+        fclose(in);
+    }
+    fclose(out);
+
+    // loop 模式下片段就是该通道的普通分段；continuous 模式加 event_ 前缀以区分同时段的连续分段
+    char nameBuf[64];
+    std::time_t firstChunkStart = std::max(clip.start, chunks.front().mtime - LOOP_CHUNK_SECONDS);
+    std::strftime(nameBuf, sizeof(nameBuf), "%Y-%m-%d_%H-%M-%S.mp4", std::localtime(&firstChunkStart));
+    std::string fileName = channelRecordMode(channel) == "loop" ? nameBuf : std::string("event_") + nameBuf;
+    std::string outputPath = channelSavePath(channel) + "/" + fileName;
+
+    std::string remuxCmd = "sudo ffmpeg -y -loglevel error -i " + staging +
+                           " -c copy -bsf:a aac_adtstoasc -movflags +faststart " + outputPath + " 2>&1";
+    CommandResult result = executeCommandWithStatus(remuxCmd);
+    unlink(staging.c_str());
+
+    if (result.exit_status != 0) {
+        std::cerr << "通道" << channel << " 事件片段落盘失败: " << result.output << std::endl;
+        return false;
+    }
+
+    struct stat st;
+    clip.fileName = fileName;
+    clip.size = stat(outputPath.c_str(), &st) == 0 ? st.st_size : 0;
+    catalogRecordSegment(channel, fileName, clip.size, std::time(nullptr));
+    std::cout << "通道" << channel << " 事件片段已落盘: " << outputPath
+              << " (" << chunks.size() << " 个分片, " << clip.triggers.size() << " 次触发)" << std::endl;
+    return true;
 }
 
-// 获取详细的文件列表
-std::vector<FileInfo> getVideoFilesDetailed() {
-    std::vector<FileInfo> files;
-    
-    auto addFiles = [&](const std::string& path, const std::string& channel) {
-        DIR* dir = opendir(path.c_str());
-        if (dir) {
-            struct dirent* entry;
-            while ((entry = readdir(dir)) != nullptr) {
-                std::string filename = entry->d_name;
-                if (filename.find(".mp4") != std::string::npos) {
-                    FileInfo fileInfo;
-                    fileInfo.name = filename;
-                    fileInfo.fullPath = path + "/" + filename;
-                    fileInfo.relativePath = channel + "/" + filename;
-                    fileInfo.channel = channel;
-                    
-                    struct stat fileStat;
-                    if (stat(fileInfo.fullPath.c_str(), &fileStat) == 0) {
-                        fileInfo.size = fileStat.st_size;
-                        fileInfo.modifyTime = fileStat.st_mtime;
-                        fileInfo.sizeStr = formatFileSize(fileStat.st_size);
-                        fileInfo.timeStr = formatTime(fileStat.st_mtime);
-                        
-                        // 检查文件是否正在被写入 (缩短判断阈值提高敏感度)
-                        std::time_t now = std::time(nullptr);
-                        fileInfo.isRecording = (now - fileStat.st_mtime) < 5;
-                        
-                        files.push_back(fileInfo);
-                    }
+// 等待后录结束后执行落盘；期间的重复触发会延长终点，超出缓存容量的触发顺延成下一个片段
+void runEventFlush(int channel) {
+    while (true) {
+        EventClip clip;
+        bool ready = false;
+        bool more = false;
+        {
+            std::lock_guard<std::mutex> lock(eventMutex);
+            EventChannelState& state = eventState[channel];
+            // 多等两个分片时长，确保覆盖终点的分片已经关闭
+            if (std::time(nullptr) >= state.clip.end + LOOP_CHUNK_SECONDS * 2) {
+                ready = true;
+                clip = state.clip;
+                state.lastFlushEnd = clip.end;
+                if (!state.overflow.empty()) {
+                    EventClip next;
+                    next.id = nextEventId++;
+                    next.channel = channel;
+                    next.start = clip.end;
+                    next.triggers = state.overflow;
+                    next.end = std::min(next.start + maxEventSeconds(),
+                                        state.overflow.back().time + config.post_roll_seconds);
+                    next.status = "recording";
+                    state.clip = next;
+                    state.overflow.clear();
+                    more = true;
+                } else {
+                    state.open = false;
                 }
             }
-            closedir(dir);
         }
-    };
-    
-    addFiles(config.save_path1, "videos1");
-    addFiles(config.save_path2, "videos2");
-    
-    // 按修改时间排序
-    std::sort(files.begin(), files.end(), [](const FileInfo& a, const FileInfo& b) {
-        return a.modifyTime > b.modifyTime;
-    });
-    
-    return files;
-}
 
-// 获取ffmpeg进程的运行时间
-std::string getFfmpegRunningTime(const std::string& rtspUrl) {
-    // 使用ps命令获取ffmpeg进程信息
-    std::string psCommand = "ps -eo pid,etime,cmd | grep 'ffmpeg.*" + rtspUrl + "' | grep -v grep | head -1";
-    std::string output = executeCommand(psCommand);
-    
-    if (!output.empty()) {
-        std::istringstream iss(output);
-        std::string pid, etime, cmd;
-        iss >> pid >> etime;
-        
-        // etime格式可能是 MM:SS 或 HH:MM:SS 或 DD-HH:MM:SS
-        return etime;
+        if (ready) {
+            clip.status = flushEventClip(clip) ? "saved" : "failed";
+            std::lock_guard<std::mutex> lock(eventMutex);
+            eventIndex.push_back(clip);
+            appendEventIndex(clip);
+            if (!more) return;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
     }
-    
-    return "00:00:00";
 }
 
-// 将etime格式转换为标准格式
-std::string formatElapsedTime(const std::string& etime) {
-    if (etime.empty() || etime == "00:00:00") {
-        return "00:00:00";
-    }
-    
-    // 处理不同的etime格式
-    if (etime.find('-') != std::string::npos) {
-        // 格式：DD-HH:MM:SS
-        size_t dashPos = etime.find('-');
-        std::string days = etime.substr(0, dashPos);
-        std::string timepart = etime.substr(dashPos + 1);
-        
-        // 转换天数为小时并加到时间部分
-        int dayCount = std::stoi(days);
-        size_t colonPos = timepart.find(':');
-        int hours = std::stoi(timepart.substr(0, colonPos)) + dayCount * 24;
-        
-        return std::to_string(hours) + timepart.substr(colonPos);
-    } else if (std::count(etime.begin(), etime.end(), ':') == 1) {
-        // 格式：MM:SS，需要补充小时
-        return "00:" + etime;
-    } else {
-        // 格式：HH:MM:SS，直接返回
-        return etime;
+// 触发通道事件：首次触发打开事件片段，已有片段时延长后录。返回事件 id，失败返回 0
+uint64_t triggerEvent(int channel, const std::string& source, const std::string& note, std::string& message) {
+    if (!channelHasEventBuffer(channel)) {
+        message = "通道" + std::to_string(channel) + " 未开启事件缓存 (loop 模式或 event_buffer_enabled)";
+        return 0;
+    }
+
+    std::time_t now = std::time(nullptr);
+    EventTrigger trigger{now, source, note};
+    std::lock_guard<std::mutex> lock(eventMutex);
+    EventChannelState& state = eventState[channel];
+    if (state.open) {
+        std::time_t cap = state.clip.start + maxEventSeconds();
+        if (now + config.post_roll_seconds > cap) {
+            state.clip.end = cap;
+            state.overflow.push_back(trigger);
+            message = "事件片段已达缓存上限，后续录像顺延到下一个片段";
+            return state.clip.id;
+        }
+        state.clip.end = std::max(state.clip.end, now + config.post_roll_seconds);
+        state.clip.triggers.push_back(trigger);
+        message = "后录已延长";
+        return state.clip.id;
+    }
+
+    state.open = true;
+    state.clip = EventClip();
+    state.clip.id = nextEventId++;
+    state.clip.channel = channel;
+    state.clip.start = std::max(now - config.pre_roll_seconds, state.lastFlushEnd);
+    state.clip.end = now + config.post_roll_seconds;
+    state.clip.triggers.push_back(trigger);
+    state.clip.status = "recording";
+    std::thread(runEventFlush, channel).detach();
+    message = "事件录制已触发";
+    return state.clip.id;
+}
+
+// 按 id 查找事件，包括仍在后录中的片段
+bool findEvent(uint64_t id, EventClip& out) {
+    std::lock_guard<std::mutex> lock(eventMutex);
+    for (int channel = 1; channel <= 2; channel++) {
+        if (eventState[channel].open && eventState[channel].clip.id == id) {
+            out = eventState[channel].clip;
+            return true;
+        }
+    }
+    auto it = std::lower_bound(eventIndex.begin(), eventIndex.end(), id,
+                               [](const EventClip& clip, uint64_t value) { return clip.id < value; });
+    if (it != eventIndex.end() && it->id == id) {
+        out = *it;
+        return true;
+    }
+    return false;
+}
+
+// ==================== GPIO 触发监视 ====================
+// sysfs GPIO (/sys/class/gpio/gpioN/value) 通过 poll(POLLPRI) 等待边沿中断；
+// 其他路径视为测试用的普通文件替身，每 200ms 读取一次并比较电平变化。
+std::string readGpioValue(int fd) {
+    char buf[8] = {0};
+    lseek(fd, 0, SEEK_SET);
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    return n > 0 ? std::string(1, buf[0]) : "";
+}
+
+void watchGpioTrigger(GpioTriggerConfig trigger) {
+    bool isSysfs = trigger.path.compare(0, 5, "/sys/") == 0;
+    if (isSysfs) {
+        std::string edgePath = trigger.path.substr(0, trigger.path.find_last_of('/')) + "/edge";
+        std::ofstream edgeFile(edgePath);
+        if (edgeFile.is_open()) {
+            edgeFile << (trigger.edge == "falling" ? "falling" : trigger.edge == "both" ? "both" : "rising");
+        }
+    }
+
+    int fd = open(trigger.path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "无法打开GPIO触发源: " << trigger.path << std::endl;
+        return;
+    }
+    std::cout << "GPIO触发监视已启动: " << trigger.path << " -> 通道" << trigger.channel << std::endl;
+
+    std::string last = readGpioValue(fd);
+    while (true) {
+        if (isSysfs) {
+            struct pollfd pfd = {fd, POLLPRI | POLLERR, 0};
+            if (poll(&pfd, 1, -1) < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+        } else {
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        }
+
+        std::string value = readGpioValue(fd);
+        if (value.empty() || value == last) continue;
+        bool rising = value == "1";
+        last = value;
+        if (trigger.edge == "both" || (trigger.edge == "falling") != rising) {
+            std::string message;
+            triggerEvent(trigger.channel, "gpio:" + trigger.path, "edge " + std::string(rising ? "rising" : "falling"), message);
+            std::cout << "GPIO触发 " << trigger.path << ": " << message << std::endl;
+        }
+    }
+    close(fd);
+}
+
+void startGpioWatchers() {
+    for (const auto& trigger : config.gpio_triggers) {
+        if (trigger.channel != 1 && trigger.channel != 2) continue;
+        std::thread(watchGpioTrigger, trigger).detach();
+    }
+}
+
+// 前向声明
+void stopRecording();
+bool channelKeyframeOnly(int channel);
+
+// ==================== 录制进程日志 ====================
+// 录制 ffmpeg 的 stderr 经管道逐行读入每路一个固定容量的环形缓冲区：内存占用有上限，
+// 重新开始录制也不会清空之前的记录。ffmpeg 以 -loglevel level+info 启动，每行带 [warning] 等级别前缀
+const size_t RECORDER_LOG_LINES = 1000;
+const size_t RECORDER_LOG_LINE_BYTES = 512;   // 超长的行截断
+
+enum LogSeverity : uint8_t { LOG_DEBUG = 0, LOG_INFO = 1, LOG_WARNING = 2, LOG_ERROR = 3, LOG_FATAL = 4 };
+const char* LOG_SEVERITY_NAMES[] = {"debug", "info", "warning", "error", "fatal"};
+
+struct RecorderLogLine {
+    int64_t time;
+    uint8_t severity;
+    std::string text;
+};
+
+struct RecorderLog {
+    std::vector<RecorderLogLine> lines;   // 写满后从头覆盖，next 为下一条的位置
+    size_t next = 0;
+    uint64_t total = 0;
+    uint64_t counts[5] = {};
+};
+
+std::mutex recorderLogMutex;
+RecorderLog recorderLogs[3];
+
+int parseLogSeverityName(const std::string& name) {
+    for (int level = LOG_DEBUG; level <= LOG_FATAL; level++) {
+        if (name == LOG_SEVERITY_NAMES[level]) return level;
+    }
+    return -1;
+}
+
+// 取出 "[rtsp @ 0x...] [warning] ..." 中的级别标记；没有标记的行按 info 处理
+uint8_t takeLogSeverity(std::string& text) {
+    static const std::pair<const char*, uint8_t> tags[] = {
+        {"[panic] ", LOG_FATAL}, {"[fatal] ", LOG_FATAL}, {"[error] ", LOG_ERROR}, {"[warning] ", LOG_WARNING},
+        {"[info] ", LOG_INFO}, {"[verbose] ", LOG_DEBUG}, {"[debug] ", LOG_DEBUG}, {"[trace] ", LOG_DEBUG}};
+    for (const auto& tag : tags) {
+        size_t pos = text.find(tag.first);
+        if (pos != std::string::npos && pos < 64) {
+            text.erase(pos, strlen(tag.first));
+            return tag.second;
+        }
+    }
+    return LOG_INFO;
+}
+
+void appendRecorderLog(int channel, uint8_t severity, const std::string& text) {
+    std::lock_guard<std::mutex> lock(recorderLogMutex);
+    RecorderLog& log = recorderLogs[channel];
+    RecorderLogLine line = {std::time(nullptr), severity, text};
+    if (log.lines.size() < RECORDER_LOG_LINES) {
+        log.lines.push_back(std::move(line));
+    } else {
+        log.lines[log.next] = std::move(line);
+    }
+    log.next = (log.next + 1) % RECORDER_LOG_LINES;
+    log.total++;
+    log.counts[severity]++;
+}
+
+// 最近 tail 条不低于 minSeverity 的日志，按时间顺序
+json recorderLogToJson(int channel, size_t tail, uint8_t minSeverity) {
+    std::lock_guard<std::mutex> lock(recorderLogMutex);
+    const RecorderLog& log = recorderLogs[channel];
+    std::vector<const RecorderLogLine*> selected;
+    size_t count = log.lines.size();
+    for (size_t i = 0; i < count && selected.size() < tail; i++) {
+        const RecorderLogLine& line = log.lines[(log.next + count - 1 - i) % count];
+        if (line.severity >= minSeverity) selected.push_back(&line);
+    }
+
+    json result;
+    result["channel"] = channelName(channel);
+    result["total"] = log.total;
+    result["dropped"] = log.total - count;   // 已被覆盖的条数
+    for (int level = LOG_INFO; level <= LOG_FATAL; level++) {
+        result["counts"][LOG_SEVERITY_NAMES[level]] = log.counts[level];
+    }
+    result["lines"] = json::array();
+    for (auto it = selected.rbegin(); it != selected.rend(); ++it) {
+        result["lines"].push_back({{"time", (*it)->time}, {"level", LOG_SEVERITY_NAMES[(*it)->severity]},
+                                   {"text", (*it)->text}});
+    }
+    return result;
+}
+
+// ==================== 检测告警 ====================
+// 各检测器 (画面冻结等) 的告警追加写入保存目录下的 detections.jsonl 并记入录制进程日志；
+// 通道开启事件缓存时，告警开始同时触发事件录制，把前后的画面单独保存
+struct Detection {
+    std::time_t time = 0;
+    int channel = 0;
+    std::string source;    // 检测器名称
+    std::string state;     // start / end
+    std::string note;
+    std::string segment;   // 由已关闭分段分析得出时为所在分段
+    uint64_t eventId = 0;  // 触发的事件片段，未开启事件缓存时为 0
+};
+
+std::mutex detectionMutex;
+
+std::string detectionLogPath(int channel) {
+    return channelSavePath(channel) + "/detections.jsonl";
+}
+
+json detectionToJson(const Detection& detection) {
+    json j;
+    j["time"] = detection.time;
+    j["channel"] = detection.channel;
+    j["source"] = detection.source;
+    j["state"] = detection.state;
+    j["note"] = detection.note;
+    if (!detection.segment.empty()) j["segment"] = detection.segment;
+    j["eventId"] = detection.eventId;
+    return j;
+}
+
+// time 为 0 表示实时检测，告警开始时触发事件录制；分析已关闭分段得出的告警带上发生时间和分段，
+// 画面已在分段中，不再触发
+void raiseDetection(int channel, const std::string& source, const std::string& state, const std::string& note,
+                    std::time_t time = 0, const std::string& segment = "") {
+    Detection detection;
+    detection.time = time != 0 ? time : std::time(nullptr);
+    detection.channel = channel;
+    detection.source = source;
+    detection.state = state;
+    detection.note = note;
+    detection.segment = segment;
+    if (state == "start" && time == 0) {
+        std::string message;
+        detection.eventId = triggerEvent(channel, source, note, message);
+    }
+    appendRecorderLog(channel, state == "start" ? LOG_WARNING : LOG_INFO, "[" + source + "] " + note);
+    std::cout << "通道" << channel << " [" << source << "] " << note << std::endl;
+
+    std::lock_guard<std::mutex> lock(detectionMutex);
+    std::ofstream file(detectionLogPath(channel), std::ios::app);
+    if (file.is_open()) {
+        file << detectionToJson(detection).dump() << "\n";
+    }
+}
+
+// 读取 [t0, t1) 内的告警记录；source 为空表示所有检测器，"tamper" 同时匹配 "tamper:black" 等
+json loadDetections(int channel, const std::string& source, int64_t t0, int64_t t1) {
+    json result = json::array();
+    std::lock_guard<std::mutex> lock(detectionMutex);
+    for (int ch = 1; ch <= 2; ch++) {
+        if (channel != 0 && ch != channel) continue;
+        std::ifstream file(detectionLogPath(ch));
+        std::string line;
+        while (std::getline(file, line)) {
+            if (line.empty()) continue;
+            try {
+                json j = json::parse(line);
+                int64_t time = j.value("time", 0LL);
+                if (time < t0 || time >= t1) continue;
+                std::string detectionSource = j.value("source", "");
+                if (!source.empty() && detectionSource != source && detectionSource.rfind(source + ":", 0) != 0) {
+                    continue;
+                }
+                result.push_back(j);
+            } catch (const std::exception& e) {
+                std::cerr << "告警记录解析错误: " << e.what() << std::endl;
+            }
+        }
+    }
+    // 分析已关闭分段得出的告警晚于发生时间写入
+    std::stable_sort(result.begin(), result.end(), [](const json& a, const json& b) {
+        return a.value("time", 0LL) < b.value("time", 0LL);
+    });
+    return result;
+}
+
+// ==================== 录制进程统计 ====================
+// ffmpeg 以 -progress pipe:1 启动，每 0.5 秒在 stdout 输出一组 key=value，以 progress=continue/end 结束。
+// 每路保留最近一分钟的样本，帧率、码率和丢帧数按窗口首尾之差计算。分段和 tee 输出没有总大小
+// (total_size=N/A)，写出字节数改由写入状态中当前分段的大小累加
+const size_t INGEST_WINDOW_SAMPLES = 120;
+
+struct IngestSample {
+    int64_t monoMs;
+    int64_t frame;
+    int64_t bytes;        // 累计写出字节数
+    int64_t outTimeUs;
+    int64_t dupFrames;
+    int64_t dropFrames;
+};
+
+struct IngestStats {
+    bool running = false;
+    int64_t startedAt = 0;
+    int64_t updatedAt = 0;
+    double fps = 0;        // ffmpeg 报告的瞬时值
+    double speed = 0;
+    IngestSample first;    // 本次启动的第一个样本，漂移以它为基准
+    std::deque<IngestSample> window;
+    std::map<std::string, std::string> pending;   // 正在接收的这一组 key=value
+    std::string segmentName;                      // 累计字节数用：上一个样本时的分段及其大小
+    int64_t segmentBytes = 0;
+    int64_t bytesBase = 0;
+};
+
+// 卡住检测：帧数、输出时间戳或写出字节数增加即为有进展。录制进程重启时保留，统计跨越多次启动
+const int STALL_CHECK_INTERVAL_MS = 200;
+const int STALL_STARTUP_GRACE_MS = 10000;   // 启动后建立 RTSP 连接的额外宽限
+const int STALL_KILL_GRACE_MS = 5000;       // SIGTERM 后这么久仍未退出则 SIGKILL
+const int STALL_HEALTHY_RESET_MS = 300000;  // 连续运行这么久后重启退避归零
+const int STALL_MAX_BACKOFF_SECONDS = 60;
+// 只录关键帧时进度每个 GOP 才推进一次：卡住判定时间取测得的最大关键帧间隔的两倍，测得之前至少 30 秒
+const int STALL_KEYFRAME_ONLY_MIN_MS = 30000;
+const size_t STALL_ADVANCE_GAPS = 8;
+const size_t STALL_HISTORY = 20;
+
+struct StallRecord {
+    int64_t start;        // 最后一次有进展的时间
+    int64_t durationMs;   // 到重启后的录制进程再次有进展为止
+};
+
+struct RecorderWatchdog {
+    pid_t pid = 0;                // 录制进程组，未运行时为 0
+    int64_t launchedMs = 0;
+    int64_t lastAdvanceMs = 0;
+    int64_t killDeadlineMs = 0;   // 已发送 SIGTERM，超过此时间发送 SIGKILL
+    bool restartRequested = false;
+    bool immediateRestart = false;  // 切换录制方式而非卡住，重启不退避
+    std::deque<int64_t> advanceGaps;   // 本次启动以来最近几次进展的间隔
+    int64_t gapStartMs = 0;       // 未结束的卡住缺口，0 表示没有
+    int consecutiveStalls = 0;
+    uint64_t stalls = 0;
+    uint64_t restarts = 0;
+    int64_t stalledMs = 0;        // 已结束的缺口总时长
+    std::deque<StallRecord> history;
+};
+
+std::mutex ingestMutex;
+IngestStats ingestStats[3];
+RecorderWatchdog watchdogs[3];
+
+int64_t monotonicMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void resetIngestStats(int channel, bool running) {
+    std::lock_guard<std::mutex> lock(ingestMutex);
+    IngestStats& stats = ingestStats[channel];
+    stats = IngestStats();
+    stats.running = running;
+    stats.startedAt = std::time(nullptr);
+}
+
+// 数值字段为 N/A 时沿用上一个样本的值
+int64_t progressValue(const std::map<std::string, std::string>& fields, const char* key, int64_t fallback) {
+    auto it = fields.find(key);
+    if (it == fields.end()) return fallback;
+    char* end;
+    long long value = strtoll(it->second.c_str(), &end, 10);
+    return end == it->second.c_str() ? fallback : value;
+}
+
+void handleProgressLine(int channel, const std::string& line) {
+    size_t eq = line.find('=');
+    if (eq == std::string::npos) return;
+    std::string key = line.substr(0, eq);
+    std::string value = line.substr(eq + 1);
+
+    std::string segmentName;
+    int64_t segmentBytes = 0;
+    bool haveSegment = key == "progress" && recorderSegmentBytes(channel, segmentName, segmentBytes);
+
+    std::lock_guard<std::mutex> lock(ingestMutex);
+    IngestStats& stats = ingestStats[channel];
+    if (key != "progress") {
+        stats.pending[key] = value;
+        return;
+    }
+    if (value == "end") stats.running = false;
+    if (stats.pending.empty()) return;
+
+    IngestSample last = stats.window.empty() ? IngestSample{0, 0, 0, 0, 0, 0} : stats.window.back();
+    IngestSample sample;
+    sample.monoMs = monotonicMs();
+    sample.frame = progressValue(stats.pending, "frame", last.frame);
+    sample.outTimeUs = progressValue(stats.pending, "out_time_us", last.outTimeUs);
+    sample.dupFrames = progressValue(stats.pending, "dup_frames", last.dupFrames);
+    sample.dropFrames = progressValue(stats.pending, "drop_frames", last.dropFrames);
+    sample.bytes = progressValue(stats.pending, "total_size", -1);
+    if (sample.bytes < 0 && haveSegment) {
+        // 分段切换时上一个分段最后一个样本之后写出的少量数据不计入
+        if (segmentName != stats.segmentName) {
+            stats.bytesBase += stats.segmentBytes;
+            stats.segmentName = segmentName;
+        }
+        stats.segmentBytes = segmentBytes;
+        sample.bytes = stats.bytesBase + stats.segmentBytes;
+    } else if (sample.bytes < 0) {
+        sample.bytes = last.bytes;
+    }
+    if (stats.pending.count("fps")) stats.fps = atof(stats.pending["fps"].c_str());
+    if (stats.pending.count("speed")) stats.speed = atof(stats.pending["speed"].c_str());   // "1.00x"
+    stats.pending.clear();
+
+    if (stats.window.empty() && stats.first.monoMs == 0) stats.first = sample;
+    RecorderWatchdog& watchdog = watchdogs[channel];
+    if (sample.frame > last.frame || sample.outTimeUs > last.outTimeUs || sample.bytes > last.bytes) {
+        if (sample.monoMs > watchdog.lastAdvanceMs) {
+            watchdog.advanceGaps.push_back(sample.monoMs - watchdog.lastAdvanceMs);
+            if (watchdog.advanceGaps.size() > STALL_ADVANCE_GAPS) watchdog.advanceGaps.pop_front();
+        }
+        watchdog.lastAdvanceMs = sample.monoMs;
+        if (watchdog.gapStartMs != 0) {
+            int64_t duration = sample.monoMs - watchdog.gapStartMs;
+            watchdog.stalledMs += duration;
+            watchdog.history.push_back({std::time(nullptr) - duration / 1000, duration});
+            if (watchdog.history.size() > STALL_HISTORY) watchdog.history.pop_front();
+            watchdog.gapStartMs = 0;
+        }
+    }
+    stats.window.push_back(sample);
+    if (stats.window.size() > INGEST_WINDOW_SAMPLES) stats.window.pop_front();
+    stats.updatedAt = std::time(nullptr);
+}
+
+json ingestStatsToJson(int channel) {
+    std::lock_guard<std::mutex> lock(ingestMutex);
+    const IngestStats& stats = ingestStats[channel];
+    json result;
+    result["running"] = stats.running;
+    result["startedAt"] = stats.startedAt;
+    result["updatedAt"] = stats.updatedAt;
+    if (stats.window.empty()) return result;
+
+    const IngestSample& oldest = stats.window.front();
+    const IngestSample& newest = stats.window.back();
+    double seconds = (newest.monoMs - oldest.monoMs) / 1000.0;
+    result["fps"] = stats.fps;
+    result["speed"] = stats.speed;
+    result["frames"] = newest.frame;
+    result["dupFrames"] = newest.dupFrames;
+    result["dropFrames"] = newest.dropFrames;
+    result["windowSeconds"] = seconds;
+    result["avgFps"] = seconds > 0 ? (newest.frame - oldest.frame) / seconds : 0.0;
+    result["bitrateKbps"] = seconds > 0 ? (newest.bytes - oldest.bytes) * 8 / seconds / 1000 : 0.0;
+    result["windowDupFrames"] = newest.dupFrames - oldest.dupFrames;
+    result["windowDropFrames"] = newest.dropFrames - oldest.dropFrames;
+    // 墙钟时间与输出时间戳推进量之差，持续增大说明摄像头送帧慢于实时
+    result["driftSeconds"] = ((newest.monoMs - stats.first.monoMs) * 1000 -
+                              (newest.outTimeUs - stats.first.outTimeUs)) / 1e6;
+    return result;
+}
+
+// 从 fd 读出当前可用的数据并按行回调；\r 与 \n 一样作为行尾，超长的行截断。读到末尾时返回 false
+bool readPipeLines(int fd, std::string& pending, const std::function<void(std::string&)>& onLine) {
+    char buffer[4096];
+    ssize_t n = read(fd, buffer, sizeof(buffer));
+    if (n < 0) return errno == EINTR || errno == EAGAIN;
+    for (ssize_t i = 0; i < n; i++) {
+        if (buffer[i] != '\n' && buffer[i] != '\r') {
+            if (pending.size() < RECORDER_LOG_LINE_BYTES) pending += buffer[i];
+            continue;
+        }
+        if (!pending.empty()) {
+            onLine(pending);
+            pending.clear();
+        }
+    }
+    if (n == 0 && !pending.empty()) {
+        onLine(pending);
+        pending.clear();
+    }
+    return n > 0;
+}
+
+// 以 sh -c 执行录制命令，stderr 经管道写入该通道的日志，stdout 为 -progress 输出，返回值与 system() 相同
+int runRecorder(int channel, const std::string& command) {
+    int errFds[2], progressFds[2];
+    if (pipe2(errFds, O_CLOEXEC) != 0) return -1;
+    if (pipe2(progressFds, O_CLOEXEC) != 0) {
+        close(errFds[0]);
+        close(errFds[1]);
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        // 独立的进程组，看门狗只结束这一路；sudo 会关闭 2 以上的描述符，进度只能走 stdout
+        setpgid(0, 0);
+        dup2(progressFds[1], STDOUT_FILENO);
+        dup2(errFds[1], STDERR_FILENO);
+        execl("/bin/sh", "sh", "-c", command.c_str(), (char*)nullptr);
+        _exit(127);
+    }
+    close(errFds[1]);
+    close(progressFds[1]);
+    if (pid < 0) {
+        close(errFds[0]);
+        close(progressFds[0]);
+        return -1;
+    }
+    appendRecorderLog(channel, LOG_INFO, "录制进程已启动");
+    std::ofstream("/tmp/recording" + std::to_string(channel) + ".pid") << pid;
+    resetIngestStats(channel, true);
+    {
+        std::lock_guard<std::mutex> lock(ingestMutex);
+        RecorderWatchdog& watchdog = watchdogs[channel];
+        watchdog.pid = pid;
+        watchdog.launchedMs = monotonicMs();
+        watchdog.lastAdvanceMs = watchdog.launchedMs + STALL_STARTUP_GRACE_MS;
+        watchdog.killDeadlineMs = 0;
+        watchdog.advanceGaps.clear();
+    }
+
+    std::function<void(std::string&)> onLine[2] = {
+        [channel](std::string& line) {
+            uint8_t severity = takeLogSeverity(line);
+            appendRecorderLog(channel, severity, line);
+        },
+        [channel](std::string& line) { handleProgressLine(channel, line); }};
+    struct pollfd pfds[2] = {{errFds[0], POLLIN, 0}, {progressFds[0], POLLIN, 0}};
+    std::string pending[2];
+    while (pfds[0].fd >= 0 || pfds[1].fd >= 0) {
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (pfds[i].fd < 0 || !(pfds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            if (!readPipeLines(pfds[i].fd, pending[i], onLine[i])) {
+                close(pfds[i].fd);
+                pfds[i].fd = -1;   // poll 忽略负的描述符
+            }
+        }
+    }
+    for (auto& pfd : pfds) {
+        if (pfd.fd >= 0) close(pfd.fd);
+    }
+
+    int status = 0;
+    pid_t waited;
+    while ((waited = waitpid(pid, &status, 0)) < 0 && errno == EINTR) {
+    }
+    {
+        std::lock_guard<std::mutex> lock(ingestMutex);
+        ingestStats[channel].running = false;
+        watchdogs[channel].pid = 0;
+    }
+    if (waited < 0) return -1;
+    bool clean = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    appendRecorderLog(channel, clean ? LOG_INFO : LOG_ERROR,
+                      "录制进程已退出，" + std::string(WIFEXITED(status) ? "退出码 " + std::to_string(WEXITSTATUS(status))
+                                                                        : "信号 " + std::to_string(WTERMSIG(status))));
+    return status;
+}
+
+// 看门狗请求重启时，录制线程在退避后重新启动这一路；由录制线程调用，取走请求和退避秒数
+bool takeRecorderRestart(int channel, int& backoffSeconds) {
+    std::lock_guard<std::mutex> lock(ingestMutex);
+    RecorderWatchdog& watchdog = watchdogs[channel];
+    if (!watchdog.restartRequested) return false;
+    watchdog.restartRequested = false;
+    watchdog.restarts++;
+    backoffSeconds = watchdog.immediateRestart
+                         ? 0 : std::min(STALL_MAX_BACKOFF_SECONDS, 1 << std::min(watchdog.consecutiveStalls - 1, 6));
+    watchdog.immediateRestart = false;
+    return true;
+}
+
+// 切换录制方式时结束这一路的进程组，录制线程立即以重新构建的命令启动；不计为卡住。
+// 返回 false 表示录制进程尚未启动（或已不再重启），新的录制方式没有生效
+bool requestRecorderRestart(int channel, const std::string& reason) {
+    pid_t target = 0;
+    {
+        std::lock_guard<std::mutex> lock(ingestMutex);
+        RecorderWatchdog& watchdog = watchdogs[channel];
+        // 进程正在结束或在退避中等待重启时，下次启动本来就会重新构建命令
+        if (watchdog.pid == 0) return watchdog.restartRequested;
+        if (watchdog.killDeadlineMs != 0) return true;
+        watchdog.restartRequested = true;
+        watchdog.immediateRestart = true;
+        watchdog.killDeadlineMs = monotonicMs() + STALL_KILL_GRACE_MS;
+        target = watchdog.pid;
+    }
+    appendRecorderLog(channel, LOG_INFO, reason);
+    kill(-target, SIGTERM);
+    return true;
+}
+
+// 每 200ms 检查一次各路是否卡住：超过 stall_timeout_ms 没有进展时只结束这一路的进程组，由录制线程重启
+void recorderWatchdogLoop() {
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(STALL_CHECK_INTERVAL_MS));
+        int64_t now = monotonicMs();
+        for (int channel = 1; channel <= 2; channel++) {
+            bool recording = channel == 1 ? recording1.load() : recording2.load();
+            bool keyframeOnly = channelKeyframeOnly(channel);
+            int64_t timeoutMs = config.stall_timeout_ms;
+            std::string message;
+            pid_t target = 0;
+            int signal = SIGTERM;
+            {
+                std::lock_guard<std::mutex> lock(ingestMutex);
+                RecorderWatchdog& watchdog = watchdogs[channel];
+                if (watchdog.pid == 0) continue;
+                if (keyframeOnly && timeoutMs > 0) {
+                    timeoutMs = watchdog.advanceGaps.empty()
+                                    ? std::max<int64_t>(timeoutMs, STALL_KEYFRAME_ONLY_MIN_MS)
+                                    : std::max(timeoutMs, 2 * *std::max_element(watchdog.advanceGaps.begin(),
+                                                                                 watchdog.advanceGaps.end()));
+                }
+                if (watchdog.killDeadlineMs != 0) {
+                    if (now < watchdog.killDeadlineMs) continue;
+                    watchdog.killDeadlineMs = 0;
+                    target = watchdog.pid;
+                    signal = SIGKILL;
+                    message = "录制进程未响应 SIGTERM，强制结束";
+                } else if (recording && timeoutMs > 0 && now - watchdog.lastAdvanceMs > timeoutMs) {
+                    if (now - watchdog.launchedMs > STALL_HEALTHY_RESET_MS) watchdog.consecutiveStalls = 0;
+                    watchdog.consecutiveStalls++;
+                    watchdog.stalls++;
+                    if (watchdog.gapStartMs == 0) watchdog.gapStartMs = std::min(now, watchdog.lastAdvanceMs);
+                    watchdog.restartRequested = true;
+                    watchdog.killDeadlineMs = now + STALL_KILL_GRACE_MS;
+                    target = watchdog.pid;
+                    message = "录制卡住 " + std::to_string(now - watchdog.gapStartMs) + " ms，重启该路";
+                }
+            }
+            if (target == 0) continue;
+            appendRecorderLog(channel, LOG_ERROR, message);
+            std::cerr << "通道" << channel << " " << message << std::endl;
+            kill(-target, signal);
+        }
+    }
+}
+
+void startRecorderWatchdog() {
+    std::thread(recorderWatchdogLoop).detach();
+}
+
+json watchdogToJson(int channel) {
+    std::lock_guard<std::mutex> lock(ingestMutex);
+    const RecorderWatchdog& watchdog = watchdogs[channel];
+    int64_t now = monotonicMs();
+    json result;
+    result["stalls"] = watchdog.stalls;
+    result["restarts"] = watchdog.restarts;
+    result["stalled"] = watchdog.gapStartMs != 0;
+    // 总卡住时长包括尚未结束的缺口
+    result["stalledMs"] = watchdog.stalledMs + (watchdog.gapStartMs != 0 ? now - watchdog.gapStartMs : 0);
+    result["sinceLastAdvanceMs"] = watchdog.pid != 0 ? std::max<int64_t>(0, now - watchdog.lastAdvanceMs) : 0;
+    result["history"] = json::array();
+    for (const auto& stall : watchdog.history) {
+        result["history"].push_back({{"start", stall.start}, {"durationMs", stall.durationMs}});
+    }
+    return result;
+}
+
+// ==================== 音频处理策略 ====================
+// 每路按 audio_policy 处理音频：copy 原样写入，transcode 转为 AAC，drop 不录音频，auto 在后台
+// 用 ffprobe 探测一次音频编码，能直接放进 MP4 的原样写入，否则转码，没有音频轨时不录音频。
+// 摄像头大多已经输出 AAC，不必在每一路上解码再编码。探测期间先按转码录制，探测结果不是转码时
+// 重启该路一次；探测结果（包括失败）保留到地址或策略变化，开始录制和重启录制进程都不等待探测
+const int AUDIO_PROBE_TIMEOUT_SECONDS = 10;
+const char* MP4_AUDIO_CODECS[] = {"aac", "mp3", "ac3", "eac3", "alac"};
+
+struct AudioDecision {
+    std::string policy;
+    std::string url;        // 探测所用的地址，地址变化后重新探测
+    std::string codec;      // 探测到的编码，没有音频轨为 "none"，探测失败为空
+    std::string mode;       // 实际采用的 copy / transcode / drop
+    bool probing = false;
+    std::time_t probedAt = 0;
+};
+
+std::mutex audioMutex;
+AudioDecision audioDecisions[3];
+
+// 返回第一路音频的编码名称；没有音频轨返回 "none"，无法连接返回空
+std::string probeAudioCodec(const std::string& rtspUrl) {
+    CommandResult result = executeCommandWithStatus(
+        "timeout " + std::to_string(AUDIO_PROBE_TIMEOUT_SECONDS) + " ffprobe -v error -rtsp_transport tcp " +
+        "-select_streams a:0 -show_entries stream=codec_name -of csv=p=0 " + rtspUrl + " 2>/dev/null");
+    if (result.exit_status != 0) return "";
+    std::string codec = result.output.substr(0, result.output.find_first_of("\r\n"));
+    return codec.empty() ? "none" : codec;
+}
+
+// 后台探测音频编码，结果与发起时的策略和地址一致才采用
+void probeAudioInBackground(int channel, const std::string& policy, const std::string& rtspUrl) {
+    std::string codec = probeAudioCodec(rtspUrl);
+    std::string mode;
+    if (codec == "none") {
+        mode = "drop";
+    } else if (std::find(std::begin(MP4_AUDIO_CODECS), std::end(MP4_AUDIO_CODECS), codec) != std::end(MP4_AUDIO_CODECS)) {
+        mode = "copy";
+    } else {
+        // 探测失败时按原来的方式转码，地址或策略变化后再探测
+        mode = "transcode";
+    }
+    {
+        std::lock_guard<std::mutex> lock(audioMutex);
+        AudioDecision& decision = audioDecisions[channel];
+        if (decision.policy != policy || decision.url != rtspUrl) return;
+        decision.codec = codec;
+        decision.mode = mode;
+        decision.probing = false;
+        decision.probedAt = std::time(nullptr);
+    }
+    std::cout << "通道" << channel << " 音频编码: " << (codec.empty() ? "探测失败" : codec) << "，处理方式: " << mode
+              << std::endl;
+    if (mode == "transcode") return;
+    // 录制进程可能刚要启动，稍等它起来再重启
+    for (int i = 0; i < AUDIO_PROBE_TIMEOUT_SECONDS; i++) {
+        if (!(channel == 1 ? recording1.load() : recording2.load())) return;
+        if (requestRecorderRestart(channel, "音频探测完成，改为 " + mode + " 方式，重启该路")) return;
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+}
+
+// 决定该路的音频处理方式，不等待探测
+std::string resolveAudioMode(int channel, const std::string& rtspUrl) {
+    std::string policy = channelAudioPolicy(channel);
+    std::lock_guard<std::mutex> lock(audioMutex);
+    AudioDecision& decision = audioDecisions[channel];
+    if (decision.policy == policy && (policy != "auto" || decision.url == rtspUrl)) return decision.mode;
+
+    decision = AudioDecision();
+    decision.policy = policy;
+    decision.url = rtspUrl;
+    if (policy == "copy" || policy == "drop") {
+        decision.mode = policy;
+    } else if (policy == "auto") {
+        decision.mode = "transcode";
+        decision.probing = true;
+        std::thread(probeAudioInBackground, channel, policy, rtspUrl).detach();
+    } else {
+        decision.mode = "transcode";
+    }
+    return decision.mode;
+}
+
+json audioDecisionToJson(int channel) {
+    std::lock_guard<std::mutex> lock(audioMutex);
+    const AudioDecision& decision = audioDecisions[channel];
+    json result;
+    result["policy"] = channelAudioPolicy(channel);
+    result["codec"] = decision.codec.empty() ? json(nullptr) : json(decision.codec);
+    result["mode"] = decision.mode.empty() ? json(nullptr) : json(decision.mode);
+    result["probing"] = decision.probing;
+    result["probedAt"] = decision.probedAt;
+    return result;
+}
+
+// ==================== 存储压力应急录制 ====================
+// 保存目录所在分区剩余空间低于 emergency_free_mb，或写延迟 p99 超过 emergency_latency_ms 时，该路改为
+// 只录关键帧（noise 比特流过滤器丢弃非关键帧，不录音频），写入量降到原来的几十分之一；压力解除并持续
+// 一分钟后恢复正常录制。切换时只重启这一路的录制进程，每次切换记一条 emergency 检测告警。
+// 写延迟取 /proc/diskstats 中该分区每秒的平均写耗时，不另写探测文件增加负担。
+// drop 表达式需要 FFmpeg 5.1 及以上：启动时检查一次，只录关键帧的录制进程启动后很快异常退出时也不再使用
+const int EMERGENCY_CHECK_INTERVAL_MS = 1000;
+const int64_t EMERGENCY_LATENCY_WINDOW_MS = 60000;   // p99 取最近一分钟的每秒样本
+const size_t EMERGENCY_MIN_LATENCY_SAMPLES = 10;     // 样本不足时不按写延迟判断
+const double EMERGENCY_FREE_HYSTERESIS = 1.25;       // 剩余空间回到低水位的 1.25 倍以上才算解除
+const double EMERGENCY_LATENCY_HYSTERESIS = 0.5;     // 写延迟降到阈值的一半以下才算解除
+const int64_t EMERGENCY_CLEAR_MS = 60000;            // 压力解除持续这么久才恢复正常录制
+const int64_t EMERGENCY_FALLBACK_MS = 15000;         // 只录关键帧的录制进程运行不到这么久即异常退出时改回正常录制
+
+struct LatencySample {
+    int64_t monoMs;
+    double latencyMs;
+};
+
+struct EmergencyState {
+    bool active = false;
+    bool keyframeOnly = false;      // 当前的录制进程按只录关键帧的方式启动
+    std::string reason;             // 进入应急录制的原因: space / latency
+    std::time_t since = 0;
+    int64_t clearSinceMs = 0;       // 压力降到解除线以下的时间，0 表示尚未解除
+    uint64_t switches = 0;
+    double freeMb = -1;             // 无法获取时为 -1
+    double latencyP99Ms = -1;       // 样本不足时为 -1
+    dev_t device = 0;
+    bool haveDiskStats = false;
+    uint64_t writes = 0;            // 上次读到的累计完成写次数和写耗时 (ms)
+    uint64_t writeMs = 0;
+    std::deque<LatencySample> latencySamples;
+};
+
+std::mutex emergencyMutex;
+EmergencyState emergencyStates[3];
+bool keyframeOnlySupported = false;   // ffmpeg 的 noise 比特流过滤器支持 drop 表达式
+
+// 构建录制命令时调用，决定并记下这次启动是否只录关键帧；loop 模式只写内存缓存，不做应急录制
+bool takeKeyframeOnly(int channel) {
+    bool loop = channelRecordMode(channel) == "loop";
+    std::lock_guard<std::mutex> lock(emergencyMutex);
+    EmergencyState& state = emergencyStates[channel];
+    state.keyframeOnly = !loop && state.active && keyframeOnlySupported;
+    return state.keyframeOnly;
+}
+
+bool channelKeyframeOnly(int channel) {
+    std::lock_guard<std::mutex> lock(emergencyMutex);
+    return emergencyStates[channel].keyframeOnly;
+}
+
+// 5.1 之前 noise 没有 drop 选项（只有 dropamount），之后 drop 为表达式
+bool probeKeyframeOnlySupport() {
+    CommandResult result = executeCommandWithStatus("ffmpeg -hide_banner -h bsf=noise 2>&1");
+    std::istringstream lines(result.output);
+    std::string line;
+    while (std::getline(lines, line)) {
+        std::istringstream fields(line);
+        std::string name, type;
+        if (fields >> name >> type && name == "drop" && type == "<string>") return true;
+    }
+    return false;
+}
+
+// 录制线程在录制进程退出且没有重启请求时调用：只录关键帧的录制进程很快异常退出，多半是 ffmpeg
+// 不支持 drop 表达式，此后不再只录关键帧，立即按正常方式重新启动
+bool takeKeyframeOnlyFallback(int channel, int status, int& backoffSeconds) {
+    if (status == 0 || !(channel == 1 ? recording1.load() : recording2.load())) return false;
+    int64_t ranMs;
+    {
+        std::lock_guard<std::mutex> lock(ingestMutex);
+        ranMs = monotonicMs() - watchdogs[channel].launchedMs;
+    }
+    {
+        std::lock_guard<std::mutex> lock(emergencyMutex);
+        if (!emergencyStates[channel].keyframeOnly || ranMs > EMERGENCY_FALLBACK_MS) return false;
+        keyframeOnlySupported = false;
+        emergencyStates[channel].keyframeOnly = false;
+    }
+    std::string message = "只录关键帧的录制进程启动后即退出，ffmpeg 可能不支持 noise 过滤器的 drop 表达式（需要 5.1 及以上），改回正常录制";
+    appendRecorderLog(channel, LOG_ERROR, message);
+    std::cerr << "通道" << channel << " " << message << std::endl;
+    backoffSeconds = 0;
+    return true;
+}
+
+// 从 /proc/diskstats 读取设备号对应分区的累计完成写次数和写耗时
+bool readDiskWriteStats(dev_t device, uint64_t& writes, uint64_t& writeMs) {
+    std::ifstream file("/proc/diskstats");
+    std::string line;
+    while (std::getline(file, line)) {
+        // 主次设备号、名称，之后依次为读次数、合并读、读扇区、读耗时、写次数、合并写、写扇区、写耗时
+        unsigned int devMajor, devMinor;
+        char name[64];
+        unsigned long long fields[8];
+        if (sscanf(line.c_str(), "%u %u %63s %llu %llu %llu %llu %llu %llu %llu %llu", &devMajor, &devMinor, name,
+                   &fields[0], &fields[1], &fields[2], &fields[3], &fields[4], &fields[5], &fields[6],
+                   &fields[7]) != 11) {
+            continue;
+        }
+        if (devMajor != major(device) || devMinor != minor(device)) continue;
+        writes = fields[4];
+        writeMs = fields[7];
+        return true;
+    }
+    return false;
+}
+
+double latencyP99(const std::deque<LatencySample>& samples) {
+    if (samples.size() < EMERGENCY_MIN_LATENCY_SAMPLES) return -1;
+    std::vector<double> values;
+    for (const auto& sample : samples) values.push_back(sample.latencyMs);
+    std::sort(values.begin(), values.end());
+    return values[(values.size() * 99 + 99) / 100 - 1];
+}
+
+std::string formatMb(double mb) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(0) << mb;
+    return out.str();
+}
+
+// 每秒检查各路保存目录的剩余空间和写延迟，按需切换应急录制
+void emergencyMonitorLoop() {
+    bool supported = probeKeyframeOnlySupport();
+    {
+        std::lock_guard<std::mutex> lock(emergencyMutex);
+        keyframeOnlySupported = supported;
+    }
+    if (!supported) std::cerr << "ffmpeg 的 noise 过滤器不支持 drop 表达式（需要 5.1 及以上），存储压力下不能只录关键帧" << std::endl;
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(EMERGENCY_CHECK_INTERVAL_MS));
+        for (int channel = 1; channel <= 2; channel++) {
+            std::string path = channelSavePath(channel);
+            struct statvfs fs;
+            double freeMb = statvfs(path.c_str(), &fs) == 0 ? (double)fs.f_bavail * fs.f_frsize / (1024.0 * 1024.0) : -1;
+            struct stat st;
+            bool haveDevice = stat(path.c_str(), &st) == 0;
+            uint64_t writes = 0, writeMs = 0;
+            bool haveStats = haveDevice && readDiskWriteStats(st.st_dev, writes, writeMs);
+            int freeLimit = config.emergency_free_mb;
+            int latencyLimit = config.emergency_latency_ms;
+            // loop 模式和未启用的第二路不切换，已处于应急录制的在解除后恢复
+            if (channelRecordMode(channel) == "loop" || (channel == 2 && !config.dual_stream_enabled)) {
+                freeLimit = 0;
+                latencyLimit = 0;
+            }
+            int64_t now = monotonicMs();
+            std::string note;
+            bool active = false;
+            bool supported = false;
+            {
+                std::lock_guard<std::mutex> lock(emergencyMutex);
+                EmergencyState& state = emergencyStates[channel];
+                state.freeMb = freeMb;
+                if (!haveStats || (state.haveDiskStats && state.device != st.st_dev)) {
+                    state.latencySamples.clear();
+                } else if (state.haveDiskStats && writes > state.writes && writeMs >= state.writeMs) {
+                    state.latencySamples.push_back({now, double(writeMs - state.writeMs) / (writes - state.writes)});
+                }
+                while (!state.latencySamples.empty() &&
+                       now - state.latencySamples.front().monoMs > EMERGENCY_LATENCY_WINDOW_MS) {
+                    state.latencySamples.pop_front();
+                }
+                state.haveDiskStats = haveStats;
+                state.device = haveDevice ? st.st_dev : 0;
+                state.writes = writes;
+                state.writeMs = writeMs;
+                state.latencyP99Ms = latencyP99(state.latencySamples);
+
+                bool lowSpace = freeLimit > 0 && freeMb >= 0 && freeMb < freeLimit;
+                bool slow = latencyLimit > 0 && state.latencyP99Ms > latencyLimit;
+                if (!state.active && (lowSpace || slow)) {
+                    state.active = true;
+                    state.reason = lowSpace ? "space" : "latency";
+                    state.since = std::time(nullptr);
+                    state.clearSinceMs = 0;
+                    state.switches++;
+                    note = lowSpace ? "剩余空间 " + formatMb(freeMb) + " MB 低于 " + std::to_string(freeLimit) + " MB"
+                                    : "写延迟 p99 " + formatMb(state.latencyP99Ms) + " ms 超过 " +
+                                          std::to_string(latencyLimit) + " ms";
+                    note += "，改为只录关键帧";
+                } else if (state.active) {
+                    bool spaceClear = freeLimit <= 0 || (freeMb >= 0 && freeMb >= freeLimit * EMERGENCY_FREE_HYSTERESIS);
+                    bool latencyClear = latencyLimit <= 0 || state.latencyP99Ms < latencyLimit * EMERGENCY_LATENCY_HYSTERESIS;
+                    if (!spaceClear || !latencyClear) {
+                        state.clearSinceMs = 0;
+                    } else if (state.clearSinceMs == 0) {
+                        state.clearSinceMs = now;
+                    } else if (now - state.clearSinceMs >= EMERGENCY_CLEAR_MS) {
+                        state.active = false;
+                        state.switches++;
+                        note = "存储压力已解除（剩余空间 " + formatMb(freeMb) + " MB，写延迟 p99 " +
+                               (state.latencyP99Ms < 0 ? std::string("-") : formatMb(state.latencyP99Ms)) +
+                               " ms），恢复正常录制";
+                    }
+                }
+                active = state.active;
+                supported = keyframeOnlySupported;
+            }
+            if (note.empty()) continue;
+            if (active && !supported) note += "（ffmpeg 不支持，继续正常录制）";
+            // 带上发生时间，不触发事件录制：存储吃紧时不再额外写入事件片段
+            raiseDetection(channel, "emergency", active ? "start" : "end", note, std::time(nullptr));
+            // 录制方式没有变化时不重启：ffmpeg 不支持时一直按正常方式录制
+            bool recording = channel == 1 ? recording1.load() : recording2.load();
+            if (recording && (active && supported) != channelKeyframeOnly(channel)) {
+                requestRecorderRestart(channel, active ? "切换为应急录制，重启该路" : "恢复正常录制，重启该路");
+            }
+        }
+    }
+}
+
+void startEmergencyMonitor() {
+    std::thread(emergencyMonitorLoop).detach();
+}
+
+json emergencyToJson(int channel) {
+    std::lock_guard<std::mutex> lock(emergencyMutex);
+    const EmergencyState& state = emergencyStates[channel];
+    json result;
+    result["active"] = state.active;
+    result["keyframeOnly"] = state.keyframeOnly;
+    result["supported"] = keyframeOnlySupported;
+    result["reason"] = state.active ? json(state.reason) : json(nullptr);
+    result["since"] = state.active ? state.since : 0;
+    result["switches"] = state.switches;
+    result["freeMb"] = state.freeMb < 0 ? json(nullptr) : json(std::round(state.freeMb));
+    result["latencyP99Ms"] = state.latencyP99Ms < 0 ? json(nullptr) : json(state.latencyP99Ms);
+    result["latencySamples"] = state.latencySamples.size();
+    return result;
+}
+
+// 录制进程报告分段关闭的命名管道
+std::string segmentListPath(int channel) {
+    return "/tmp/vrs_segments" + std::to_string(channel) + ".fifo";
+}
+
+// 录制进程把视频流原样复制一份以 mpegts 写入的命名管道，供画面冻结检测读取关键帧
+std::string videoTapPath(int channel) {
+    return "/tmp/vrs_video" + std::to_string(channel) + ".fifo";
+}
+
+// 构建单路录制的ffmpeg命令：continuous 模式按分段写入保存目录，loop 模式循环写入内存缓存，
+// continuous 模式开启事件缓存时两者同时写入
+std::string buildRecorderCommand(int channel, const std::string& rtspUrl, const std::string& saveLocation,
+                                 int segmentTime)
+{
+    // stderr 和 stdout 由 runRecorder 经管道读取：不输出统计行，日志每行带级别前缀，进度以 key=value 写到 stdout
+    std::string ffmpeg = "sudo ffmpeg -hide_banner -nostats -loglevel level+info -progress pipe:1";
+    // 每个关键帧开始一个分片，moov 写在文件开头，写入中的分段可以边录边看
+    std::string movflags = config.fragmented_mp4 ? "movflags=+frag_keyframe+empty_moov+default_base_moof" : "";
+    // 每个写完的分段以 CSV 报告到命名管道，见分段边界通知部分
+    std::string segmentList = segmentListPath(channel);
+    // 开启冻结检测时另加一路只含视频的 mpegts 输出到命名管道，不解码、不转码
+    bool tap = config.freeze_threshold_seconds > 0;
+    std::string audioMode = resolveAudioMode(channel, rtspUrl);
+    // 应急录制只保留关键帧，不录音频，见存储压力应急录制部分
+    std::string videoArgs = "-c:v copy";
+    if (takeKeyframeOnly(channel)) {
+        videoArgs += " -bsf:v 'noise=drop=not(key)'";
+        audioMode = "drop";
+    }
+    std::string audioArgs = audioMode == "copy" ? "-c:a copy" : audioMode == "drop" ? "-an" : "-c:a aac -strict experimental";
+    bool loop = channelRecordMode(channel) == "loop";
+    if (loop && !tap) {
+        return ffmpeg + " -rtsp_transport tcp -i " + rtspUrl +
+               " -c:v copy " + audioArgs + " -f segment -segment_time " + std::to_string(LOOP_CHUNK_SECONDS) +
+               " -segment_wrap " + std::to_string(loopRingWrap()) + " -segment_format mpegts " +
+               loopRingDir(channel) + "/ring_%03d.ts";
+    }
+    if (!loop && !tap && !config.event_buffer_enabled) {
+        return ffmpeg + " -rtsp_transport tcp -i " + rtspUrl +
+               " " + videoArgs + " " + audioArgs + " -f segment -segment_time " + std::to_string(segmentTime) +
+               " -reset_timestamps 1 -strftime 1 -segment_format mp4 -segment_list " + segmentList +
+               " -segment_list_type csv " +
+               (movflags.empty() ? "" : "-segment_format_options " + movflags + " ") + saveLocation +
+               "/%Y-%m-%d_%H-%M-%S.mp4";
+    }
+
+    // 多个输出时同一路输入经 tee 分发到分段文件、事件预录缓存和冻结检测管道，不额外建立 RTSP 连接
+    std::vector<std::string> outputs;
+    if (!loop) {
+        outputs.push_back("[f=segment:segment_time=" + std::to_string(segmentTime) +
+                          ":reset_timestamps=1:strftime=1:segment_format=mp4:segment_list=" + segmentList +
+                          ":segment_list_type=csv" +
+                          (movflags.empty() ? "" : ":segment_format_options=" + movflags) + "]" +
+                          saveLocation + "/%Y-%m-%d_%H-%M-%S.mp4");
+    }
+    if (loop || config.event_buffer_enabled) {
+        outputs.push_back("[f=segment:segment_time=" + std::to_string(LOOP_CHUNK_SECONDS) + ":segment_wrap=" +
+                          std::to_string(loopRingWrap()) + ":segment_format=mpegts]" + loopRingDir(channel) +
+                          "/ring_%03d.ts");
+    }
+    if (tap) {
+        // 冻结检测输出经 fifo 缓冲、队列满时丢包，出错时忽略：读取方变慢或停止都不会阻塞或中断录制
+        outputs.push_back("[f=mpegts:select=v:onfail=ignore:use_fifo=1:fifo_options=drop_pkts_on_overflow=1]" +
+                          videoTapPath(channel));
+    }
+    std::string teeOutputs;
+    for (const auto& output : outputs) teeOutputs += (teeOutputs.empty() ? "" : "|") + output;
+    return ffmpeg + " -rtsp_transport tcp -i " + rtspUrl +
+           " -map 0:v" + (audioMode == "drop" ? "" : " -map 0:a?") + " " + videoArgs + " " + audioArgs +
+           " -flags +global_header -f tee \"" + teeOutputs + "\"";
+}
+
+// 完全照搬 lintech 的 startRecording 函数
+void startRecording(const std::string &rtspStreamUrl = "", const std::string &saveLocation = "",
+                    const std::string &rtspStreamUrl2 = "", const std::string &saveLocation2 = "")
+{
+    loadConfig();
+    
+    // 使用 config 中的值作为实际参数
+    std::string actualRtspStreamUrl = rtspStreamUrl.empty() ? config.rtsp_url1 : rtspStreamUrl;
+    std::string actualSaveLocation = saveLocation.empty() ? config.save_path1 : saveLocation;
+    std::string actualRtspStreamUrl2 = rtspStreamUrl2.empty() ? config.rtsp_url2 : rtspStreamUrl2;
+    std::string actualSaveLocation2 = saveLocation2.empty() ? config.save_path2 : saveLocation2;
+    int segmentTime = config.segment_time;
+
+    // 创建保存目录
+    ensureServiceDirectory(actualSaveLocation);
+    
+    // 如果启用双路录制，创建第二路的保存目录
+    if (config.dual_stream_enabled) {
+        ensureServiceDirectory(actualSaveLocation2);
+    }
+
+    // 事件预录缓存只在开始录制时清空，看门狗重启录制进程时保留
+    if (channelHasEventBuffer(1)) prepareLoopRing(1);
+    if (config.dual_stream_enabled && channelHasEventBuffer(2)) prepareLoopRing(2);
+
+    // 构建第一路ffmpeg命令字符串
+    std::string ffmpegCommand = buildRecorderCommand(1, actualRtspStreamUrl, actualSaveLocation, segmentTime);
+    std::cout << "第一路 ffmpeg command: " << ffmpegCommand << std::endl;
+    
+    // 如果启用双路录制，构建第二路视频流的ffmpeg命令字符串
+    std::string ffmpegCommand2;
+    if (config.dual_stream_enabled) {
+        ffmpegCommand2 = buildRecorderCommand(2, actualRtspStreamUrl2, actualSaveLocation2, segmentTime);
+        std::cout << "第二路 ffmpeg command: " << ffmpegCommand2 << std::endl;
+    } else {
+        std::cout << "双路录制已禁用，只录制第一路视频流" << std::endl;
+    }
+
+    // 创建第一路录制线程
+    std::thread ffmpegThread([ffmpegCommand, actualRtspStreamUrl, actualSaveLocation, segmentTime]() {
+        // 启动ffmpeg进程（PID 文件由 runRecorder 写入）；看门狗结束卡住的进程后在退避后重新启动，
+        // 每次重新构建命令，切换应急录制后按新的方式录制
+        int result = runRecorder(1, ffmpegCommand);
+        int backoff;
+        while (takeRecorderRestart(1, backoff) || takeKeyframeOnlyFallback(1, result, backoff)) {
+            std::this_thread::sleep_for(std::chrono::seconds(backoff));
+            if (!recording1.load()) break;
+            result = runRecorder(1, buildRecorderCommand(1, actualRtspStreamUrl, actualSaveLocation, segmentTime));
+        }
+        
+        if (result == -1) {
+            std::cerr << "Error starting ffmpeg process." << std::endl;
+        }
+        recording1.store(false);
+    });
+
+    // 立即设置第一路录制标志位
+    recording1.store(true);
+    
+    // 如果启用双路录制，创建第二路录制线程
+    if (config.dual_stream_enabled) {
+        std::thread ffmpegThread2([ffmpegCommand2, actualRtspStreamUrl2, actualSaveLocation2, segmentTime]() {
+            // 启动ffmpeg进程（PID 文件由 runRecorder 写入）；看门狗结束卡住的进程后在退避后重新启动，
+            // 每次重新构建命令，切换应急录制后按新的方式录制
+            int result2 = runRecorder(2, ffmpegCommand2);
+            int backoff;
+            while (takeRecorderRestart(2, backoff) || takeKeyframeOnlyFallback(2, result2, backoff)) {
+                std::this_thread::sleep_for(std::chrono::seconds(backoff));
+                if (!recording2.load()) break;
+                result2 = runRecorder(2, buildRecorderCommand(2, actualRtspStreamUrl2, actualSaveLocation2, segmentTime));
+            }
+            
+            if (result2 == -1) {
+                std::cerr << "Error starting ffmpeg process for stream 2." << std::endl;
+            }
+            recording2.store(false);
+        });
+
+        // 立即设置第二路录制标志位
+        recording2.store(true);
+
+        // 分离第二路线程，让它在后台运行
+        ffmpegThread2.detach();
+        
+        std::cout << "双路录制线程已启动并分离" << std::endl;
+    } else {
+        // 如果禁用双路录制，确保第二路标志位为false
+        recording2.store(false);
+        
+        std::cout << "单路录制线程已启动并分离" << std::endl;
+    }
+    
+    // 分离第一路线程，让它在后台运行
+    ffmpegThread.detach();
+}
+
+// 完全照搬 lintech 的 stopRecording 函数
+void stopRecording()
+{
+    std::cout << "准备停止录制..." << std::endl;
+    // 先清除录制标志，看门狗和录制线程不再重启被结束的进程
+    recording1.store(false);
+    recording2.store(false);
+    // Kill ffmpeg processes using pkill
+    system("pkill -f ffmpeg");
+
+    // 清理PID文件
+    remove("/tmp/recording1.pid");
+    remove("/tmp/recording2.pid");
+
+    recording1.store(false);
+    recording2.store(false);
+    std::cout << "所有FFmpeg进程已停止，PID文件已清理。" << std::endl;
+}
+
+// 分段种类，由文件名前缀区分
+enum SegmentKind : uint8_t { SEGMENT_NORMAL = 0, SEGMENT_EVENT = 1, SEGMENT_IRREGULAR = 2 };
+
+// 文件信息结构体：只保存整数字段，文件名、路径和格式化字符串在序列化时生成
+struct FileInfo {
+    int channel;
+    uint8_t kind;
+    bool isRecording;
+    int64_t startTime;          // 从文件名解析的开始时间
+    int64_t modifyTime;
+    int64_t size;
+    std::string irregularName;  // 仅非标准命名的文件使用
+};
+
+// 格式化文件大小
+std::string formatFileSize(long long bytes) {
+    const char* units[] = {"B", "KB", "MB", "GB", "TB"};
+    int unit = 0;
+    double size = bytes;
+    
+    while (size >= 1024 && unit < 4) {
+        size /= 1024;
+        unit++;
+    }
+    
+    char buffer[64];
+    if (unit == 0) {
+        snprintf(buffer, sizeof(buffer), "%lld %s", bytes, units[unit]);
+    } else {
+        snprintf(buffer, sizeof(buffer), "%.2f %s", size, units[unit]);
+    }
+    return std::string(buffer);
+}
+
+// 格式化时间
+std::string formatTime(std::time_t time) {
+    char buffer[64];
+    std::strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", std::localtime(&time));
+    return std::string(buffer);
+}
+
+// ==================== 分段目录 (segment catalog) ====================
+// 每个保存目录旁维护一份只追加的二进制日志 .catalog.journal，记录分段的新增/关闭/删除，
+// 并定期压缩成可直接 mmap 的快照 .catalog.snapshot。启动时只需加载快照并重放日志，
+// 目录对账在后台以空闲I/O优先级进行，请求路径上不再遍历目录和逐个 stat。
+//
+// 内存中按列存储 (struct-of-arrays)：开始时间从 strftime 文件名解析为整数并保持有序，
+// 通道由目录所在槽位隐含，文件名和格式化字符串在序列化时才生成，每个分段 29 字节
+// (start 8 + duration 4 + size 8 + kind 1 + checksum 8)。
+const char CATALOG_MAGIC_V1[8] = {'V', 'R', 'S', 'C', 'A', 'T', '0', '1'};
+const char CATALOG_MAGIC_V2[8] = {'V', 'R', 'S', 'C', 'A', 'T', '0', '2'};
+const char CATALOG_MAGIC_V3[8] = {'V', 'R', 'S', 'C', 'A', 'T', '0', '3'};
+const size_t CATALOG_COMPACT_ENTRIES = 1024;   // 日志条目超过此数量时压缩成快照
+const int CATALOG_RECONCILE_SECONDS = 60;
+const int SEGMENT_CHECKSUM_RECENT_SECONDS = 3600;   // 关闭时只为最近写入的分段计算校验值
+
+enum CatalogOp : uint8_t { CATALOG_ADD = 1, CATALOG_CLOSE = 2, CATALOG_DELETE = 3, CATALOG_CHECKSUM = 4 };
+
+// 日志条目（以及 v1 快照、v2/v3 快照中非标准命名文件）使用的定长记录，
+// crc 覆盖之前的所有字节，用于识别断电造成的残缺尾部。CHECKSUM 条目的 size 字段存放 xxh3
+struct CatalogEntry {
+    int64_t size;
+    int64_t modifyTime;
+    char name[40];
+    uint8_t op;
+    uint8_t reserved[3];
+    uint32_t crc;
+};
+static_assert(sizeof(CatalogEntry) == 64, "CatalogEntry must stay 64 bytes on disk");
+
+// v2/v3 快照：头部之后依次为 start[count] (int64)、duration[count] (int32，补齐到8字节)、
+// size[count] (int64)、kind[count] (uint8，补齐到8字节)、irregular[irregularCount] (CatalogEntry)；
+// v3 在 kind 之后多一列 checksum[count] (uint64)
+struct CatalogSnapshotHeader {
+    char magic[8];
+    uint32_t entrySize;
+    uint32_t payloadCrc;      // v2: 头部之后全部数据的 crc32
+    uint64_t count;
+    uint64_t irregularCount;  // v2
+    uint8_t padding[32];
+};
+static_assert(sizeof(CatalogSnapshotHeader) == 64, "snapshot header must stay 64 bytes");
+
+// 列式分段索引，各列按 start 升序排列
+struct SegmentColumns {
+    std::vector<int64_t> start;
+    std::vector<int32_t> duration;   // 最后修改时间 - 开始时间（秒）
+    std::vector<int64_t> size;
+    std::vector<uint8_t> kind;
+    std::vector<uint64_t> checksum;  // 分段关闭时计算的 xxh3，0 表示尚未计算
+    int32_t maxDuration = 0;         // 所有行时长的上界，区间查询据此限定回溯范围
+
+    size_t count() const { return start.size(); }
+
+    // 第一个 start >= t 的行
+    size_t lowerBound(int64_t t) const {
+        return std::lower_bound(start.begin(), start.end(), t) - start.begin();
+    }
+
+    // 查找 (kind, start) 对应的行，不存在时返回 count()
+    size_t find(uint8_t k, int64_t t) const {
+        for (size_t row = lowerBound(t); row < count() && start[row] == t; row++) {
+            if (kind[row] == k) return row;
+        }
+        return count();
+    }
+
+    // 新分段通常追加在末尾，插入代价为均摊 O(1)
+    void upsert(uint8_t k, int64_t t, int32_t dur, int64_t sz) {
+        maxDuration = std::max(maxDuration, dur);
+        size_t row = find(k, t);
+        if (row != count()) {
+            // 大小变化说明文件被改写过，旧的校验值作废
+            if (size[row] != sz) checksum[row] = 0;
+            duration[row] = dur;
+            size[row] = sz;
+            return;
+        }
+        row = std::upper_bound(start.begin(), start.end(), t) - start.begin();
+        start.insert(start.begin() + row, t);
+        duration.insert(duration.begin() + row, dur);
+        size.insert(size.begin() + row, sz);
+        kind.insert(kind.begin() + row, k);
+        checksum.insert(checksum.begin() + row, 0);
+    }
+
+    void erase(size_t row) {
+        start.erase(start.begin() + row);
+        duration.erase(duration.begin() + row);
+        size.erase(size.begin() + row);
+        kind.erase(kind.begin() + row);
+        checksum.erase(checksum.begin() + row);
+    }
+
+    void resize(size_t n) {
+        start.resize(n);
+        duration.resize(n);
+        size.resize(n);
+        kind.resize(n);
+        checksum.resize(n);
+    }
+
+    void recomputeMaxDuration() {
+        maxDuration = duration.empty() ? 0 : *std::max_element(duration.begin(), duration.end());
+    }
+
+    // 可能与 [t0, t1) 重叠的行范围 [first, last)。任何覆盖 t0 的行开始时间都不早于 t0 - maxDuration，
+    // 所以二分定位后只需多检查少量行，复杂度 O(log n + k)；调用方仍需按结束时间过滤 first 附近的行
+    std::pair<size_t, size_t> overlapRange(int64_t t0, int64_t t1) const {
+        size_t first = lowerBound(t0 - maxDuration);
+        size_t last = lowerBound(t1);
+        return {first, std::max(first, last)};
+    }
+
+    size_t memoryBytes() const {
+        return start.capacity() * sizeof(int64_t) + duration.capacity() * sizeof(int32_t) +
+               size.capacity() * sizeof(int64_t) + kind.capacity() * sizeof(uint8_t) +
+               checksum.capacity() * sizeof(uint64_t);
+    }
+};
+
+struct IrregularSegment {
+    int64_t size;
+    int64_t modifyTime;
+};
+
+struct SegmentCatalog {
+    std::string dirPath;
+    SegmentColumns rows;
+    std::map<std::string, IrregularSegment> irregular;   // 非标准命名的文件，数量很少
+    int journalFd = -1;
+    size_t journalEntries = 0;
+    std::string openSegment;    // 仍在写入的分段，录制进程报告写完或对账发现已不在写入时关闭
+};
+
+std::mutex catalogMutex;
+std::condition_variable catalogCv;
+bool catalogReconcileRequested = false;
+SegmentCatalog catalogs[3];
+
+// CRC-32 (zip/gzip 多项式)。slicing-by-8：每次查 8 张表处理 8 字节，打包下载时按此速度流过整个文件
+uint32_t crc32(const void* data, size_t len, uint32_t crc = 0) {
+    struct Tables {
+        uint32_t t[8][256];
+        Tables() {
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                t[0][i] = c;
+            }
+            for (int k = 1; k < 8; k++) {
+                for (int i = 0; i < 256; i++) t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xFF];
+            }
+        }
+    };
+    static const Tables tables;
+    const auto& t = tables.t;
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    crc = ~crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+              t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+    }
+    while (len--) crc = t[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+// 后台扫描线程使用空闲I/O优先级，避免与录制写入争抢TF卡带宽
+void setThreadIdleIoPriority() {
+    const int IOPRIO_WHO_PROCESS = 1;
+    const int IOPRIO_CLASS_IDLE = 3;
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, (int)syscall(SYS_gettid), IOPRIO_CLASS_IDLE << 13);
+}
+
+// 生成标准分段文件名，与录制命令中的 strftime 格式一致
+std::string segmentFileName(uint8_t kind, int64_t start) {
+    char buffer[64];
+    std::time_t t = start;
+    struct tm tm;
+    localtime_r(&t, &tm);
+    std::strftime(buffer, sizeof(buffer), kind == SEGMENT_EVENT ? "event_%Y-%m-%d_%H-%M-%S.mp4" : "%Y-%m-%d_%H-%M-%S.mp4", &tm);
+    return buffer;
+}
+
+// 本地时间转时间戳。按小时缓存 mktime 结果，连续分段大多落在同一小时内
+int64_t localEpoch(int year, int month, int day, int hour, int minute, int second) {
+    static thread_local int64_t cachedKey = -1;
+    static thread_local int64_t cachedBase = 0;
+    int64_t key = ((int64_t)year * 13 + month) * 32 * 24 + day * 24 + hour;
+    if (key != cachedKey) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        tm.tm_year = year - 1900;
+        tm.tm_mon = month - 1;
+        tm.tm_mday = day;
+        tm.tm_hour = hour;
+        tm.tm_isdst = -1;
+        cachedBase = mktime(&tm);
+        cachedKey = key;
+    }
+    return cachedBase + minute * 60 + second;
+}
+
+// 解析 [event_]%Y-%m-%d_%H-%M-%S.mp4，非标准命名（含夏令时切换时无法往返的名字）返回 false
+bool parseSegmentFileName(const std::string& name, uint8_t& kind, int64_t& start) {
+    size_t offset = 0;
+    kind = SEGMENT_NORMAL;
+    if (name.compare(0, 6, "event_") == 0) {
+        kind = SEGMENT_EVENT;
+        offset = 6;
+    }
+    if (name.size() != offset + 23 || name.compare(offset + 19, 4, ".mp4") != 0) return false;
+
+    const char* p = name.c_str() + offset;
+    const char* pattern = "dddd-dd-dd_dd-dd-dd";
+    for (int i = 0; i < 19; i++) {
+        if (pattern[i] == 'd' ? !isdigit((unsigned char)p[i]) : p[i] != pattern[i]) return false;
+    }
+    auto num = [p](int pos, int len) {
+        int value = 0;
+        for (int i = 0; i < len; i++) value = value * 10 + (p[pos + i] - '0');
+        return value;
+    };
+    start = localEpoch(num(0, 4), num(5, 2), num(8, 2), num(11, 2), num(14, 2), num(17, 2));
+    return segmentFileName(kind, start) == name;
+}
+
+CatalogEntry makeCatalogEntry(CatalogOp op, const std::string& name, long long size, std::time_t modifyTime) {
+    CatalogEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.size = size;
+    entry.modifyTime = modifyTime;
+    strncpy(entry.name, name.c_str(), sizeof(entry.name) - 1);
+    entry.op = op;
+    entry.crc = crc32(&entry, offsetof(CatalogEntry, crc));
+    return entry;
+}
+
+bool catalogEntryValid(const CatalogEntry& entry) {
+    return entry.crc == crc32(&entry, offsetof(CatalogEntry, crc)) && entry.name[sizeof(entry.name) - 1] == '\0';
+}
+
+void applyCatalogEntry(SegmentCatalog& catalog, const CatalogEntry& entry) {
+    uint8_t kind;
+    int64_t start;
+    if (parseSegmentFileName(entry.name, kind, start)) {
+        if (entry.op == CATALOG_DELETE) {
+            size_t row = catalog.rows.find(kind, start);
+            if (row != catalog.rows.count()) catalog.rows.erase(row);
+        } else if (entry.op == CATALOG_CHECKSUM) {
+            size_t row = catalog.rows.find(kind, start);
+            if (row != catalog.rows.count()) catalog.rows.checksum[row] = (uint64_t)entry.size;
+        } else {
+            int32_t duration = (int32_t)std::max<int64_t>(0, entry.modifyTime - start);
+            catalog.rows.upsert(kind, start, duration, entry.size);
+        }
+    } else if (entry.op == CATALOG_DELETE) {
+        catalog.irregular.erase(entry.name);
+    } else if (entry.op != CATALOG_CHECKSUM) {
+        catalog.irregular[entry.name] = {entry.size, entry.modifyTime};
+    }
+}
+
+// 最后一个普通分段（录制中的文件只可能是它），不存在时返回 count()
+size_t latestNormalRow(const SegmentColumns& rows) {
+    for (size_t row = rows.count(); row-- > 0;) {
+        if (rows.kind[row] == SEGMENT_NORMAL) return row;
+    }
+    return rows.count();
+}
+
+// 按文件名查询当前记录，不存在时返回 false
+bool lookupCatalogSegment(const SegmentCatalog& catalog, const std::string& name, int64_t& size, int64_t& modifyTime) {
+    uint8_t kind;
+    int64_t start;
+    if (parseSegmentFileName(name, kind, start)) {
+        size_t row = catalog.rows.find(kind, start);
+        if (row == catalog.rows.count()) return false;
+        size = catalog.rows.size[row];
+        modifyTime = start + catalog.rows.duration[row];
+        return true;
+    }
+    auto it = catalog.irregular.find(name);
+    if (it == catalog.irregular.end()) return false;
+    size = it->second.size;
+    modifyTime = it->second.modifyTime;
+    return true;
+}
+
+// 批量追加日志条目，一次 write + fdatasync
+void appendCatalogJournal(SegmentCatalog& catalog, const std::vector<CatalogEntry>& entries) {
+    if (entries.empty()) return;
+    for (const auto& entry : entries) applyCatalogEntry(catalog, entry);
+    if (catalog.journalFd < 0) return;
+    const char* data = reinterpret_cast<const char*>(entries.data());
+    size_t remaining = entries.size() * sizeof(CatalogEntry);
+    while (remaining > 0) {
+        ssize_t n = write(catalog.journalFd, data, remaining);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "分段目录日志写入失败: " << strerror(errno) << std::endl;
+            return;
+        }
+        data += n;
+        remaining -= n;
+    }
+    fdatasync(catalog.journalFd);
+    catalog.journalEntries += entries.size();
+}
+
+size_t alignTo8(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+// 从 mmap 的快照恢复索引：v2/v3 直接按列拷贝，v1 逐条解析文件名
+bool loadCatalogSnapshot(SegmentCatalog& catalog, const char* data, size_t length) {
+    if (length < sizeof(CatalogSnapshotHeader)) return false;
+    const CatalogSnapshotHeader* header = reinterpret_cast<const CatalogSnapshotHeader*>(data);
+    const char* payload = data + sizeof(CatalogSnapshotHeader);
+    size_t payloadLength = length - sizeof(CatalogSnapshotHeader);
+    if (header->entrySize != sizeof(CatalogEntry)) return false;
+
+    if (memcmp(header->magic, CATALOG_MAGIC_V1, sizeof(CATALOG_MAGIC_V1)) == 0) {
+        const CatalogEntry* entries = reinterpret_cast<const CatalogEntry*>(payload);
+        if (header->count > payloadLength / sizeof(CatalogEntry)) return false;
+        for (uint64_t i = 0; i < header->count; i++) {
+            if (catalogEntryValid(entries[i])) applyCatalogEntry(catalog, entries[i]);
+        }
+        return true;
+    }
+
+    bool v3 = memcmp(header->magic, CATALOG_MAGIC_V3, sizeof(CATALOG_MAGIC_V3)) == 0;
+    if (!v3 && memcmp(header->magic, CATALOG_MAGIC_V2, sizeof(CATALOG_MAGIC_V2)) != 0) return false;
+    size_t n = header->count;
+    size_t expected = n * sizeof(int64_t) + alignTo8(n * sizeof(int32_t)) + n * sizeof(int64_t) +
+                      alignTo8(n) + (v3 ? n * sizeof(uint64_t) : 0) + header->irregularCount * sizeof(CatalogEntry);
+    if (n > payloadLength || expected != payloadLength || crc32(payload, payloadLength) != header->payloadCrc) {
+        return false;
+    }
+    catalog.rows.resize(n);
+    const char* p = payload;
+    memcpy(catalog.rows.start.data(), p, n * sizeof(int64_t));
+    p += n * sizeof(int64_t);
+    memcpy(catalog.rows.duration.data(), p, n * sizeof(int32_t));
+    p += alignTo8(n * sizeof(int32_t));
+    memcpy(catalog.rows.size.data(), p, n * sizeof(int64_t));
+    p += n * sizeof(int64_t);
+    memcpy(catalog.rows.kind.data(), p, n);
+    p += alignTo8(n);
+    if (v3) {
+        memcpy(catalog.rows.checksum.data(), p, n * sizeof(uint64_t));
+        p += n * sizeof(uint64_t);
+    }
+    catalog.rows.recomputeMaxDuration();
+    const CatalogEntry* irregular = reinterpret_cast<const CatalogEntry*>(p);
+    for (uint64_t i = 0; i < header->irregularCount; i++) {
+        if (catalogEntryValid(irregular[i])) applyCatalogEntry(catalog, irregular[i]);
+    }
+    return true;
+}
+
+// 加载快照并重放日志。日志尾部残缺或校验失败的条目会被截断
+void openCatalog(SegmentCatalog& catalog, const std::string& dirPath) {
+    if (catalog.journalFd >= 0) close(catalog.journalFd);
+    catalog = SegmentCatalog();
+    catalog.dirPath = dirPath;
+
+    std::string snapshotPath = dirPath + "/.catalog.snapshot";
+    int fd = open(snapshotPath.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                if (!loadCatalogSnapshot(catalog, static_cast<const char*>(map), st.st_size)) {
+                    std::cerr << "分段目录快照无效，忽略: " << snapshotPath << std::endl;
+                    catalog.rows = SegmentColumns();
+                    catalog.irregular.clear();
+                }
+                munmap(map, st.st_size);
+            }
+        }
+        close(fd);
+    }
+
+    std::string journalPath = dirPath + "/.catalog.journal";
+    catalog.journalFd = open(journalPath.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (catalog.journalFd < 0) {
+        std::cerr << "无法打开分段目录日志，仅在内存中维护: " << journalPath << std::endl;
+        return;
+    }
+    CatalogEntry entry;
+    off_t validEnd = 0;
+    while (pread(catalog.journalFd, &entry, sizeof(entry), validEnd) == (ssize_t)sizeof(entry) &&
+           catalogEntryValid(entry)) {
+        applyCatalogEntry(catalog, entry);
+        validEnd += sizeof(entry);
+        catalog.journalEntries++;
+    }
+    struct stat st;
+    if (fstat(catalog.journalFd, &st) == 0 && st.st_size != validEnd) {
+        std::cerr << "分段目录日志尾部残缺，截断到 " << validEnd << " 字节" << std::endl;
+        if (ftruncate(catalog.journalFd, validEnd) != 0) {
+            std::cerr << "截断分段目录日志失败: " << strerror(errno) << std::endl;
+        }
+    }
+}
+
+// 把当前状态写成 v3 快照（先写临时文件再 rename），然后清空日志
+void compactCatalog(SegmentCatalog& catalog) {
+    const SegmentColumns& rows = catalog.rows;
+    size_t n = rows.count();
+    std::vector<CatalogEntry> irregular;
+    for (const auto& item : catalog.irregular) {
+        irregular.push_back(makeCatalogEntry(CATALOG_CLOSE, item.first, item.second.size, item.second.modifyTime));
+    }
+
+    std::string payload;
+    size_t rowBytes = sizeof(int64_t) + sizeof(int32_t) + sizeof(int64_t) + sizeof(uint8_t) + sizeof(uint64_t);
+    payload.reserve(n * rowBytes + 16 + irregular.size() * sizeof(CatalogEntry));
+    payload.append(reinterpret_cast<const char*>(rows.start.data()), n * sizeof(int64_t));
+    payload.append(reinterpret_cast<const char*>(rows.duration.data()), n * sizeof(int32_t));
+    payload.resize(alignTo8(payload.size()), '\0');
+    payload.append(reinterpret_cast<const char*>(rows.size.data()), n * sizeof(int64_t));
+    payload.append(reinterpret_cast<const char*>(rows.kind.data()), n);
+    payload.resize(alignTo8(payload.size()), '\0');
+    payload.append(reinterpret_cast<const char*>(rows.checksum.data()), n * sizeof(uint64_t));
+    payload.append(reinterpret_cast<const char*>(irregular.data()), irregular.size() * sizeof(CatalogEntry));
+
+    CatalogSnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CATALOG_MAGIC_V3, sizeof(CATALOG_MAGIC_V3));
+    header.entrySize = sizeof(CatalogEntry);
+    header.payloadCrc = crc32(payload.data(), payload.size());
+    header.count = n;
+    header.irregularCount = irregular.size();
+
+    std::string snapshotPath = catalog.dirPath + "/.catalog.snapshot";
+    std::string tmpPath = snapshotPath + ".tmp";
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return;
+    bool ok = write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header);
+    ok = ok && (payload.empty() || write(fd, payload.data(), payload.size()) == (ssize_t)payload.size());
+    ok = ok && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmpPath.c_str(), snapshotPath.c_str()) != 0) {
+        unlink(tmpPath.c_str());
+        std::cerr << "分段目录快照写入失败: " << snapshotPath << std::endl;
+        return;
+    }
+    // rename 要等目录项落盘才算持久化；否则断电后可能留下旧快照和已被清空的日志，日志中的操作全部丢失
+    int dirFd = open(catalog.dirPath.c_str(), O_RDONLY | O_DIRECTORY);
+    bool dirSynced = dirFd >= 0 && fsync(dirFd) == 0;
+    if (dirFd >= 0) close(dirFd);
+    if (!dirSynced) {
+        std::cerr << "分段目录快照所在目录同步失败，暂不清空日志: " << catalog.dirPath << std::endl;
+        return;
+    }
+    // 快照已持久化，日志中的操作都可以重放到快照上而不改变结果，清空失败也不影响正确性
+    if (catalog.journalFd >= 0 && ftruncate(catalog.journalFd, 0) == 0) {
+        catalog.journalEntries = 0;
+    }
+}
+
+// 取得通道对应的目录；保存路径被修改后重新加载
+SegmentCatalog& channelCatalog(int channel) {
+    SegmentCatalog& catalog = catalogs[channel];
+    std::string dirPath = channelSavePath(channel);
+    if (catalog.dirPath != dirPath) {
+        openCatalog(catalog, dirPath);
+        // 上次退出时可能仍在写入的分段，由下一次对账判定是否已关闭
+        size_t row = latestNormalRow(catalog.rows);
+        if (row < catalog.rows.count()) catalog.openSegment = segmentFileName(SEGMENT_NORMAL, catalog.rows.start[row]);
+    }
+    return catalog;
+}
+
+bool isSegmentFileName(const std::string& name) {
+    return name.size() > 4 && name.compare(name.size() - 4, 4, ".mp4") == 0 &&
+           name.size() < sizeof(CatalogEntry::name);
+}
+
+// 分段旁的校验值文件，格式见分段完整性校验部分
+std::string segmentSidecarPath(const std::string& dirPath, const std::string& name) {
+    return dirPath + "/" + name + ".sum";
+}
+
+// 分段旁的关键帧分析结果，格式见关键帧画面分析部分
+std::string segmentAnalysisPath(const std::string& dirPath, const std::string& name) {
+    return dirPath + "/" + name + ".analysis.json";
+}
+
+// 分段删除后清理它的附属文件
+void removeSegmentSidecars(const std::string& dirPath, const std::string& name) {
+    unlink(segmentSidecarPath(dirPath, name).c_str());
+    unlink(segmentAnalysisPath(dirPath, name).c_str());
+}
+
+// 记录一个已写完的分段（事件片段落盘等由本进程生成的文件直接调用）
+void catalogRecordSegment(int channel, const std::string& name, long long size, std::time_t modifyTime) {
+    if (!isSegmentFileName(name)) return;
+    {
+        std::lock_guard<std::mutex> lock(catalogMutex);
+        SegmentCatalog& catalog = channelCatalog(channel);
+        if (catalog.openSegment == name) catalog.openSegment.clear();
+        appendCatalogJournal(catalog, {makeCatalogEntry(CATALOG_CLOSE, name, size, modifyTime)});
+    }
+    queueSegmentChecksum(channel, name);
+    queueSegmentAnalysis(channel, name);
+    autoUploadSegment(channel, name, true, modifyTime);
+    publishSegmentEvent("close", channel, name, size, 0);
+}
+
+// 与目录对账：只对目录中新出现的文件和最新的(可能仍在写入的)分段做 stat
+void reconcileCatalog(int channel) {
+    std::string dirPath;
+    {
+        std::lock_guard<std::mutex> lock(catalogMutex);
+        dirPath = channelCatalog(channel).dirPath;
+    }
+
+    struct stat dirStat;
+    if (stat(dirPath.c_str(), &dirStat) != 0) return;
+    DIR* dir = opendir(dirPath.c_str());
+    if (!dir) return;
+    std::vector<std::string> names;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        std::string name = entry->d_name;
+        if (isSegmentFileName(name)) names.push_back(name);
+    }
+    closedir(dir);
+
+    // 按解析出的 (kind, start) 与索引比对，不为已知分段生成或比较文件名字符串
+    std::vector<std::string> toStat;
+    std::vector<CatalogEntry> ops;
+    std::string newest;   // 当前正在写入的候选：开始时间最晚的普通分段
+    {
+        std::lock_guard<std::mutex> lock(catalogMutex);
+        SegmentCatalog& catalog = channelCatalog(channel);
+        if (catalog.dirPath != dirPath) return;
+        const SegmentColumns& rows = catalog.rows;
+        std::vector<uint8_t> present(rows.count(), 0);
+        std::set<std::string> presentIrregular;
+        int64_t newestStart = INT64_MIN;
+        for (const auto& name : names) {
+            uint8_t kind;
+            int64_t start;
+            if (parseSegmentFileName(name, kind, start)) {
+                size_t row = rows.find(kind, start);
+                if (row == rows.count()) {
+                    toStat.push_back(name);
+                    if (kind == SEGMENT_NORMAL && start > newestStart) {
+                        newest = name;
+                        newestStart = start;
+                    }
+                } else {
+                    present[row] = 1;
+                }
+            } else if (catalog.irregular.count(name)) {
+                presentIrregular.insert(name);
+            } else {
+                toStat.push_back(name);
+            }
+        }
+        for (size_t row = 0; row < rows.count(); row++) {
+            if (!present[row]) {
+                ops.push_back(makeCatalogEntry(CATALOG_DELETE, segmentFileName(rows.kind[row], rows.start[row]), 0, 0));
+            }
+        }
+        for (const auto& item : catalog.irregular) {
+            if (!presentIrregular.count(item.first)) ops.push_back(makeCatalogEntry(CATALOG_DELETE, item.first, 0, 0));
+        }
+        size_t active = latestNormalRow(rows);
+        if (active < rows.count() && present[active]) {
+            std::string name = segmentFileName(SEGMENT_NORMAL, rows.start[active]);
+            toStat.push_back(name);
+            if (rows.start[active] > newestStart) newest = name;
+        }
+        // 打开的分段也要 stat，以便判定关闭；已从目录消失的不再跟踪
+        if (!catalog.openSegment.empty() &&
+            std::find(toStat.begin(), toStat.end(), catalog.openSegment) == toStat.end()) {
+            if (std::find(names.begin(), names.end(), catalog.openSegment) != names.end()) {
+                toStat.push_back(catalog.openSegment);
+            } else {
+                catalog.openSegment.clear();
+            }
+        }
+    }
+
+    for (const auto& name : toStat) {
+        struct stat st;
+        if (stat((dirPath + "/" + name).c_str(), &st) == 0) {
+            ops.push_back(makeCatalogEntry(CATALOG_CLOSE, name, st.st_size, st.st_mtime));
+        }
+    }
+
+    // 关闭的分段（segment_list 漏报后已不在写入，或出现时即已写完）在释放锁后交给校验和自动上传
+    std::vector<CatalogEntry> closed;
+    std::vector<std::string> removed;
+    {
+        std::lock_guard<std::mutex> lock(catalogMutex);
+        SegmentCatalog& catalog = channelCatalog(channel);
+        if (catalog.dirPath != dirPath) return;
+        std::string wasOpen = catalog.openSegment;
+        std::vector<CatalogEntry> journalOps;
+        for (auto& op : ops) {
+            if (op.op != CATALOG_CLOSE) {
+                if (op.op == CATALOG_DELETE) removed.push_back(op.name);
+                journalOps.push_back(op);
+                continue;
+            }
+            int64_t size, modifyTime;
+            bool known = lookupCatalogSegment(catalog, op.name, size, modifyTime);
+            if (op.name == newest && segmentWriting(channel, op.name)) {
+                // 最新分段在写入期间大小不断变化，首次出现时记一条 ADD，之后只更新内存
+                catalog.openSegment = op.name;
+                if (known) {
+                    applyCatalogEntry(catalog, op);
+                    continue;
+                }
+            } else if (op.name == wasOpen || !known) {
+                if (catalog.openSegment == op.name) catalog.openSegment.clear();
+                closed.push_back(op);
+            } else if (size == op.size && modifyTime == op.modifyTime) {
+                continue;
+            }
+            if (!known) {
+                op.op = CATALOG_ADD;
+                op.crc = crc32(&op, offsetof(CatalogEntry, crc));
+            }
+            journalOps.push_back(op);
+        }
+        appendCatalogJournal(catalog, journalOps);
+        if (catalog.journalEntries > CATALOG_COMPACT_ENTRIES) {
+            compactCatalog(catalog);
+        }
+    }
+
+    for (const auto& name : removed) removeSegmentSidecars(dirPath, name);
+    // 按修改时间顺序入队，停机或漏报后一次发现的多个分段按录制先后上传
+    std::sort(closed.begin(), closed.end(), [](const CatalogEntry& a, const CatalogEntry& b) {
+        return a.modifyTime != b.modifyTime ? a.modifyTime < b.modifyTime : strncmp(a.name, b.name, sizeof(a.name)) < 0;
+    });
+    for (const auto& entry : closed) {
+        uint8_t kind;
+        int64_t start;
+        if (parseSegmentFileName(entry.name, kind, start)) {
+            // 首次对账发现的旧文件早已不在页缓存中，留给 /api/verify 补算
+            if (std::time(nullptr) - entry.modifyTime < SEGMENT_CHECKSUM_RECENT_SECONDS) {
+                queueSegmentChecksum(channel, entry.name);
+                queueSegmentAnalysis(channel, entry.name);
+            }
+            autoUploadSegment(channel, entry.name, kind == SEGMENT_EVENT, entry.modifyTime);
+        }
+    }
+}
+
+void catalogReconcileLoop() {
+    setThreadIdleIoPriority();
+    while (true) {
+        for (int channel = 1; channel <= 2; channel++) {
+            reconcileCatalog(channel);
+        }
+        std::unique_lock<std::mutex> lock(catalogMutex);
+        catalogCv.wait_for(lock, std::chrono::seconds(CATALOG_RECONCILE_SECONDS),
+                           [] { return catalogReconcileRequested; });
+        catalogReconcileRequested = false;
+    }
+}
+
+void startCatalog() {
+    auto begin = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(catalogMutex);
+        for (int channel = 1; channel <= 2; channel++) {
+            SegmentCatalog& catalog = channelCatalog(channel);
+            std::cout << "分段目录 " << catalog.dirPath << ": " << catalog.rows.count() + catalog.irregular.size()
+                      << " 个分段, 索引占用 " << catalog.rows.memoryBytes() << " 字节" << std::endl;
+        }
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin);
+    std::cout << "分段目录加载耗时 " << elapsed.count() << " ms" << std::endl;
+    std::thread(catalogReconcileLoop).detach();
+}
+
+// ==================== 写入状态 (writer state) ====================
+// 用 inotify 监视保存目录：分段从 IN_CREATE 到 IN_CLOSE_WRITE 之间处于写入中。这两个事件由内核在写入方
+// 创建和关闭文件时产生，录制卡住时文件仍是打开的，ffmpeg 退出时内核关闭文件也会产生 IN_CLOSE_WRITE，
+// 因此不需要按 mtime 猜测。写入字节数由监视线程在 IN_MODIFY 时对自己持有的只读描述符 fstat 得到，
+// 请求路径只读取内存中的状态，不调用 stat 或 ps
+struct WritingSegment {
+    std::string name;
+    uint8_t kind;
+    int64_t startTime;   // 从文件名解析，非标准命名为 0
+    int64_t bytes;
+    int64_t lastWrite;
+    int fd;
+};
+
+struct ChannelWriterState {
+    std::string dirPath;
+    int watch = -1;
+    std::vector<WritingSegment> writing;   // 录制中的分段以及正在落盘的事件片段，通常不超过两个
+};
+
+std::mutex writerMutex;
+ChannelWriterState writerStates[3];
+
+void addWritingSegment(ChannelWriterState& state, const std::string& name) {
+    for (const auto& segment : state.writing) {
+        if (segment.name == name) return;
+    }
+    WritingSegment segment;
+    segment.name = name;
+    if (!parseSegmentFileName(name, segment.kind, segment.startTime)) {
+        segment.kind = SEGMENT_IRREGULAR;
+        segment.startTime = 0;
+    }
+    segment.fd = open((state.dirPath + "/" + name).c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    segment.bytes = segment.fd >= 0 && fstat(segment.fd, &st) == 0 ? st.st_size : 0;
+    segment.lastWrite = std::time(nullptr);
+    state.writing.push_back(segment);
+}
+
+void removeWritingSegment(ChannelWriterState& state, const std::string& name) {
+    for (auto it = state.writing.begin(); it != state.writing.end(); ++it) {
+        if (it->name == name) {
+            if (it->fd >= 0) close(it->fd);
+            state.writing.erase(it);
+            return;
+        }
+    }
+}
+
+void clearWritingSegments(ChannelWriterState& state) {
+    for (const auto& segment : state.writing) {
+        if (segment.fd >= 0) close(segment.fd);
+    }
+    state.writing.clear();
+}
+
+// 本进程重启时录制可能仍在进行，监视开始前打开的分段收不到 IN_CREATE：
+// 从 /proc 找出以写方式打开了该目录中分段的描述符。只在挂上监视时执行一次
+void seedWritingSegments(ChannelWriterState& state) {
+    char resolved[PATH_MAX];
+    if (!realpath(state.dirPath.c_str(), resolved)) return;
+    std::string prefix = std::string(resolved) + "/";
+    DIR* proc = opendir("/proc");
+    if (!proc) return;
+    while (struct dirent* process = readdir(proc)) {
+        if (!isdigit((unsigned char)process->d_name[0])) continue;
+        std::string processDir = std::string("/proc/") + process->d_name;
+        DIR* fds = opendir((processDir + "/fd").c_str());
+        if (!fds) continue;
+        while (struct dirent* fd = readdir(fds)) {
+            char target[PATH_MAX];
+            ssize_t n = readlink((processDir + "/fd/" + fd->d_name).c_str(), target, sizeof(target) - 1);
+            if (n <= 0) continue;
+            target[n] = '\0';
+            std::string path(target);
+            if (path.compare(0, prefix.size(), prefix) != 0) continue;
+            std::string name = path.substr(prefix.size());
+            if (!isSegmentFileName(name) || name.find('/') != std::string::npos) continue;
+            // fdinfo 中的 flags 为八进制，只读打开的（例如转封装下载的 ffmpeg）不算写入
+            std::ifstream info(processDir + "/fdinfo/" + fd->d_name);
+            std::string key;
+            int flags = O_RDONLY;
+            while (info >> key) {
+                if (key == "flags:") {
+                    info >> std::oct >> flags;
+                    break;
+                }
+            }
+            if ((flags & O_ACCMODE) != O_RDONLY) addWritingSegment(state, name);
+        }
+        closedir(fds);
+    }
+    closedir(proc);
+}
+
+// 保存目录尚未创建或配置改变时重新挂监视，调用方持有 writerMutex
+void attachWriterWatches(int notifyFd) {
+    for (int channel = 1; channel <= 2; channel++) {
+        ChannelWriterState& state = writerStates[channel];
+        std::string dirPath = channelSavePath(channel);
+        if (state.watch >= 0 && state.dirPath == dirPath) continue;
+        if (state.watch >= 0) inotify_rm_watch(notifyFd, state.watch);
+        clearWritingSegments(state);
+        state.dirPath = dirPath;
+        state.watch = inotify_add_watch(notifyFd, dirPath.c_str(),
+                                        IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+        if (state.watch >= 0) seedWritingSegments(state);
+    }
+}
+
+void writerWatchLoop(int notifyFd) {
+    alignas(struct inotify_event) char events[8192];
+    while (true) {
+        struct pollfd pfd = {notifyFd, POLLIN, 0};
+        int ready = poll(&pfd, 1, 1000);
+        bool changed = false;
+        std::vector<std::pair<int, std::string>> created;
+        {
+            std::lock_guard<std::mutex> lock(writerMutex);
+            attachWriterWatches(notifyFd);
+            ssize_t length = ready > 0 ? read(notifyFd, events, sizeof(events)) : 0;
+            std::set<std::pair<int, std::string>> modified;
+            for (char* p = events; length > 0 && p < events + length;) {
+                const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(p);
+                p += sizeof(struct inotify_event) + event->len;
+                if (event->mask & IN_Q_OVERFLOW) {
+                    std::cerr << "写入状态监视队列溢出" << std::endl;
+                    changed = true;
+                    continue;
+                }
+                int channel = event->wd == writerStates[1].watch ? 1 : event->wd == writerStates[2].watch ? 2 : 0;
+                if (channel == 0) continue;
+                ChannelWriterState& state = writerStates[channel];
+                if (event->mask & IN_IGNORED) {
+                    // 目录被删除或卸载，下一轮重新挂监视
+                    state.watch = -1;
+                    clearWritingSegments(state);
+                    continue;
+                }
+                std::string name = event->len ? event->name : "";
+                if (!isSegmentFileName(name)) continue;
+                if (event->mask & IN_CREATE) {
+                    addWritingSegment(state, name);
+                    created.push_back({channel, name});
+                } else if (event->mask & IN_MODIFY) {
+                    modified.insert({channel, name});
+                } else if (event->mask & IN_CLOSE_WRITE) {
+                    // 关闭由 segment_list 登记
+                    removeWritingSegment(state, name);
+                } else if (event->mask & (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+                    removeWritingSegment(state, name);
+                    changed = true;
+                }
+            }
+            // 同一批事件中的多次写入只 fstat 一次
+            std::time_t now = std::time(nullptr);
+            for (const auto& item : modified) {
+                for (auto& segment : writerStates[item.first].writing) {
+                    struct stat st;
+                    if (segment.name == item.second && segment.fd >= 0 && fstat(segment.fd, &st) == 0) {
+                        segment.bytes = st.st_size;
+                        segment.lastWrite = now;
+                    }
+                }
+            }
+        }
+        // 登记分段目录须在释放 writerMutex 之后（加锁顺序为 catalogMutex -> writerMutex）
+        for (const auto& item : created) {
+            catalogOpenSegment(item.first, item.second);
+        }
+        // 其他进程删除或移入移出文件时唤醒对账
+        if (changed) {
+            std::lock_guard<std::mutex> lock(catalogMutex);
+            catalogReconcileRequested = true;
+            catalogCv.notify_one();
+        }
+    }
+}
+
+// 须在分段目录之前启动，否则首次对账看不到仍在写入的分段
+void startWriterWatch() {
+    int notifyFd = inotify_init1(IN_CLOEXEC);
+    if (notifyFd < 0) {
+        std::cerr << "无法创建写入状态监视: " << strerror(errno) << std::endl;
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(writerMutex);
+        attachWriterWatches(notifyFd);
+        for (int channel = 1; channel <= 2; channel++) {
+            for (const auto& segment : writerStates[channel].writing) {
+                std::cout << "通道" << channel << " 正在写入: " << segment.name << std::endl;
+            }
+        }
+    }
+    std::thread(writerWatchLoop, notifyFd).detach();
+}
+
+std::vector<WritingSegment> writingSegments(int channel) {
+    std::lock_guard<std::mutex> lock(writerMutex);
+    return writerStates[channel].writing;
+}
+
+bool segmentWriting(int channel, const std::string& name) {
+    std::lock_guard<std::mutex> lock(writerMutex);
+    for (const auto& segment : writerStates[channel].writing) {
+        if (segment.name == name) return true;
+    }
+    return false;
+}
+
+// 录制进程当前写入的分段：写入中的开始时间最晚的普通分段
+bool recorderSegment(int channel, WritingSegment& out) {
+    std::lock_guard<std::mutex> lock(writerMutex);
+    bool found = false;
+    for (const auto& segment : writerStates[channel].writing) {
+        if (segment.kind == SEGMENT_NORMAL && (!found || segment.startTime > out.startTime)) {
+            out = segment;
+            found = true;
+        }
+    }
+    return found;
+}
+
+bool recorderSegmentBytes(int channel, std::string& name, int64_t& bytes) {
+    WritingSegment segment;
+    if (!recorderSegment(channel, segment)) return false;
+    name = segment.name;
+    bytes = segment.bytes;
+    return true;
+}
+
+// ==================== 分段边界通知 ====================
+// 录制进程以 -segment_list 把每个写完的分段以 CSV（文件名,开始时间,结束时间）写入每路一个命名管道，
+// 服务端常驻读取，分段关闭后立即登记到分段目录、校验和自动上传队列；分段打开由写入状态监视的 IN_CREATE 登记。
+// 两者都不扫描目录，定时对账只作为兜底。开关事件同时记入一个短的历史，供 /api/segments/events 推送
+const size_t SEGMENT_EVENT_HISTORY = 256;
+const int MAX_SEGMENT_EVENT_CLIENTS = 2;
+
+struct SegmentEvent {
+    uint64_t id;
+    std::string type;   // open / close
+    int channel;
+    std::string name;
+    int64_t size;
+    double duration;    // 仅录制进程报告的关闭事件有，其余为 0
+    int64_t time;
+};
+
+std::mutex segmentEventMutex;
+std::condition_variable segmentEventCv;
+std::deque<SegmentEvent> segmentEvents;
+uint64_t lastSegmentEventId = 0;
+std::atomic<int> segmentEventClients(0);
+
+void publishSegmentEvent(const std::string& type, int channel, const std::string& name, int64_t size, double duration) {
+    std::lock_guard<std::mutex> lock(segmentEventMutex);
+    segmentEvents.push_back({++lastSegmentEventId, type, channel, name, size, duration, std::time(nullptr)});
+    if (segmentEvents.size() > SEGMENT_EVENT_HISTORY) segmentEvents.pop_front();
+    segmentEventCv.notify_all();
+}
+
+json segmentEventToJson(const SegmentEvent& event) {
+    json j;
+    j["id"] = event.id;
+    j["type"] = event.type;
+    j["channel"] = channelName(event.channel);
+    j["name"] = event.name;
+    j["relativePath"] = channelName(event.channel) + "/" + event.name;
+    j["size"] = event.size;
+    if (event.duration > 0) j["duration"] = event.duration;
+    j["time"] = event.time;
+    return j;
+}
+
+// 关闭一个分段并交给校验和自动上传。同一分段可能由 segment_list、下一个分段打开或对账先后报告，只处理一次
+void catalogCloseSegment(int channel, const std::string& name, double duration) {
+    struct stat st;
+    if (stat((channelSavePath(channel) + "/" + name).c_str(), &st) != 0) return;
+    {
+        std::lock_guard<std::mutex> lock(catalogMutex);
+        SegmentCatalog& catalog = channelCatalog(channel);
+        int64_t size, modifyTime;
+        bool known = lookupCatalogSegment(catalog, name, size, modifyTime);
+        if (known && catalog.openSegment != name) return;
+        if (catalog.openSegment == name) catalog.openSegment.clear();
+        appendCatalogJournal(catalog, {makeCatalogEntry(known ? CATALOG_CLOSE : CATALOG_ADD, name, st.st_size, st.st_mtime)});
+    }
+    uint8_t kind;
+    int64_t start;
+    queueSegmentChecksum(channel, name);
+    queueSegmentAnalysis(channel, name);
+    autoUploadSegment(channel, name, parseSegmentFileName(name, kind, start) && kind == SEGMENT_EVENT, st.st_mtime);
+    publishSegmentEvent("close", channel, name, st.st_size, duration);
+}
+
+// 写入状态监视线程在分段创建时调用：登记为打开的分段，上一个分段若仍记为打开且已不在写入则先关闭它
+void catalogOpenSegment(int channel, const std::string& name) {
+    uint8_t kind;
+    int64_t start;
+    if (!parseSegmentFileName(name, kind, start) || kind != SEGMENT_NORMAL) return;
+    std::string previous;
+    {
+        std::lock_guard<std::mutex> lock(catalogMutex);
+        previous = channelCatalog(channel).openSegment;
+    }
+    if (!previous.empty() && previous != name && !segmentWriting(channel, previous)) {
+        catalogCloseSegment(channel, previous, 0);
+    }
+    {
+        std::lock_guard<std::mutex> lock(catalogMutex);
+        SegmentCatalog& catalog = channelCatalog(channel);
+        int64_t size, modifyTime;
+        if (!lookupCatalogSegment(catalog, name, size, modifyTime)) {
+            appendCatalogJournal(catalog, {makeCatalogEntry(CATALOG_ADD, name, 0, start)});
+        }
+        catalog.openSegment = name;
+    }
+    publishSegmentEvent("open", channel, name, 0, 0);
+}
+
+// 解析一行 segment_list CSV；文件名含逗号或引号时 ffmpeg 会加引号
+bool parseSegmentListLine(const std::string& line, std::string& name, double& duration) {
+    size_t nameEnd;
+    if (!line.empty() && line[0] == '"') {
+        name.clear();
+        size_t i = 1;
+        for (; i < line.size(); i++) {
+            if (line[i] == '"' && i + 1 < line.size() && line[i + 1] == '"') {
+                name += '"';
+                i++;
+            } else if (line[i] == '"') {
+                break;
+            } else {
+                name += line[i];
+            }
+        }
+        nameEnd = i + 1;
+    } else {
+        nameEnd = line.find(',');
+        name = line.substr(0, nameEnd);
+    }
+    double start = 0, end = 0;
+    if (nameEnd >= line.size() || sscanf(line.c_str() + nameEnd, ",%lf,%lf", &start, &end) != 2) return false;
+    duration = end - start;
+    return isSegmentFileName(name) && name.find('/') == std::string::npos;
+}
+
+// 以读写方式打开管道：没有写入方时读取阻塞而不是读到 EOF，录制进程打开管道也不会因没有读者而阻塞
+void segmentListLoop(int channel, int fd) {
+    std::string pending;
+    auto onLine = [channel](std::string& line) {
+        std::string name;
+        double duration;
+        if (parseSegmentListLine(line, name, duration)) {
+            catalogCloseSegment(channel, name, duration);
+        } else {
+            std::cerr << "通道" << channel << " 无法解析 segment_list: " << line << std::endl;
+        }
+    };
+    while (readPipeLines(fd, pending, onLine)) {
+    }
+    std::cerr << "通道" << channel << " segment_list 管道读取失败: " << strerror(errno) << std::endl;
+    close(fd);
+}
+
+// 创建并以读写方式打开录制进程输出用的命名管道，失败返回 -1
+int openRecorderFifo(const std::string& path) {
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0 && !S_ISFIFO(st.st_mode)) unlink(path.c_str());
+    if (mkfifo(path.c_str(), 0600) != 0 && errno != EEXIST) {
+        std::cerr << "无法创建管道 " << path << ": " << strerror(errno) << std::endl;
+        return -1;
+    }
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "无法打开管道 " << path << ": " << strerror(errno) << std::endl;
+    }
+    return fd;
+}
+
+void startSegmentListReaders() {
+    for (int channel = 1; channel <= 2; channel++) {
+        int fd = openRecorderFifo(segmentListPath(channel));
+        if (fd >= 0) std::thread(segmentListLoop, channel, fd).detach();
+    }
+}
+
+// 请求路径上的轻量刷新：用写入状态更新写入中分段的大小和时长，不访问文件系统。
+// 目录的增删由写入状态监视线程唤醒后台对账
+void refreshCatalogActive(int channel) {
+    std::lock_guard<std::mutex> lock(catalogMutex);
+    SegmentColumns& rows = channelCatalog(channel).rows;
+    for (const auto& segment : writingSegments(channel)) {
+        if (segment.kind == SEGMENT_IRREGULAR) continue;
+        size_t row = rows.find(segment.kind, segment.startTime);
+        if (row == rows.count()) continue;
+        rows.size[row] = segment.bytes;
+        rows.duration[row] = (int32_t)std::max<int64_t>(0, segment.lastWrite - segment.startTime);
+        rows.maxDuration = std::max(rows.maxDuration, rows.duration[row]);
+    }
+}
+
+std::string fileInfoName(const FileInfo& file) {
+    return file.kind == SEGMENT_IRREGULAR ? file.irregularName : segmentFileName(file.kind, file.startTime);
+}
+
+std::string fileInfoFullPath(const FileInfo& file) {
+    return channelSavePath(file.channel) + "/" + fileInfoName(file);
+}
+
+json fileInfoToJson(const FileInfo& file) {
+    std::string name = fileInfoName(file);
+    json fileJson;
+    fileJson["name"] = name;
+    fileJson["fullPath"] = channelSavePath(file.channel) + "/" + name;
+    fileJson["relativePath"] = channelName(file.channel) + "/" + name;
+    fileJson["size"] = file.size;
+    fileJson["sizeStr"] = formatFileSize(file.size);
+    fileJson["modifyTime"] = file.modifyTime;
+    fileJson["timeStr"] = formatTime(file.modifyTime);
+    fileJson["channel"] = channelName(file.channel);
+    fileJson["isRecording"] = file.isRecording;
+    return fileJson;
+}
+
+// 把索引中的一行展开为 FileInfo，是否写入中由调用方按写入状态标记
+FileInfo catalogRowInfo(int channel, const SegmentColumns& rows, size_t row) {
+    FileInfo fileInfo;
+    fileInfo.channel = channel;
+    fileInfo.kind = rows.kind[row];
+    fileInfo.startTime = rows.start[row];
+    fileInfo.modifyTime = rows.start[row] + rows.duration[row];
+    fileInfo.size = rows.size[row];
+    fileInfo.isRecording = false;
+    return fileInfo;
+}
+
+// 获取详细的文件列表
+std::vector<FileInfo> getVideoFilesDetailed() {
+    std::vector<FileInfo> files;
+
+    for (int channel = 1; channel <= 2; channel++) {
+        refreshCatalogActive(channel);
+        std::vector<WritingSegment> writing = writingSegments(channel);
+        std::lock_guard<std::mutex> lock(catalogMutex);
+        SegmentCatalog& catalog = channelCatalog(channel);
+        size_t first = files.size();
+        files.reserve(files.size() + catalog.rows.count() + catalog.irregular.size());
+        for (size_t row = 0; row < catalog.rows.count(); row++) {
+            files.push_back(catalogRowInfo(channel, catalog.rows, row));
+        }
+        for (const auto& item : catalog.irregular) {
+            FileInfo fileInfo;
+            fileInfo.channel = channel;
+            fileInfo.kind = SEGMENT_IRREGULAR;
+            fileInfo.startTime = 0;
+            fileInfo.modifyTime = item.second.modifyTime;
+            fileInfo.size = item.second.size;
+            fileInfo.isRecording = false;
+            fileInfo.irregularName = item.first;
+            files.push_back(fileInfo);
+        }
+        // 索引行与 files 中的位置一一对应，非标准命名的文件排在其后，按名称顺序
+        for (const auto& segment : writing) {
+            if (segment.kind != SEGMENT_IRREGULAR) {
+                size_t row = catalog.rows.find(segment.kind, segment.startTime);
+                if (row < catalog.rows.count()) files[first + row].isRecording = true;
+            } else {
+                auto it = catalog.irregular.find(segment.name);
+                if (it != catalog.irregular.end()) {
+                    files[first + catalog.rows.count() + std::distance(catalog.irregular.begin(), it)].isRecording = true;
+                }
+            }
+        }
+    }
+
+    // 按修改时间排序
+    std::sort(files.begin(), files.end(), [](const FileInfo& a, const FileInfo& b) {
+        return a.modifyTime > b.modifyTime;
+    });
+
+    return files;
+}
+
+// 获取正在录制的文件：直接取自写入状态
+std::vector<FileInfo> getCurrentRecordingFiles() {
+    std::vector<FileInfo> recordingFiles;
+
+    for (int channel = 1; channel <= 2; channel++) {
+        for (const auto& segment : writingSegments(channel)) {
+            FileInfo file;
+            file.channel = channel;
+            file.kind = segment.kind;
+            file.isRecording = true;
+            file.startTime = segment.startTime;
+            file.modifyTime = segment.lastWrite;
+            file.size = segment.bytes;
+            if (segment.kind == SEGMENT_IRREGULAR) file.irregularName = segment.name;
+            recordingFiles.push_back(file);
+        }
+    }
+
+    return recordingFiles;
+}
+
+// 解析时间参数：纯数字为时间戳，否则按本地时间 "YYYY-MM-DD HH:MM:SS" 或 "YYYY-MM-DDTHH:MM:SS"
+bool parseTimeParam(const std::string& value, int64_t& out) {
+    if (value.empty()) return false;
+    if (std::all_of(value.begin(), value.end(), [](char c) { return isdigit((unsigned char)c); })) {
+        return parseIntParam(value, out);
+    }
+    int year, month, day, hour = 0, minute = 0, second = 0;
+    char sep;
+    int fields = sscanf(value.c_str(), "%d-%d-%d%c%d:%d:%d", &year, &month, &day, &sep, &hour, &minute, &second);
+    if (fields != 3 && fields < 6) return false;
+    out = localEpoch(year, month, day, hour, minute, second);
+    return true;
+}
+
+// 查询通道在 [t0, t1) 内的分段以及覆盖缺口（短于 minGap 秒的缺口视为分段切换抖动忽略）
+json querySegments(int channel, int64_t t0, int64_t t1, int64_t minGap) {
+    refreshCatalogActive(channel);
+    std::lock_guard<std::mutex> lock(catalogMutex);
+    const SegmentColumns& rows = channelCatalog(channel).rows;
+
+    json result;
+    result["channel"] = channelName(channel);
+    result["segments"] = json::array();
+    result["gaps"] = json::array();
+
+    int64_t covered = t0;      // 已被覆盖到的时间点
+    int64_t coverage = 0;
+    auto addGap = [&](int64_t from, int64_t to) {
+        if (to - from >= minGap) {
+            result["gaps"].push_back({{"from", from}, {"to", to}, {"duration", to - from}});
+        }
+    };
+
+    auto range = rows.overlapRange(t0, t1);
+    for (size_t row = range.first; row < range.second; row++) {
+        int64_t start = rows.start[row];
+        int64_t end = start + rows.duration[row];
+        if (end <= t0) continue;
+
+        std::string name = segmentFileName(rows.kind[row], start);
+        json segment;
+        segment["name"] = name;
+        segment["relativePath"] = channelName(channel) + "/" + name;
+        segment["start"] = start;
+        segment["end"] = end;
+        segment["size"] = rows.size[row];
+        segment["kind"] = rows.kind[row] == SEGMENT_EVENT ? "event" : "normal";
+        result["segments"].push_back(segment);
+
+        int64_t clippedStart = std::max(start, t0);
+        int64_t clippedEnd = std::min(end, t1);
+        if (clippedStart > covered) addGap(covered, clippedStart);
+        if (clippedEnd > covered) {
+            coverage += clippedEnd - std::max(covered, clippedStart);
+            covered = clippedEnd;
+        }
+    }
+    if (t1 > covered) addGap(covered, t1);
+    result["coverageSeconds"] = coverage;
+    return result;
+}
+
+// 检查 ffmpeg 进程是否正在运行
+bool checkFfmpegRunning() {
+    std::string pgrepCommand = "pgrep ffmpeg";
+    FILE *pipe = popen(pgrepCommand.c_str(), "r");
+    if (!pipe) {
+        return false;
+    }
+    char buffer[128];
+    std::string result = "";
+    while (fgets(buffer, sizeof(buffer), pipe) != NULL) {
+        result += buffer;
+    }
+    pclose(pipe);
+    
+    // 如果有输出说明有 ffmpeg 进程在运行
+    return !result.empty() && result != "\n";
+}
+
+// Helper function to check if a process is running using its PID file
+bool isProcessRunning(const std::string& pid_file) {
+    std::ifstream file(pid_file);
+    if (!file.is_open()) {
+        return false;
+    }
+    pid_t pid;
+    file >> pid;
+    file.close();
+    // kill with signal 0 is a standard way to check for process existence
+    return (kill(pid, 0) == 0);
+}
+
+// ==================== SHA-256 / HMAC-SHA256 ====================
+// S3 SigV4 签名所需，避免为此引入 OpenSSL 依赖
+struct Sha256 {
+    uint32_t state[8];
+    uint8_t block[64];
+    size_t blockLen = 0;
+    uint64_t totalLen = 0;
+
+    Sha256() {
+        static const uint32_t init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                         0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+        memcpy(state, init, sizeof(state));
+    }
+
+    static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void transform(const uint8_t* data) {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t)data[i * 4] << 24 | (uint32_t)data[i * 4 + 1] << 16 |
+                   (uint32_t)data[i * 4 + 2] << 8 | data[i * 4 + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+            uint32_t ch = (e & f) ^ (~e & g);
+            uint32_t t1 = h + s1 + ch + k[i] + w[i];
+            uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+            uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t t2 = s0 + maj;
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+
+    void update(const void* data, size_t len) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        totalLen += len;
+        while (len > 0) {
+            size_t n = std::min(len, sizeof(block) - blockLen);
+            memcpy(block + blockLen, p, n);
+            blockLen += n;
+            p += n;
+            len -= n;
+            if (blockLen == sizeof(block)) {
+                transform(block);
+                blockLen = 0;
+            }
+        }
+    }
+
+    std::string digest() {
+        uint64_t bits = totalLen * 8;
+        uint8_t pad = 0x80;
+        update(&pad, 1);
+        uint8_t zero = 0;
+        while (blockLen != 56) update(&zero, 1);
+        uint8_t lenBytes[8];
+        for (int i = 0; i < 8; i++) lenBytes[i] = (uint8_t)(bits >> (56 - i * 8));
+        update(lenBytes, 8);
+        std::string out(32, '\0');
+        for (int i = 0; i < 8; i++) {
+            out[i * 4] = (char)(state[i] >> 24);
+            out[i * 4 + 1] = (char)(state[i] >> 16);
+            out[i * 4 + 2] = (char)(state[i] >> 8);
+            out[i * 4 + 3] = (char)state[i];
+        }
+        return out;
+    }
+};
+
+std::string toHex(const std::string& bytes) {
+    static const char digits[] = "0123456789abcdef";
+    std::string out;
+    out.reserve(bytes.size() * 2);
+    for (unsigned char c : bytes) {
+        out += digits[c >> 4];
+        out += digits[c & 0x0F];
+    }
+    return out;
+}
+
+std::string sha256Hex(const std::string& data) {
+    Sha256 hash;
+    hash.update(data.data(), data.size());
+    return toHex(hash.digest());
+}
+
+std::string hmacSha256(const std::string& key, const std::string& message) {
+    std::string k = key.size() > 64 ? [&] { Sha256 h; h.update(key.data(), key.size()); return h.digest(); }() : key;
+    k.resize(64, '\0');
+    std::string inner(64, '\0'), outer(64, '\0');
+    for (int i = 0; i < 64; i++) {
+        inner[i] = k[i] ^ 0x36;
+        outer[i] = k[i] ^ 0x5c;
+    }
+    Sha256 innerHash;
+    innerHash.update(inner.data(), inner.size());
+    innerHash.update(message.data(), message.size());
+    std::string innerDigest = innerHash.digest();
+    Sha256 outerHash;
+    outerHash.update(outer.data(), outer.size());
+    outerHash.update(innerDigest.data(), innerDigest.size());
+    return outerHash.digest();
+}
+
+// ==================== MD5 / CRC32C / XXH3 ====================
+// 上传分片校验：MD5 作为 Content-MD5 交给服务端校验，CRC32C 记录在上传日志中，
+// 续传前用它确认已确认的分片与本地文件仍然一致。XXH3 用于分段的完整性校验
+struct Md5 {
+    uint32_t state[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    uint8_t block[64];
+    size_t blockLen = 0;
+    uint64_t totalLen = 0;
+
+    static uint32_t rotl(uint32_t x, int n) { return (x << n) | (x >> (32 - n)); }
+
+    void transform(const uint8_t* data) {
+        static const uint32_t k[64] = {
+            0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+            0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+            0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+            0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+            0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+            0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+            0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+            0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391};
+        static const int shift[16] = {7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21};
+        uint32_t w[16];
+        for (int i = 0; i < 16; i++) {
+            w[i] = data[i * 4] | (uint32_t)data[i * 4 + 1] << 8 | (uint32_t)data[i * 4 + 2] << 16 |
+                   (uint32_t)data[i * 4 + 3] << 24;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        for (int i = 0; i < 64; i++) {
+            uint32_t f;
+            int g;
+            if (i < 16) {
+                f = (b & c) | (~b & d);
+                g = i;
+            } else if (i < 32) {
+                f = (d & b) | (~d & c);
+                g = (5 * i + 1) % 16;
+            } else if (i < 48) {
+                f = b ^ c ^ d;
+                g = (3 * i + 5) % 16;
+            } else {
+                f = c ^ (b | ~d);
+                g = (7 * i) % 16;
+            }
+            uint32_t t = d;
+            d = c;
+            c = b;
+            b = b + rotl(a + f + k[i] + w[g], shift[(i / 16) * 4 + i % 4]);
+            a = t;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    }
+
+    void update(const void* data, size_t len) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        totalLen += len;
+        if (blockLen > 0) {
+            size_t n = std::min(len, sizeof(block) - blockLen);
+            memcpy(block + blockLen, p, n);
+            blockLen += n;
+            p += n;
+            len -= n;
+            if (blockLen < sizeof(block)) return;
+            transform(block);
+            blockLen = 0;
+        }
+        for (; len >= sizeof(block); p += sizeof(block), len -= sizeof(block)) transform(p);
+        memcpy(block, p, len);
+        blockLen = len;
+    }
+
+    std::string digest() {
+        uint64_t bits = totalLen * 8;
+        uint8_t pad = 0x80;
+        update(&pad, 1);
+        uint8_t zero = 0;
+        while (blockLen != 56) update(&zero, 1);
+        uint8_t lenBytes[8];
+        for (int i = 0; i < 8; i++) lenBytes[i] = (uint8_t)(bits >> (i * 8));
+        update(lenBytes, 8);
+        std::string out(16, '\0');
+        for (int i = 0; i < 16; i++) out[i] = (char)(state[i / 4] >> ((i % 4) * 8));
+        return out;
+    }
+};
+
+std::string base64Encode(const std::string& bytes) {
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    out.reserve((bytes.size() + 2) / 3 * 4);
+    for (size_t i = 0; i < bytes.size(); i += 3) {
+        uint32_t v = (uint8_t)bytes[i] << 16;
+        if (i + 1 < bytes.size()) v |= (uint8_t)bytes[i + 1] << 8;
+        if (i + 2 < bytes.size()) v |= (uint8_t)bytes[i + 2];
+        out += table[(v >> 18) & 0x3F];
+        out += table[(v >> 12) & 0x3F];
+        out += i + 1 < bytes.size() ? table[(v >> 6) & 0x3F] : '=';
+        out += i + 2 < bytes.size() ? table[v & 0x3F] : '=';
+    }
+    return out;
+}
+
+uint32_t crc32cSoftware(const uint8_t* p, size_t len, uint32_t crc) {
+    struct Table {
+        uint32_t t[256];
+        Table() {
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++) c = (c & 1) ? 0x82F63B78 ^ (c >> 1) : c >> 1;
+                t[i] = c;
+            }
+        }
+    };
+    static const Table table;   // 分片线程并发调用，局部静态对象的初始化是线程安全的
+    while (len--) crc = table.t[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+// x86 的 SSE4.2 和 ARMv8 的 CRC 扩展都有 CRC32C 指令，运行时检测，不支持时退回查表
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) uint32_t crc32cHardware(const uint8_t* p, size_t len, uint32_t crc) {
+    uint64_t c = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = __builtin_ia32_crc32di(c, v);
+    }
+    crc = (uint32_t)c;
+    while (len--) crc = __builtin_ia32_crc32qi(crc, *p++);
+    return crc;
+}
+
+bool crc32cHardwareSupported() { return __builtin_cpu_supports("sse4.2"); }
+#elif defined(__aarch64__)
+__attribute__((target("+crc"))) uint32_t crc32cHardware(const uint8_t* p, size_t len, uint32_t crc) {
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = __builtin_aarch64_crc32cx(crc, v);
+    }
+    while (len--) crc = __builtin_aarch64_crc32cb(crc, *p++);
+    return crc;
+}
+
+bool crc32cHardwareSupported() { return getauxval(AT_HWCAP) & HWCAP_CRC32; }
+#else
+uint32_t crc32cHardware(const uint8_t* p, size_t len, uint32_t crc) { return crc32cSoftware(p, len, crc); }
+
+bool crc32cHardwareSupported() { return false; }
+#endif
+
+uint32_t crc32c(const void* data, size_t len, uint32_t crc = 0) {
+    static const bool hardware = crc32cHardwareSupported();
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    return ~(hardware ? crc32cHardware(p, len, ~crc) : crc32cSoftware(p, len, ~crc));
+}
+
+// XXH3-64 (seed 0)，与 xxhsum -H3 的结果一致，用于分段完整性校验。
+// 长输入按 64 字节条带累加到 8 个 64 位累加器，每 16 条带 (1KB) 用密钥扰乱一次；
+// 累加/扰乱有 SSE2 (x86_64) 和 NEON (aarch64) 实现，启动时与标量实现对照一次，不一致则退回标量
+const uint8_t XXH3_SECRET[192] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+const uint64_t XXH_PRIME32_1 = 0x9E3779B1u;
+const uint64_t XXH_PRIME32_2 = 0x85EBCA77u;
+const uint64_t XXH_PRIME32_3 = 0xC2B2AE3Du;
+const uint64_t XXH_PRIME64_1 = 0x9E3779B185EBCA87ull;
+const uint64_t XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4Full;
+const uint64_t XXH_PRIME64_3 = 0x165667B19E3779F9ull;
+const uint64_t XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ull;
+const uint64_t XXH_PRIME64_5 = 0x27D4EB2F165667C5ull;
+const size_t XXH3_STRIPE_LEN = 64;
+const size_t XXH3_BLOCK_LEN = 1024;   // (192 - 64) / 8 = 16 个条带
+
+uint64_t readLE64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+uint32_t readLE32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+uint64_t xxhMul128Fold64(uint64_t a, uint64_t b) {
+    unsigned __int128 product = (unsigned __int128)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+uint64_t xxh64Avalanche(uint64_t h) {
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    return h ^ (h >> 32);
+}
+
+uint64_t xxh3Avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ull;
+    return h ^ (h >> 32);
+}
+
+uint64_t xxh3Mix16(const uint8_t* p, const uint8_t* secret) {
+    return xxhMul128Fold64(readLE64(p) ^ readLE64(secret), readLE64(p + 8) ^ readLE64(secret + 8));
+}
+
+// 不超过 240 字节的输入不走条带累加，各长度区间的混合方式不同
+uint64_t xxh3HashShort(const uint8_t* p, size_t len) {
+    const uint8_t* s = XXH3_SECRET;
+    if (len == 0) return xxh64Avalanche(readLE64(s + 56) ^ readLE64(s + 64));
+    if (len <= 3) {
+        uint32_t combined = ((uint32_t)p[0] << 16) | ((uint32_t)p[len >> 1] << 24) | p[len - 1] | ((uint32_t)len << 8);
+        return xxh64Avalanche(combined ^ (uint64_t)(readLE32(s) ^ readLE32(s + 4)));
+    }
+    if (len <= 8) {
+        uint64_t input = readLE32(p + len - 4) + ((uint64_t)readLE32(p) << 32);
+        uint64_t h = input ^ (readLE64(s + 8) ^ readLE64(s + 16));
+        h ^= ((h << 49) | (h >> 15)) ^ ((h << 24) | (h >> 40));
+        h *= 0x9FB21C651E98DF25ull;
+        h ^= (h >> 35) + len;
+        h *= 0x9FB21C651E98DF25ull;
+        return h ^ (h >> 28);
+    }
+    if (len <= 16) {
+        uint64_t lo = readLE64(p) ^ (readLE64(s + 24) ^ readLE64(s + 32));
+        uint64_t hi = readLE64(p + len - 8) ^ (readLE64(s + 40) ^ readLE64(s + 48));
+        return xxh3Avalanche(len + __builtin_bswap64(lo) + hi + xxhMul128Fold64(lo, hi));
+    }
+    uint64_t acc = len * XXH_PRIME64_1;
+    if (len <= 128) {
+        for (size_t i = 0; i <= (len - 1) / 32; i++) {
+            acc += xxh3Mix16(p + 16 * i, s + 32 * i);
+            acc += xxh3Mix16(p + len - 16 * (i + 1), s + 32 * i + 16);
+        }
+        return xxh3Avalanche(acc);
+    }
+    for (size_t i = 0; i < 8; i++) acc += xxh3Mix16(p + 16 * i, s + 16 * i);
+    acc = xxh3Avalanche(acc);
+    uint64_t accEnd = xxh3Mix16(p + len - 16, s + 136 - 17);
+    for (size_t i = 8; i < len / 16; i++) accEnd += xxh3Mix16(p + 16 * i, s + 16 * (i - 8) + 3);
+    return xxh3Avalanche(acc + accEnd);
+}
+
+void xxh3AccumulateScalar(uint64_t* acc, const uint8_t* p, const uint8_t* secret) {
+    for (int lane = 0; lane < 8; lane++) {
+        uint64_t data = readLE64(p + 8 * lane);
+        uint64_t key = data ^ readLE64(secret + 8 * lane);
+        acc[lane ^ 1] += data;
+        acc[lane] += (key & 0xFFFFFFFF) * (key >> 32);
+    }
+}
+
+void xxh3ScrambleScalar(uint64_t* acc, const uint8_t* secret) {
+    for (int lane = 0; lane < 8; lane++) {
+        uint64_t a = acc[lane];
+        a ^= a >> 47;
+        a ^= readLE64(secret + 8 * lane);
+        acc[lane] = a * XXH_PRIME32_1;
+    }
+}
+
+#if defined(__x86_64__)
+void xxh3AccumulateSimd(uint64_t* acc, const uint8_t* p, const uint8_t* secret) {
+    for (int i = 0; i < 4; i++) {
+        __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p) + i);
+        __m128i key = _mm_xor_si128(data, _mm_loadu_si128(reinterpret_cast<const __m128i*>(secret) + i));
+        __m128i product = _mm_mul_epu32(key, _mm_shuffle_epi32(key, _MM_SHUFFLE(0, 3, 0, 1)));
+        __m128i* a = reinterpret_cast<__m128i*>(acc) + i;
+        __m128i sum = _mm_add_epi64(_mm_loadu_si128(a), _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2)));
+        _mm_storeu_si128(a, _mm_add_epi64(product, sum));
+    }
+}
+
+void xxh3ScrambleSimd(uint64_t* acc, const uint8_t* secret) {
+    const __m128i prime = _mm_set1_epi32((int)XXH_PRIME32_1);
+    for (int i = 0; i < 4; i++) {
+        __m128i* a = reinterpret_cast<__m128i*>(acc) + i;
+        __m128i v = _mm_loadu_si128(a);
+        v = _mm_xor_si128(v, _mm_srli_epi64(v, 47));
+        v = _mm_xor_si128(v, _mm_loadu_si128(reinterpret_cast<const __m128i*>(secret) + i));
+        __m128i lo = _mm_mul_epu32(v, prime);
+        __m128i hi = _mm_mul_epu32(_mm_shuffle_epi32(v, _MM_SHUFFLE(0, 3, 0, 1)), prime);
+        _mm_storeu_si128(a, _mm_add_epi64(lo, _mm_slli_epi64(hi, 32)));
+    }
+}
+#elif defined(__aarch64__)
+void xxh3AccumulateSimd(uint64_t* acc, const uint8_t* p, const uint8_t* secret) {
+    for (int i = 0; i < 4; i++) {
+        uint64x2_t data = vreinterpretq_u64_u8(vld1q_u8(p + 16 * i));
+        uint64x2_t key = veorq_u64(data, vreinterpretq_u64_u8(vld1q_u8(secret + 16 * i)));
+        uint64x2_t sum = vaddq_u64(vld1q_u64(acc + 2 * i), vextq_u64(data, data, 1));
+        vst1q_u64(acc + 2 * i, vmlal_u32(sum, vmovn_u64(key), vshrn_n_u64(key, 32)));
+    }
+}
+
+void xxh3ScrambleSimd(uint64_t* acc, const uint8_t* secret) {
+    const uint32x2_t prime = vdup_n_u32((uint32_t)XXH_PRIME32_1);
+    for (int i = 0; i < 4; i++) {
+        uint64x2_t v = vld1q_u64(acc + 2 * i);
+        v = veorq_u64(v, vshrq_n_u64(v, 47));
+        v = veorq_u64(v, vreinterpretq_u64_u8(vld1q_u8(secret + 16 * i)));
+        uint64x2_t hi = vshlq_n_u64(vmull_u32(vshrn_n_u64(v, 32), prime), 32);
+        vst1q_u64(acc + 2 * i, vmlal_u32(hi, vmovn_u64(v), prime));
+    }
+}
+#else
+void xxh3AccumulateSimd(uint64_t* acc, const uint8_t* p, const uint8_t* secret) { xxh3AccumulateScalar(acc, p, secret); }
+
+void xxh3ScrambleSimd(uint64_t* acc, const uint8_t* secret) { xxh3ScrambleScalar(acc, secret); }
+#endif
+
+struct Xxh3Kernels {
+    void (*accumulate)(uint64_t*, const uint8_t*, const uint8_t*);
+    void (*scramble)(uint64_t*, const uint8_t*);
+};
+
+// 流式 XXH3：缓存一个 1KB 块，只有确定后面还有数据时才处理满块，
+// 因为整体长度恰为块长整数倍时最后一块要按"不完整块 + 末条带"处理
+struct Xxh3 {
+    uint64_t acc[8] = {XXH_PRIME32_3, XXH_PRIME64_1, XXH_PRIME64_2, XXH_PRIME64_3,
+                       XXH_PRIME64_4, XXH_PRIME32_2, XXH_PRIME64_5, XXH_PRIME32_1};
+    uint8_t buffer[XXH3_BLOCK_LEN];
+    uint8_t lastStripe[XXH3_STRIPE_LEN];   // 上一块的末尾 64 字节，末条带可能跨块
+    size_t bufferLen = 0;
+    uint64_t totalLen = 0;
+    Xxh3Kernels kernels;
+
+    explicit Xxh3(const Xxh3Kernels& k = kernelsForCpu()) : kernels(k) {}
+
+    static Xxh3Kernels kernelsForCpu();
+
+    void update(const void* data, size_t len) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        totalLen += len;
+        while (len > 0) {
+            if (bufferLen == XXH3_BLOCK_LEN) {
+                for (size_t i = 0; i < XXH3_BLOCK_LEN / XXH3_STRIPE_LEN; i++) {
+                    kernels.accumulate(acc, buffer + i * XXH3_STRIPE_LEN, XXH3_SECRET + i * 8);
+                }
+                kernels.scramble(acc, XXH3_SECRET + sizeof(XXH3_SECRET) - XXH3_STRIPE_LEN);
+                memcpy(lastStripe, buffer + XXH3_BLOCK_LEN - XXH3_STRIPE_LEN, XXH3_STRIPE_LEN);
+                bufferLen = 0;
+            }
+            size_t n = std::min(len, XXH3_BLOCK_LEN - bufferLen);
+            memcpy(buffer + bufferLen, p, n);
+            bufferLen += n;
+            p += n;
+            len -= n;
+        }
+    }
+
+    uint64_t digest() const {
+        if (totalLen <= 240) return xxh3HashShort(buffer, totalLen);
+        uint64_t a[8];
+        memcpy(a, acc, sizeof(a));
+        size_t stripes = (bufferLen - 1) / XXH3_STRIPE_LEN;
+        for (size_t i = 0; i < stripes; i++) {
+            kernels.accumulate(a, buffer + i * XXH3_STRIPE_LEN, XXH3_SECRET + i * 8);
+        }
+        uint8_t last[XXH3_STRIPE_LEN];
+        if (bufferLen >= XXH3_STRIPE_LEN) {
+            memcpy(last, buffer + bufferLen - XXH3_STRIPE_LEN, XXH3_STRIPE_LEN);
+        } else {
+            size_t carry = XXH3_STRIPE_LEN - bufferLen;
+            memcpy(last, lastStripe + XXH3_STRIPE_LEN - carry, carry);
+            memcpy(last + carry, buffer, bufferLen);
+        }
+        kernels.accumulate(a, last, XXH3_SECRET + sizeof(XXH3_SECRET) - XXH3_STRIPE_LEN - 7);
+
+        uint64_t result = totalLen * XXH_PRIME64_1;
+        for (int i = 0; i < 4; i++) {
+            const uint8_t* s = XXH3_SECRET + 11 + 16 * i;
+            result += xxhMul128Fold64(a[2 * i] ^ readLE64(s), a[2 * i + 1] ^ readLE64(s + 8));
+        }
+        return xxh3Avalanche(result);
+    }
+};
+
+Xxh3Kernels Xxh3::kernelsForCpu() {
+    static const Xxh3Kernels kernels = [] {
+        Xxh3Kernels scalar = {xxh3AccumulateScalar, xxh3ScrambleScalar};
+        Xxh3Kernels simd = {xxh3AccumulateSimd, xxh3ScrambleSimd};
+        std::vector<uint8_t> sample(4096 + 77);
+        uint32_t x = 1;
+        for (auto& b : sample) b = (uint8_t)((x = x * 1103515245 + 12345) >> 16);
+        Xxh3 a(scalar), b(simd);
+        a.update(sample.data(), sample.size());
+        b.update(sample.data(), sample.size());
+        if (a.digest() != b.digest()) {
+            std::cerr << "XXH3 SIMD 实现自检失败，使用标量实现" << std::endl;
+            return scalar;
+        }
+        return simd;
+    }();
+    return kernels;
+}
+
+std::string xxh3Hex(uint64_t digest) {
+    char buffer[17];
+    snprintf(buffer, sizeof(buffer), "%016llx", (unsigned long long)digest);
+    return buffer;
+}
+
+// ==================== 画面冻结检测 ====================
+// 摄像头卡死时常常持续发送同一幅画面，copy 模式录制照样写满数小时。录制进程另把视频流原样
+// 以 mpegts 写入命名管道，这里按 TS 包解出关键帧的 PES 负载并计算 XXH3，不解码。
+// 相同画面重新编码得到的 slice 数据相同，只有 slice header 中的 idr_pic_id、POC 等字段逐帧变化，
+// 所以跳过参数集、SEI 等小 NAL 单元，并跳过每个 slice 开头的若干字节
+const size_t TS_PACKET_BYTES = 188;
+const size_t FREEZE_MIN_NAL_BYTES = 256;
+const size_t FREEZE_SKIP_NAL_BYTES = 32;
+const size_t FREEZE_MAX_KEYFRAME_BYTES = 8 * 1024 * 1024;
+
+struct VideoTap {
+    int videoPid = -1;               // 第一个带视频 PES 的 PID
+    bool keyframe = false;           // 当前 PES 以随机访问点开始
+    std::vector<uint8_t> frame;      // 当前关键帧的 PES 负载，不含 PES 头
+};
+
+struct FreezeState {
+    bool frozen = false;
+    uint64_t lastHash = 0;
+    int64_t repeatSinceMs = 0;   // 当前画面第一次出现的时间
+    uint32_t repeats = 0;        // 当前画面连续出现的关键帧数
+    std::time_t frozenSince = 0;
+    uint64_t keyframes = 0;
+    uint64_t freezes = 0;
+    uint64_t hashNs = 0;         // 累计摘要耗时
+    uint64_t skippedKeyframes = 0;   // 没有足够大的 NAL 单元、无法比较的关键帧
+};
+
+std::mutex freezeMutex;
+FreezeState freezeStates[3];
+
+// 处理一个 TS 包。关键帧的 PES 在下一个 PES 开始时结束，此时返回 true，负载移入 done
+bool tapTsPacket(const uint8_t* p, VideoTap& tap, std::vector<uint8_t>& done) {
+    int pid = ((p[1] & 0x1F) << 8) | p[2];
+    bool unitStart = p[1] & 0x40;
+    int adaptation = (p[3] >> 4) & 0x03;
+    if (!(adaptation & 0x01)) return false;
+    size_t offset = 4;
+    bool randomAccess = false;
+    if (adaptation & 0x02) {
+        randomAccess = p[4] > 0 && (p[5] & 0x40);
+        offset += 1 + p[4];
+    }
+    if (offset >= TS_PACKET_BYTES) return false;
+    const uint8_t* payload = p + offset;
+    size_t length = TS_PACKET_BYTES - offset;
+
+    if (unitStart && tap.videoPid < 0 && length >= 9 && payload[0] == 0 && payload[1] == 0 && payload[2] == 1 &&
+        (payload[3] & 0xF0) == 0xE0) {
+        tap.videoPid = pid;
+    }
+    if (pid != tap.videoPid) return false;
+
+    bool finished = false;
+    if (unitStart) {
+        if (tap.keyframe && !tap.frame.empty()) {
+            done.swap(tap.frame);
+            finished = true;
+        }
+        tap.frame.clear();
+        tap.keyframe = false;
+        if (length < 9 || payload[0] != 0 || payload[1] != 0 || payload[2] != 1) return finished;
+        size_t header = 9 + payload[8];
+        if (header >= length || !randomAccess) return finished;
+        tap.keyframe = true;
+        payload += header;
+        length -= header;
+    }
+    if (tap.keyframe) {
+        if (tap.frame.size() + length > FREEZE_MAX_KEYFRAME_BYTES) {
+            tap.keyframe = false;
+            tap.frame.clear();
+        } else {
+            tap.frame.insert(tap.frame.end(), payload, payload + length);
+        }
+    }
+    return finished;
+}
+
+// 关键帧画面内容的摘要：按起始码切分 NAL 单元，只对大的 NAL 单元去掉开头部分后计算。
+// 没有足够大的 NAL 单元时返回 false：只剩逐帧变化的头部，无从判断画面是否相同
+bool keyframeDigest(const std::vector<uint8_t>& frame, uint64_t& digest) {
+    Xxh3 hash;
+    bool hashed = false;
+    const uint8_t* data = frame.data();
+    size_t size = frame.size();
+    size_t nalStart = SIZE_MAX;
+    auto addNal = [&](size_t begin, size_t end) {
+        if (begin != SIZE_MAX && end - begin >= FREEZE_MIN_NAL_BYTES) {
+            hash.update(data + begin + FREEZE_SKIP_NAL_BYTES, end - begin - FREEZE_SKIP_NAL_BYTES);
+            hashed = true;
+        }
+    };
+    // 起始码 00 00 01 中的 01 在压缩数据里很少出现，用 memchr 跳着找
+    size_t pos = 2;
+    while (pos < size) {
+        const uint8_t* one = static_cast<const uint8_t*>(memchr(data + pos, 1, size - pos));
+        if (!one) break;
+        pos = one - data;
+        if (data[pos - 1] == 0 && data[pos - 2] == 0) {
+            addNal(nalStart, pos - 2);
+            nalStart = pos + 1;
+        }
+        pos++;
+    }
+    addNal(nalStart, size);
+    digest = hash.digest();
+    return hashed;
+}
+
+// 每个关键帧调用一次：同一画面持续超过阈值时告警，画面变化后告警结束
+void recordKeyframe(int channel, const std::vector<uint8_t>& frame) {
+    auto begin = std::chrono::steady_clock::now();
+    uint64_t hash;
+    bool comparable = keyframeDigest(frame, hash);
+    uint64_t elapsedNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - begin).count();
+    int64_t now = monotonicMs();
+    int64_t thresholdMs = (int64_t)config.freeze_threshold_seconds * 1000;
+
+    std::string state, note;
+    {
+        std::lock_guard<std::mutex> lock(freezeMutex);
+        FreezeState& freeze = freezeStates[channel];
+        freeze.keyframes++;
+        freeze.hashNs += elapsedNs;
+        if (!comparable) {
+            freeze.skippedKeyframes++;
+            return;
+        }
+        if (freeze.repeats > 0 && hash == freeze.lastHash) {
+            freeze.repeats++;
+        } else {
+            if (freeze.frozen) {
+                freeze.frozen = false;
+                state = "end";
+                note = "画面恢复，冻结持续 " + std::to_string(std::time(nullptr) - freeze.frozenSince) + " 秒";
+            }
+            freeze.lastHash = hash;
+            freeze.repeats = 1;
+            freeze.repeatSinceMs = now;
+        }
+        if (!freeze.frozen && thresholdMs > 0 && freeze.repeats > 1 && now - freeze.repeatSinceMs >= thresholdMs) {
+            freeze.frozen = true;
+            freeze.frozenSince = std::time(nullptr) - (now - freeze.repeatSinceMs) / 1000;
+            freeze.freezes++;
+            state = "start";
+            note = "画面冻结：连续 " + std::to_string(freeze.repeats) + " 个关键帧相同，已持续 " +
+                   std::to_string((now - freeze.repeatSinceMs) / 1000) + " 秒";
+        }
+    }
+    // 告警要写文件并可能触发事件录制，交给单独的线程，管道读取不因磁盘慢而停顿
+    if (!state.empty()) std::thread([channel, state, note]() { raiseDetection(channel, "freeze", state, note); }).detach();
+}
+
+// 管道以读写方式打开，录制进程重启不会读到 EOF；重启时残留的半个包靠同步字节重新对齐
+void videoTapLoop(int channel, int fd) {
+    std::vector<uint8_t> pending;
+    std::vector<uint8_t> keyframe;
+    uint8_t chunk[TS_PACKET_BYTES * 64];
+    VideoTap tap;
+    while (true) {
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        pending.insert(pending.end(), chunk, chunk + n);
+        size_t pos = 0;
+        while (pending.size() - pos >= TS_PACKET_BYTES) {
+            const uint8_t* packet = pending.data() + pos;
+            if (packet[0] != 0x47 ||
+                (pending.size() - pos > TS_PACKET_BYTES && packet[TS_PACKET_BYTES] != 0x47)) {
+                pos++;
+                continue;
+            }
+            pos += TS_PACKET_BYTES;
+            if (tapTsPacket(packet, tap, keyframe)) recordKeyframe(channel, keyframe);
+        }
+        pending.erase(pending.begin(), pending.begin() + pos);
+    }
+    std::cerr << "通道" << channel << " 视频管道读取失败: " << strerror(errno) << std::endl;
+    close(fd);
+}
+
+void startVideoTapReaders() {
+    for (int channel = 1; channel <= 2; channel++) {
+        int fd = openRecorderFifo(videoTapPath(channel));
+        if (fd >= 0) std::thread(videoTapLoop, channel, fd).detach();
+    }
+}
+
+json freezeToJson(int channel) {
+    std::lock_guard<std::mutex> lock(freezeMutex);
+    const FreezeState& freeze = freezeStates[channel];
+    json result;
+    result["enabled"] = config.freeze_threshold_seconds > 0;
+    result["frozen"] = freeze.frozen;
+    result["frozenSince"] = freeze.frozen ? json(freeze.frozenSince) : json(nullptr);
+    result["identicalKeyframes"] = freeze.repeats;
+    result["keyframes"] = freeze.keyframes;
+    result["freezes"] = freeze.freezes;
+    result["skippedKeyframes"] = freeze.skippedKeyframes;
+    result["avgHashUs"] = freeze.keyframes > 0 ? freeze.hashNs / 1000.0 / freeze.keyframes : 0.0;
+    return result;
+}
+
+// ==================== S3 客户端 (SigV4, 分片上传) ====================
+// 使用 path-style 地址 (http://host:port/bucket/key)，兼容 MinIO 及本地桩服务。
+// 分片正文使用 UNSIGNED-PAYLOAD 签名，边读文件边发送，不在内存中缓存整个分片。
+struct S3Endpoint {
+    std::string scheme;
+    std::string host;   // 含端口，用作 Host 头
+    std::string bucket;
+    std::string accessKey;
+    std::string secretKey;
+    std::string region;
+};
+
+bool makeS3Endpoint(S3Endpoint& endpoint, std::string& error) {
+    std::lock_guard<std::mutex> lock(configMutex);
+    std::string url = config.s3_endpoint;
+    size_t schemeEnd = url.find("://");
+    if (schemeEnd == std::string::npos || config.s3_bucket.empty()) {
+        error = "S3配置不完整 (s3_endpoint / s3_bucket)";
+        return false;
+    }
+    endpoint.scheme = url.substr(0, schemeEnd);
+    if (endpoint.scheme != "http") {
+        error = "当前构建仅支持 http 协议的 S3 端点";
+        return false;
+    }
+    endpoint.host = url.substr(schemeEnd + 3);
+    while (!endpoint.host.empty() && endpoint.host.back() == '/') endpoint.host.pop_back();
+    endpoint.bucket = config.s3_bucket;
+    endpoint.accessKey = config.s3_access_key;
+    endpoint.secretKey = config.s3_secret_key;
+    endpoint.region = config.s3_region.empty() ? "us-east-1" : config.s3_region;
+    return true;
+}
+
+// RFC 3986 编码，对象键中的 '/' 保留
+std::string s3UriEncode(const std::string& value, bool keepSlash) {
+    static const char digits[] = "0123456789ABCDEF";
+    std::string out;
+    for (unsigned char c : value) {
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' || (keepSlash && c == '/')) {
+            out += (char)c;
+        } else {
+            out += '%';
+            out += digits[c >> 4];
+            out += digits[c & 0x0F];
+        }
+    }
+    return out;
+}
+
+struct S3Request {
+    std::string method;
+    std::string key;
+    std::map<std::string, std::string> query;
+    std::string payloadHash;   // 正文的 sha256 十六进制，或 UNSIGNED-PAYLOAD
+};
+
+// 生成带 SigV4 签名的请求路径和请求头
+std::string signS3Request(const S3Endpoint& endpoint, const S3Request& request, Headers& headers) {
+    char amzDate[32], dateStamp[16];
+    std::time_t now = std::time(nullptr);
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    std::strftime(amzDate, sizeof(amzDate), "%Y%m%dT%H%M%SZ", &tm);
+    std::strftime(dateStamp, sizeof(dateStamp), "%Y%m%d", &tm);
+
+    std::string canonicalUri = "/" + s3UriEncode(endpoint.bucket, false) + "/" + s3UriEncode(request.key, true);
+    std::string canonicalQuery;
+    for (const auto& item : request.query) {
+        if (!canonicalQuery.empty()) canonicalQuery += "&";
+        canonicalQuery += s3UriEncode(item.first, false) + "=" + s3UriEncode(item.second, false);
+    }
+
+    std::string canonicalHeaders = "host:" + endpoint.host + "\n" +
+                                   "x-amz-content-sha256:" + request.payloadHash + "\n" +
+                                   "x-amz-date:" + amzDate + "\n";
+    std::string signedHeaders = "host;x-amz-content-sha256;x-amz-date";
+    std::string canonicalRequest = request.method + "\n" + canonicalUri + "\n" + canonicalQuery + "\n" +
+                                   canonicalHeaders + "\n" + signedHeaders + "\n" + request.payloadHash;
+
+    std::string scope = std::string(dateStamp) + "/" + endpoint.region + "/s3/aws4_request";
+    std::string stringToSign = std::string("AWS4-HMAC-SHA256\n") + amzDate + "\n" + scope + "\n" + sha256Hex(canonicalRequest);
+    std::string signingKey = hmacSha256(hmacSha256(hmacSha256(hmacSha256("AWS4" + endpoint.secretKey, dateStamp),
+                                                              endpoint.region), "s3"), "aws4_request");
+    std::string signature = toHex(hmacSha256(signingKey, stringToSign));
+
+    headers.emplace("Host", endpoint.host);
+    headers.emplace("x-amz-date", amzDate);
+    headers.emplace("x-amz-content-sha256", request.payloadHash);
+    headers.emplace("Authorization", "AWS4-HMAC-SHA256 Credential=" + endpoint.accessKey + "/" + scope +
+                                     ", SignedHeaders=" + signedHeaders + ", Signature=" + signature);
+    return canonicalQuery.empty() ? canonicalUri : canonicalUri + "?" + canonicalQuery;
+}
+
+std::unique_ptr<Client> makeS3Client(const S3Endpoint& endpoint) {
+    std::unique_ptr<Client> client(new Client(endpoint.scheme + "://" + endpoint.host));
+    client->set_keep_alive(true);
+    client->set_url_encode(false);
+    client->set_connection_timeout(10);
+    client->set_read_timeout(60);
+    client->set_write_timeout(60);
+    return client;
+}
+
+// 从 XML 响应中取出 <tag>...</tag> 的内容
+std::string xmlValue(const std::string& xml, const std::string& tag) {
+    size_t begin = xml.find("<" + tag + ">");
+    if (begin == std::string::npos) return "";
+    begin += tag.size() + 2;
+    size_t end = xml.find("</" + tag + ">", begin);
+    return end == std::string::npos ? "" : xml.substr(begin, end - begin);
+}
+
+std::string s3ErrorMessage(const Result& result) {
+    if (!result) return "连接失败: " + httplib::to_string(result.error());
+    std::string code = xmlValue(result->body, "Code");
+    std::string message = xmlValue(result->body, "Message");
+    return "HTTP " + std::to_string(result->status) + (code.empty() ? "" : " " + code) +
+           (message.empty() ? "" : ": " + message);
+}
+
+// 所有上传线程共享的令牌桶，速率取 upload_bandwidth_kbps，桶容量为 1 秒的流量，
+// 避免上传挤占同一上行链路上的 RTSP 拉流
+struct TokenBucket {
+    std::mutex mutex;
+    double tokens = 0;
+    std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+
+    void acquire(size_t bytes) {
+        while (true) {
+            double rate = config.upload_bandwidth_kbps * 1000.0 / 8;
+            if (rate <= 0) return;
+            double wait;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto now = std::chrono::steady_clock::now();
+                double capacity = std::max(rate, 65536.0);
+                tokens = std::min(capacity, tokens + rate * std::chrono::duration<double>(now - last).count());
+                last = now;
+                if (tokens >= bytes) {
+                    tokens -= bytes;
+                    return;
+                }
+                wait = (bytes - tokens) / rate;
+            }
+            std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+        }
+    }
+};
+
+TokenBucket uploadBandwidth;
+
+bool readFileRange(int fd, off_t offset, size_t length, std::string& out) {
+    out.resize(length);
+    size_t done = 0;
+    while (done < length) {
+        ssize_t got = pread(fd, &out[done], length - done, offset + done);
+        if (got <= 0) return false;
+        done += got;
+    }
+    return true;
+}
+
+// 以 64KB 为单位把内存中的分片写入请求体，经过令牌桶限速
+ContentProvider bufferProvider(const std::string& data, std::function<void(size_t)> onSent) {
+    return [&data, onSent](size_t position, size_t length, DataSink& sink) {
+        size_t n = std::min<size_t>(length, 65536);
+        uploadBandwidth.acquire(n);
+        if (!sink.write(data.data() + position, n)) return false;
+        if (onSent) onSent(n);
+        return true;
+    };
+}
+
+std::string contentMd5(const std::string& data) {
+    Md5 md5;
+    md5.update(data.data(), data.size());
+    return base64Encode(md5.digest());
+}
+
+bool s3PutObject(Client& client, const S3Endpoint& endpoint, const std::string& key, const std::string& data,
+                 std::function<void(size_t)> onSent, std::string& error) {
+    Headers headers;
+    std::string path = signS3Request(endpoint, {"PUT", key, {}, "UNSIGNED-PAYLOAD"}, headers);
+    headers.emplace("Content-MD5", contentMd5(data));
+    auto result = client.Put(path, headers, data.size(), bufferProvider(data, onSent), "application/octet-stream");
+    if (!result || result->status != 200) {
+        error = s3ErrorMessage(result);
+        return false;
+    }
+    return true;
+}
+
+bool s3CreateMultipartUpload(Client& client, const S3Endpoint& endpoint, const std::string& key,
+                             std::string& uploadId, std::string& error) {
+    Headers headers;
+    std::string path = signS3Request(endpoint, {"POST", key, {{"uploads", ""}}, sha256Hex("")}, headers);
+    auto result = client.Post(path, headers, "", "application/octet-stream");
+    if (!result || result->status != 200) {
+        error = s3ErrorMessage(result);
+        return false;
+    }
+    uploadId = xmlValue(result->body, "UploadId");
+    if (uploadId.empty()) {
+        error = "响应中缺少 UploadId";
+        return false;
+    }
+    return true;
+}
+
+// 分片带 Content-MD5，传输中损坏的分片由服务端拒收（BadDigest）
+bool s3UploadPart(Client& client, const S3Endpoint& endpoint, const std::string& key, const std::string& uploadId,
+                  int partNumber, const std::string& data, const std::string& md5,
+                  std::function<void(size_t)> onSent, std::string& etag, std::string& error) {
+    Headers headers;
+    S3Request request{"PUT", key, {{"partNumber", std::to_string(partNumber)}, {"uploadId", uploadId}}, "UNSIGNED-PAYLOAD"};
+    std::string path = signS3Request(endpoint, request, headers);
+    headers.emplace("Content-MD5", md5);
+    auto result = client.Put(path, headers, data.size(), bufferProvider(data, onSent), "application/octet-stream");
+    if (!result || result->status != 200) {
+        error = s3ErrorMessage(result);
+        return false;
+    }
+    etag = result->get_header_value("ETag");
+    return true;
+}
+
+bool s3CompleteMultipartUpload(Client& client, const S3Endpoint& endpoint, const std::string& key,
+                               const std::string& uploadId, const std::vector<std::string>& etags, std::string& error) {
+    std::string body = "<CompleteMultipartUpload>";
+    for (size_t i = 0; i < etags.size(); i++) {
+        body += "<Part><PartNumber>" + std::to_string(i + 1) + "</PartNumber><ETag>" + etags[i] + "</ETag></Part>";
+    }
+    body += "</CompleteMultipartUpload>";
+
+    Headers headers;
+    std::string path = signS3Request(endpoint, {"POST", key, {{"uploadId", uploadId}}, sha256Hex(body)}, headers);
+    auto result = client.Post(path, headers, body, "application/xml");
+    // CompleteMultipartUpload 可能返回 200 但正文中带 <Error>
+    if (!result || result->status != 200 || result->body.find("<Error>") != std::string::npos) {
+        error = s3ErrorMessage(result);
+        return false;
+    }
+    return true;
+}
+
+void s3AbortMultipartUpload(Client& client, const S3Endpoint& endpoint, const std::string& key, const std::string& uploadId) {
+    Headers headers;
+    std::string path = signS3Request(endpoint, {"DELETE", key, {{"uploadId", uploadId}}, sha256Hex("")}, headers);
+    client.Delete(path, headers);
+}
+
+// ==================== 上传任务队列 ====================
+// /api/upload-to-s3 只负责入队并立即返回任务 id，由固定数量的后台工作线程执行上传；
+// 每个任务的分片再由若干线程并行上传，每个线程复用自己的长连接。
+// 按通道策略在分段关闭时自动入队的任务只在允许时段内执行，失败后退避重试；
+// 未完成的任务和各通道已处理到的位置保存在 upload_queue.json，重启后继续。
+// 分片上传的 uploadId 和每个已确认分片（偏移、长度、ETag、CRC32C）也记录在其中，
+// 断线或重启后从最后确认的分片继续，不再整段重传。
+const int S3_PART_RETRIES = 3;
+const char* UPLOAD_QUEUE_FILE = "upload_queue.json";
+const int MAX_UPLOAD_EVENT_CLIENTS = 2;   // 每个 SSE 连接占用一个服务线程
+
+// 已被服务端确认的分片
+struct UploadPart {
+    int number = 0;
+    int64_t offset = 0;
+    int64_t length = 0;
+    std::string etag;
+    uint32_t crc32c = 0;
+};
+
+struct UploadJob {
+    uint64_t id = 0;
+    std::string filePath;
+    std::string objectName;
+    std::string status;     // queued / active / done / failed
+    std::string message;
+    int64_t size = 0;
+    int64_t bytesSent = 0;
+    std::time_t createdAt = 0;
+    std::time_t startedAt = 0;
+    std::time_t finishedAt = 0;
+    int channel = 0;            // 自动上传任务所属通道，手动上传为 0
+    bool automatic = false;
+    int attempts = 0;
+    std::time_t notBefore = 0;  // 失败重试的最早时间
+    std::string uploadId;       // 进行中的分片上传，用于断点续传
+    int64_t partSize = 0;
+    std::vector<UploadPart> parts;
+    int partRetries = 0;        // 分片/请求级重试次数
+    double rate = 0;            // 发送速率 (字节/秒) 的指数平均
+    int64_t sampleBytes = 0;
+    std::chrono::steady_clock::time_point sampleTime;
+    uint64_t version = 0;       // 最后一次变化时的 uploadVersion，推送时只发送变化的任务
+};
+
+// 每个通道已处理过（已入队或按策略不上传）的关闭分段，逐个分段判断，分段报告的先后顺序不影响结果。
+// 修改时间早于 floor 的分段不再自动入队：首次启动时 floor 为启动时间，已有的分段不补传；
+// 记录只保留一天，更早的由 floor 排除
+const int64_t UPLOAD_HANDLED_SECONDS = 86400;
+
+struct UploadHandled {
+    std::time_t floor = 0;
+    std::map<std::string, std::time_t> segments;   // 分段名 -> 修改时间
+};
+
+std::mutex uploadMutex;
+std::condition_variable uploadCv;
+std::deque<uint64_t> uploadQueue;
+std::map<uint64_t, UploadJob> uploadJobs;
+uint64_t nextUploadJobId = 1;
+UploadHandled uploadHandled[3];
+uint64_t uploadVersion = 0;
+std::condition_variable uploadChangedCv;
+std::atomic<int> uploadEventClients(0);
+
+// 标记任务已变化并唤醒推送连接（调用方持有 uploadMutex）
+void touchUploadJob(UploadJob& job) {
+    job.version = ++uploadVersion;
+    uploadChangedCv.notify_all();
+}
+
+json uploadJobToJson(const UploadJob& job) {
+    json j;
+    j["id"] = job.id;
+    j["filePath"] = job.filePath;
+    j["objectName"] = job.objectName;
+    j["status"] = job.status;
+    j["message"] = job.message;
+    j["size"] = job.size;
+    j["bytesSent"] = job.bytesSent;
+    j["createdAt"] = job.createdAt;
+    j["startedAt"] = job.startedAt;
+    j["finishedAt"] = job.finishedAt;
+    j["channel"] = job.channel;
+    j["automatic"] = job.automatic;
+    j["attempts"] = job.attempts;
+    j["notBefore"] = job.notBefore;
+    j["partsDone"] = job.parts.size();
+    j["partRetries"] = job.partRetries;
+    j["rate"] = job.status == "active" ? (int64_t)job.rate : 0;
+    j["eta"] = job.status == "active" && job.rate > 0 ? (int64_t)((job.size - job.bytesSent) / job.rate) : -1;
+    return j;
+}
+
+// 各状态的任务数和总体速率（调用方持有 uploadMutex）
+json uploadSummaryJson() {
+    json j;
+    int queued = 0, active = 0, failed = 0, done = 0;
+    int64_t pendingBytes = 0;
+    double rate = 0;
+    for (const auto& item : uploadJobs) {
+        const UploadJob& job = item.second;
+        if (job.status == "queued") queued++;
+        if (job.status == "active") active++;
+        if (job.status == "failed") failed++;
+        if (job.status == "done") done++;
+        if (job.status == "queued" || job.status == "active") pendingBytes += std::max<int64_t>(0, job.size - job.bytesSent);
+        if (job.status == "active") rate += job.rate;
+    }
+    j["queued"] = queued;
+    j["active"] = active;
+    j["failed"] = failed;
+    j["done"] = done;
+    j["pendingBytes"] = pendingBytes;
+    j["rate"] = (int64_t)rate;
+    j["bandwidthLimit"] = config.upload_bandwidth_kbps * 1000 / 8;
+    return j;
+}
+
+json uploadPartsToJson(const UploadJob& job) {
+    json j;
+    j["uploadId"] = job.uploadId;
+    j["partSize"] = job.partSize;
+    j["parts"] = json::array();
+    for (const auto& part : job.parts) {
+        j["parts"].push_back({{"number", part.number}, {"offset", part.offset}, {"length", part.length},
+                              {"etag", part.etag}, {"crc32c", part.crc32c}});
+    }
+    return j;
+}
+
+UploadJob uploadJobFromJson(const json& j) {
+    UploadJob job;
+    job.id = j.value("id", (uint64_t)0);
+    job.filePath = j.value("filePath", "");
+    job.objectName = j.value("objectName", "");
+    job.status = j.value("status", "queued");
+    job.message = j.value("message", "");
+    job.size = j.value("size", (int64_t)0);
+    job.createdAt = j.value("createdAt", (std::time_t)0);
+    job.channel = j.value("channel", 0);
+    job.automatic = j.value("automatic", false);
+    job.attempts = j.value("attempts", 0);
+    job.notBefore = j.value("notBefore", (std::time_t)0);
+    if (j.contains("multipart")) {
+        const json& multipart = j["multipart"];
+        job.uploadId = multipart.value("uploadId", "");
+        job.partSize = multipart.value("partSize", (int64_t)0);
+        for (const auto& part : multipart.value("parts", json::array())) {
+            job.parts.push_back({part.value("number", 0), part.value("offset", (int64_t)0), part.value("length", (int64_t)0),
+                                 part.value("etag", ""), part.value("crc32c", (uint32_t)0)});
+        }
+    }
+    return job;
+}
+
+// 保存未完成的任务和各通道已处理的分段（调用方持有 uploadMutex），先写临时文件再 rename
+void saveUploadQueue() {
+    json j;
+    for (int channel = 1; channel <= 2; channel++) {
+        j["handled"][channelName(channel)] = {{"floor", uploadHandled[channel].floor},
+                                              {"segments", uploadHandled[channel].segments}};
+    }
+    j["jobs"] = json::array();
+    for (const auto& item : uploadJobs) {
+        if (item.second.status == "queued" || item.second.status == "active") {
+            json job = uploadJobToJson(item.second);
+            if (!item.second.uploadId.empty()) job["multipart"] = uploadPartsToJson(item.second);
+            j["jobs"].push_back(job);
+        }
+    }
+    std::string tmpPath = std::string(UPLOAD_QUEUE_FILE) + ".tmp";
+    std::ofstream file(tmpPath);
+    if (!file.is_open()) return;
+    file << j.dump(4);
+    file.close();
+    if (rename(tmpPath.c_str(), UPLOAD_QUEUE_FILE) != 0) {
+        std::cerr << "保存上传队列失败: " << strerror(errno) << std::endl;
+    }
+}
+
+void loadUploadQueue() {
+    std::lock_guard<std::mutex> lock(uploadMutex);
+    std::ifstream file(UPLOAD_QUEUE_FILE);
+    if (!file.is_open()) {
+        // 首次启动：已有的分段不补传
+        for (int channel = 1; channel <= 2; channel++) uploadHandled[channel].floor = std::time(nullptr);
+        saveUploadQueue();
+        return;
+    }
+    try {
+        json j;
+        file >> j;
+        for (int channel = 1; channel <= 2; channel++) {
+            UploadHandled& handled = uploadHandled[channel];
+            if (j.contains("handled") && j["handled"].contains(channelName(channel))) {
+                const json& item = j["handled"][channelName(channel)];
+                handled.floor = item.value("floor", (std::time_t)0);
+                handled.segments = item.value("segments", json::object()).get<std::map<std::string, std::time_t>>();
+            } else if (j.contains("watermarks") && j["watermarks"].contains(channelName(channel))) {
+                // 旧版本只保存最后处理的分段，以它的修改时间为 floor
+                const json& mark = j["watermarks"][channelName(channel)];
+                handled.floor = mark.value("modifyTime", (std::time_t)0);
+                if (!mark.value("name", "").empty()) handled.segments[mark.value("name", "")] = handled.floor;
+            }
+        }
+        for (const auto& item : j.value("jobs", json::array())) {
+            UploadJob job = uploadJobFromJson(item);
+            job.status = "queued";   // 上次退出时正在执行的任务重新开始
+            uploadJobs[job.id] = job;
+            uploadQueue.push_back(job.id);
+            nextUploadJobId = std::max(nextUploadJobId, job.id + 1);
+        }
+        std::cout << "恢复上传队列: " << uploadQueue.size() << " 个任务" << std::endl;
+    } catch (const std::exception& e) {
+        std::cerr << "上传队列文件解析错误: " << e.what() << std::endl;
+    }
+}
+
+// 调用方持有 uploadMutex
+uint64_t addUploadJob(const std::string& filePath, const std::string& objectName, int channel, bool automatic) {
+    UploadJob job;
+    job.id = nextUploadJobId++;
+    job.filePath = filePath;
+    job.objectName = objectName;
+    job.status = "queued";
+    job.createdAt = std::time(nullptr);
+    job.channel = channel;
+    job.automatic = automatic;
+    touchUploadJob(job);
+    uploadJobs[job.id] = job;
+    uploadQueue.push_back(job.id);
+    uploadCv.notify_one();
+    return job.id;
+}
+
+uint64_t enqueueUpload(const std::string& filePath, const std::string& objectName) {
+    std::lock_guard<std::mutex> lock(uploadMutex);
+    uint64_t jobId = addUploadJob(filePath, objectName, 0, false);
+    saveUploadQueue();
+    return jobId;
+}
+
+// 分段关闭时按通道策略入队：all 上传所有分段，events 只上传事件片段
+void autoUploadSegment(int channel, const std::string& name, bool isEvent, std::time_t modifyTime) {
+    std::string policy = channelUploadPolicy(channel);
+    std::string filePath = channelSavePath(channel) + "/" + name;
+    std::lock_guard<std::mutex> lock(uploadMutex);
+    UploadHandled& handled = uploadHandled[channel];
+    if (modifyTime < handled.floor || handled.segments.count(name)) return;
+    handled.segments[name] = modifyTime;
+    std::time_t horizon = std::time(nullptr) - UPLOAD_HANDLED_SECONDS;
+    if (horizon > handled.floor) {
+        handled.floor = horizon;
+        for (auto it = handled.segments.begin(); it != handled.segments.end();) {
+            it = it->second < horizon ? handled.segments.erase(it) : std::next(it);
+        }
+    }
+    if (policy == "all" || (policy == "events" && isEvent)) {
+        bool queued = false;
+        for (const auto& item : uploadJobs) {
+            if (item.second.filePath == filePath && item.second.status != "failed") queued = true;
+        }
+        if (!queued) {
+            uint64_t jobId = addUploadJob(filePath, channelName(channel) + "/" + name, channel, true);
+            std::cout << "[上传任务 " << jobId << "] 分段关闭，自动入队: " << filePath << std::endl;
+        }
+    }
+    saveUploadQueue();
+}
+
+// 排队或正在上传的文件路径，这些文件不允许删除
+std::set<std::string> pendingUploadPaths() {
+    std::set<std::string> paths;
+    std::lock_guard<std::mutex> lock(uploadMutex);
+    for (const auto& item : uploadJobs) {
+        if (item.second.status == "queued" || item.second.status == "active") paths.insert(item.second.filePath);
+    }
+    return paths;
+}
+
+// 当前是否处于允许自动上传的时段，时段可以跨越午夜（如 "22:00-06:00"）
+bool inUploadWindow(std::time_t now) {
+    if (config.upload_windows.empty()) return true;
+    struct tm tm;
+    localtime_r(&now, &tm);
+    int minute = tm.tm_hour * 60 + tm.tm_min;
+    for (const auto& window : config.upload_windows) {
+        int h1, m1, h2, m2;
+        if (sscanf(window.c_str(), "%d:%d-%d:%d", &h1, &m1, &h2, &m2) != 4) continue;
+        int begin = h1 * 60 + m1;
+        int end = h2 * 60 + m2;
+        if (begin <= end ? (minute >= begin && minute < end) : (minute >= begin || minute < end)) return true;
+    }
+    return false;
+}
+
+// 下一个可执行的任务：自动任务须在允许时段内，重试任务须到达重试时间（调用方持有 uploadMutex）
+std::deque<uint64_t>::iterator nextRunnableUpload(std::time_t now) {
+    bool inWindow = inUploadWindow(now);
+    for (auto it = uploadQueue.begin(); it != uploadQueue.end(); ++it) {
+        const UploadJob& job = uploadJobs[*it];
+        if (job.notBefore > now || (job.automatic && !inWindow)) continue;
+        return it;
+    }
+    return uploadQueue.end();
+}
+
+// 累计已发送字节，每秒采样一次速率，回滚（重传）时不采样
+void addUploadProgress(uint64_t jobId, int64_t bytes) {
+    std::lock_guard<std::mutex> lock(uploadMutex);
+    UploadJob& job = uploadJobs[jobId];
+    job.bytesSent += bytes;
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - job.sampleTime).count();
+    if (bytes < 0) {
+        job.sampleBytes = job.bytesSent;
+        job.sampleTime = now;
+        touchUploadJob(job);
+    } else if (elapsed >= 1.0) {
+        double current = (job.bytesSent - job.sampleBytes) / elapsed;
+        job.rate = job.rate == 0 ? current : job.rate * 0.7 + current * 0.3;
+        job.sampleBytes = job.bytesSent;
+        job.sampleTime = now;
+        touchUploadJob(job);
+    }
+}
+
+void countUploadRetry(uint64_t jobId) {
+    std::lock_guard<std::mutex> lock(uploadMutex);
+    uploadJobs[jobId].partRetries++;
+    touchUploadJob(uploadJobs[jobId]);
+}
+
+// 清除任务记录的分片上传状态，下次从头开始
+void resetUploadState(uint64_t jobId) {
+    std::lock_guard<std::mutex> lock(uploadMutex);
+    UploadJob& job = uploadJobs[jobId];
+    job.uploadId.clear();
+    job.partSize = 0;
+    job.parts.clear();
+    touchUploadJob(job);
+    saveUploadQueue();
+}
+
+// 服务端已不认识这次分片上传（过期或被清理）或其中的分片，记录失效，只能从头开始
+bool uploadSessionGone(const std::string& error) {
+    return error.find("NoSuchUpload") != std::string::npos || error.find("InvalidPart") != std::string::npos;
+}
+
+// 执行一个上传任务，返回是否成功；记录的分片上传已失效时清除记录，重新开始一次分片上传
+bool runUploadJob(uint64_t jobId, const std::string& filePath, const std::string& key, std::string& error,
+                  bool restarted = false) {
+    S3Endpoint endpoint;
+    if (!makeS3Endpoint(endpoint, error)) return false;
+
+    int fd = open(filePath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        error = "无法打开文件: " + filePath;
+        return false;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    size_t size = st.st_size;
+    size_t partSize = (size_t)std::max(5, config.s3_part_size_mb) * 1024 * 1024;   // S3 要求分片至少 5MB
+    int concurrency = std::max(1, config.s3_part_concurrency);
+
+    // 沿用上次记录的分片上传；文件大小或分片大小变化时旧记录作废
+    std::string uploadId, staleUploadId;
+    std::vector<UploadPart> journaled;
+    bool automatic;
+    {
+        std::lock_guard<std::mutex> lock(uploadMutex);
+        UploadJob& job = uploadJobs[jobId];
+        automatic = job.automatic;
+        if (!job.uploadId.empty()) {
+            if (job.size == (int64_t)size && job.partSize == (int64_t)partSize) {
+                uploadId = job.uploadId;
+                journaled = job.parts;
+            } else {
+                staleUploadId = job.uploadId;
+            }
+        }
+        job.size = size;
+        job.bytesSent = 0;
+        job.sampleBytes = 0;
+        job.sampleTime = std::chrono::steady_clock::now();
+    }
+    auto onSent = [jobId](size_t bytes) { addUploadProgress(jobId, bytes); };
+
+    std::unique_ptr<Client> client = makeS3Client(endpoint);
+    if (!staleUploadId.empty()) {
+        s3AbortMultipartUpload(*client, endpoint, key, staleUploadId);
+        resetUploadState(jobId);
+    }
+    if (size <= partSize) {
+        std::string data;
+        bool ok = readFileRange(fd, 0, size, data);
+        close(fd);
+        if (!ok) {
+            error = "读取文件失败: " + filePath;
+            return false;
+        }
+        ok = false;
+        for (int attempt = 0; attempt < S3_PART_RETRIES && !ok; attempt++) {
+            if (attempt > 0) std::this_thread::sleep_for(std::chrono::seconds(1 << attempt));
+            size_t sentThisAttempt = 0;
+            auto countSent = [&](size_t bytes) { sentThisAttempt += bytes; onSent(bytes); };
+            ok = s3PutObject(*client, endpoint, key, data, countSent, error);
+            if (!ok) {
+                addUploadProgress(jobId, -(int64_t)sentThisAttempt);
+                countUploadRetry(jobId);
+            }
+        }
+        return ok;
+    }
+
+    size_t partCount = (size + partSize - 1) / partSize;
+    std::vector<std::string> etags(partCount);
+    std::vector<UploadPart> confirmed;
+    std::string data;
+    int64_t resumedBytes = 0;
+    for (const auto& part : journaled) {
+        // 只跳过本地内容与记录的 CRC32C 一致的分片
+        if (part.number < 1 || (size_t)part.number > partCount) continue;
+        size_t offset = (part.number - 1) * partSize;
+        size_t length = std::min(partSize, size - offset);
+        if (part.offset != (int64_t)offset || part.length != (int64_t)length) continue;
+        if (!readFileRange(fd, offset, length, data) || crc32c(data.data(), data.size()) != part.crc32c) continue;
+        etags[part.number - 1] = part.etag;
+        confirmed.push_back(part);
+        resumedBytes += length;
+    }
+    {
+        std::lock_guard<std::mutex> lock(uploadMutex);
+        UploadJob& job = uploadJobs[jobId];
+        job.parts = confirmed;
+        job.bytesSent = resumedBytes;
+        job.sampleBytes = resumedBytes;
+        touchUploadJob(job);
+    }
+    if (!uploadId.empty()) {
+        std::cout << "[上传任务 " << jobId << "] 断点续传: 已确认 " << confirmed.size() << "/" << partCount
+                  << " 个分片" << std::endl;
+    } else {
+        if (!s3CreateMultipartUpload(*client, endpoint, key, uploadId, error)) {
+            close(fd);
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(uploadMutex);
+        UploadJob& job = uploadJobs[jobId];
+        job.uploadId = uploadId;
+        job.partSize = partSize;
+        job.parts.clear();
+        saveUploadQueue();
+    }
+
+    std::vector<size_t> todo;
+    for (size_t part = 0; part < partCount; part++) {
+        if (etags[part].empty()) todo.push_back(part);
+    }
+    std::atomic<size_t> nextTodo(0);
+    std::atomic<bool> failed(false);
+    std::mutex errorMutex;
+
+    auto partWorker = [&]() {
+        std::unique_ptr<Client> partClient = makeS3Client(endpoint);
+        std::string buffer;
+        size_t index;
+        while (!failed.load() && (index = nextTodo.fetch_add(1)) < todo.size()) {
+            size_t part = todo[index];
+            off_t offset = part * partSize;
+            size_t length = std::min(partSize, size - offset);
+            std::string partError = "读取文件失败";
+            bool partOk = readFileRange(fd, offset, length, buffer);
+            std::string md5 = partOk ? contentMd5(buffer) : "";
+            uint32_t crc = partOk ? crc32c(buffer.data(), buffer.size()) : 0;
+            for (int attempt = 0; attempt < S3_PART_RETRIES && !md5.empty(); attempt++) {
+                if (attempt > 0) std::this_thread::sleep_for(std::chrono::seconds(1 << attempt));
+                size_t sentThisAttempt = 0;
+                auto countSent = [&](size_t bytes) { sentThisAttempt += bytes; onSent(bytes); };
+                partOk = s3UploadPart(*partClient, endpoint, key, uploadId, part + 1, buffer, md5,
+                                      countSent, etags[part], partError);
+                if (partOk) break;
+                addUploadProgress(jobId, -(int64_t)sentThisAttempt);
+                countUploadRetry(jobId);
+                if (uploadSessionGone(partError)) break;
+            }
+            if (!partOk) {
+                failed.store(true);
+                std::lock_guard<std::mutex> lock(errorMutex);
+                error = "分片 " + std::to_string(part + 1) + " 上传失败: " + partError;
+                continue;
+            }
+            // 每个确认的分片立即写入上传日志
+            std::lock_guard<std::mutex> lock(uploadMutex);
+            uploadJobs[jobId].parts.push_back({(int)part + 1, (int64_t)offset, (int64_t)length, etags[part], crc});
+            saveUploadQueue();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < concurrency && (size_t)i < todo.size(); i++) workers.emplace_back(partWorker);
+    for (auto& worker : workers) worker.join();
+    close(fd);
+
+    // 自动任务失败后会重试，保留已确认的分片；手动任务不再重试，放弃本次分片上传
+    bool ok = !failed.load();
+    for (int attempt = 0; attempt < S3_PART_RETRIES && ok; attempt++) {
+        if (attempt > 0) std::this_thread::sleep_for(std::chrono::seconds(1 << attempt));
+        if (s3CompleteMultipartUpload(*client, endpoint, key, uploadId, etags, error)) break;
+        if (attempt + 1 == S3_PART_RETRIES || uploadSessionGone(error)) ok = false;
+    }
+    if (!ok) {
+        bool gone = uploadSessionGone(error);
+        if (!automatic || gone) {
+            s3AbortMultipartUpload(*client, endpoint, key, uploadId);
+            resetUploadState(jobId);
+        }
+        if (gone && !restarted) {
+            std::cout << "[上传任务 " << jobId << "] 分片上传已失效，重新开始: " << error << std::endl;
+            return runUploadJob(jobId, filePath, key, error, true);
+        }
+        return false;
+    }
+    resetUploadState(jobId);
+    return true;
+}
+
+// 只保留最近的已结束任务记录
+void pruneUploadJobs() {
+    const size_t MAX_FINISHED_JOBS = 500;
+    size_t finished = 0;
+    for (const auto& item : uploadJobs) {
+        if (item.second.status == "done" || item.second.status == "failed") finished++;
+    }
+    for (auto it = uploadJobs.begin(); it != uploadJobs.end() && finished > MAX_FINISHED_JOBS;) {
+        if (it->second.status == "done" || it->second.status == "failed") {
+            it = uploadJobs.erase(it);
+            finished--;
+        } else {
+            ++it;
+        }
+    }
+}
+
+void uploadWorkerLoop() {
+    while (true) {
+        uint64_t jobId;
+        std::string filePath, objectName;
+        {
+            std::unique_lock<std::mutex> lock(uploadMutex);
+            std::deque<uint64_t>::iterator next;
+            while ((next = nextRunnableUpload(std::time(nullptr))) == uploadQueue.end()) {
+                uploadCv.wait_for(lock, std::chrono::seconds(30));
+            }
+            jobId = *next;
+            uploadQueue.erase(next);
+            UploadJob& job = uploadJobs[jobId];
+            job.status = "active";
+            job.startedAt = std::time(nullptr);
+            job.rate = 0;
+            touchUploadJob(job);
+            filePath = job.filePath;
+            objectName = job.objectName;
+        }
+
+        std::string error;
+        bool ok = runUploadJob(jobId, filePath, objectName, error);
+
+        struct stat st;
+        std::lock_guard<std::mutex> lock(uploadMutex);
+        UploadJob& job = uploadJobs[jobId];
+        job.finishedAt = std::time(nullptr);
+        if (!ok && job.automatic && stat(filePath.c_str(), &st) == 0) {
+            // 自动上传失败后退避重试，文件在上传成功前一直受保护
+            job.attempts++;
+            int delay = std::min(3600, 60 << std::min(job.attempts - 1, 6));
+            job.status = "queued";
+            job.notBefore = job.finishedAt + delay;
+            job.message = "上传失败，" + std::to_string(delay) + " 秒后重试: " + error;
+            uploadQueue.push_back(jobId);
+        } else {
+            job.status = ok ? "done" : "failed";
+            job.message = ok ? "文件上传到S3成功: " + objectName : "上传失败: " + error;
+        }
+        touchUploadJob(job);
+        std::cout << "[上传任务 " << jobId << "] " << job.message << std::endl;
+        pruneUploadJobs();
+        saveUploadQueue();
+    }
+}
+
+void startUploadWorkers() {
+    int workers = std::max(1, config.s3_upload_workers);
+    for (int i = 0; i < workers; i++) {
+        std::thread(uploadWorkerLoop).detach();
+    }
+    std::cout << "S3上传工作线程: " << workers << " 个" << std::endl;
+}
+
+// ==================== 分段完整性校验 ====================
+// 分段关闭后趁数据仍在页缓存中计算 xxh3（可选同时计算 SHA-256），校验值写入分段目录索引，
+// 并在分段旁生成 <分段>.sum，每行一个 BSD 风格条目，可直接用 xxhsum -c / sha256sum -c 核对：
+//   XXH3 (2024-01-01_08-00-00.mp4) = 0123456789abcdef
+// /api/verify 在后台以空闲I/O优先级重读分段并与索引比对；读之前丢弃该文件的页缓存，
+// 保证比对的是TF卡上的数据而不是内存中的副本
+const size_t CHECKSUM_READ_CHUNK = 1 << 20;
+const size_t MAX_VERIFY_PROBLEMS = 200;
+
+struct SegmentDigest {
+    uint64_t xxh3 = 0;
+    std::string sha256;   // 未启用 checksum_sha256 时为空
+    int64_t size = 0;
+};
+
+std::mutex checksumMutex;
+std::condition_variable checksumCv;
+std::deque<std::pair<int, std::string>> checksumQueue;
+
+bool hashSegmentFile(const std::string& path, bool withSha256, bool dropCache, SegmentDigest& digest) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    posix_fadvise(fd, 0, 0, dropCache ? POSIX_FADV_DONTNEED : POSIX_FADV_SEQUENTIAL);
+    Xxh3 xxh;
+    Sha256 sha;
+    std::vector<char> buffer(CHECKSUM_READ_CHUNK);
+    int64_t total = 0;
+    ssize_t n;
+    while ((n = read(fd, buffer.data(), buffer.size())) > 0) {
+        xxh.update(buffer.data(), n);
+        if (withSha256) sha.update(buffer.data(), n);
+        total += n;
+    }
+    // 校验读入的数据不会再用到，不让它挤掉录制写入的缓存
+    if (dropCache) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    if (n < 0) return false;
+    digest.xxh3 = xxh.digest();
+    digest.size = total;
+    if (withSha256) digest.sha256 = toHex(sha.digest());
+    return true;
+}
+
+bool writeSegmentSidecar(const std::string& dirPath, const std::string& name, const SegmentDigest& digest) {
+    std::string path = segmentSidecarPath(dirPath, name);
+    std::string tmpPath = path + ".tmp";
+    {
+        std::ofstream file(tmpPath, std::ios::trunc);
+        if (!file.is_open()) return false;
+        file << "XXH3 (" << name << ") = " << xxh3Hex(digest.xxh3) << "\n";
+        if (!digest.sha256.empty()) file << "SHA256 (" << name << ") = " << digest.sha256 << "\n";
+        if (!file.good()) return false;
+    }
+    return rename(tmpPath.c_str(), path.c_str()) == 0;
+}
+
+// 索引中没有校验值（例如索引被重建过）时从旁文件恢复
+bool readSegmentSidecar(const std::string& dirPath, const std::string& name, uint64_t& xxh3) {
+    std::ifstream file(segmentSidecarPath(dirPath, name));
+    std::string prefix = "XXH3 (" + name + ") = ";
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.compare(0, prefix.size(), prefix) == 0 && line.size() == prefix.size() + 16) {
+            xxh3 = std::strtoull(line.c_str() + prefix.size(), nullptr, 16);
+            return xxh3 != 0;
+        }
+    }
+    return false;
+}
+
+// 大小与索引一致时才记录，避免把改写中途的校验值当成基准
+bool recordSegmentChecksum(int channel, const std::string& name, const SegmentDigest& digest) {
+    uint8_t kind;
+    int64_t start;
+    if (!parseSegmentFileName(name, kind, start)) return false;
+    std::lock_guard<std::mutex> lock(catalogMutex);
+    SegmentCatalog& catalog = channelCatalog(channel);
+    size_t row = catalog.rows.find(kind, start);
+    if (row == catalog.rows.count() || catalog.rows.size[row] != digest.size) return false;
+    appendCatalogJournal(catalog, {makeCatalogEntry(CATALOG_CHECKSUM, name, (long long)digest.xxh3, std::time(nullptr))});
+    return true;
+}
+
+void queueSegmentChecksum(int channel, const std::string& name) {
+    std::lock_guard<std::mutex> lock(checksumMutex);
+    checksumQueue.emplace_back(channel, name);
+    checksumCv.notify_one();
+}
+
+void checksumWorkerLoop() {
+    setThreadIdleIoPriority();
+    while (true) {
+        std::pair<int, std::string> item;
+        {
+            std::unique_lock<std::mutex> lock(checksumMutex);
+            checksumCv.wait(lock, [] { return !checksumQueue.empty(); });
+            item = checksumQueue.front();
+            checksumQueue.pop_front();
+        }
+        std::string dirPath;
+        {
+            std::lock_guard<std::mutex> lock(catalogMutex);
+            dirPath = channelCatalog(item.first).dirPath;
+        }
+        bool withSha256;
+        {
+            std::lock_guard<std::mutex> lock(configMutex);
+            withSha256 = config.checksum_sha256;
+        }
+        SegmentDigest digest;
+        if (!hashSegmentFile(dirPath + "/" + item.second, withSha256, false, digest)) {
+            std::cerr << "通道" << item.first << " 分段校验值计算失败: " << item.second << std::endl;
+            continue;
+        }
+        // 旁文件比分段新，说明分段写完后已经算过（例如索引被重建后重新判定关闭），
+        // 保留原值写回索引，不一致交给 /api/verify 报告，不能用可能已损坏的数据覆盖基准
+        uint64_t previous;
+        struct stat segmentStat, sidecarStat;
+        if (readSegmentSidecar(dirPath, item.second, previous) &&
+            stat((dirPath + "/" + item.second).c_str(), &segmentStat) == 0 &&
+            stat(segmentSidecarPath(dirPath, item.second).c_str(), &sidecarStat) == 0 &&
+            segmentStat.st_mtime <= sidecarStat.st_mtime) {
+            if (previous != digest.xxh3) {
+                std::cerr << "通道" << item.first << " 分段与已有校验值不一致: " << item.second << std::endl;
+            }
+            digest.xxh3 = previous;
+            recordSegmentChecksum(item.first, item.second, digest);
+            continue;
+        }
+        if (!recordSegmentChecksum(item.first, item.second, digest)) continue;
+        if (!writeSegmentSidecar(dirPath, item.second, digest)) {
+            std::cerr << "校验值文件写入失败: " << segmentSidecarPath(dirPath, item.second) << std::endl;
+        }
+    }
+}
+
+struct VerifyTarget {
+    int channel;
+    std::string dirPath;
+    std::string name;
+    int64_t size;
+    uint64_t xxh3;
+};
+
+struct VerifyState {
+    bool running = false;
+    std::time_t startedAt = 0;
+    std::time_t finishedAt = 0;
+    size_t total = 0;
+    size_t checked = 0;
+    size_t ok = 0;
+    size_t baselined = 0;   // 之前没有校验值，本次计算后记为基准
+    size_t changed = 0;     // 大小与索引不一致，文件被改写过而非位翻转
+    size_t missing = 0;
+    int64_t bytes = 0;
+    json problems = json::array();   // 校验不一致或读取出错的分段
+};
+
+std::mutex verifyMutex;
+VerifyState verifyState;
+
+json verifyStateToJson() {
+    json j;
+    j["running"] = verifyState.running;
+    j["startedAt"] = verifyState.startedAt;
+    j["finishedAt"] = verifyState.finishedAt;
+    j["total"] = verifyState.total;
+    j["checked"] = verifyState.checked;
+    j["ok"] = verifyState.ok;
+    j["baselined"] = verifyState.baselined;
+    j["changed"] = verifyState.changed;
+    j["missing"] = verifyState.missing;
+    j["bytes"] = verifyState.bytes;
+    j["problems"] = verifyState.problems;
+    return j;
+}
+
+// 收集 [t0, t1) 内开始的已关闭分段，正在写入的分段不参与校验
+std::vector<VerifyTarget> collectVerifyTargets(int channel, int64_t t0, int64_t t1) {
+    std::vector<VerifyTarget> targets;
+    std::lock_guard<std::mutex> lock(catalogMutex);
+    for (int ch = 1; ch <= 2; ch++) {
+        if (channel != 0 && ch != channel) continue;
+        SegmentCatalog& catalog = channelCatalog(ch);
+        const SegmentColumns& rows = catalog.rows;
+        for (size_t row = rows.lowerBound(t0); row < rows.count() && rows.start[row] < t1; row++) {
+            std::string name = segmentFileName(rows.kind[row], rows.start[row]);
+            if (name == catalog.openSegment) continue;
+            targets.push_back({ch, catalog.dirPath, name, rows.size[row], rows.checksum[row]});
+        }
+    }
+    return targets;
+}
+
+void addVerifyProblem(const VerifyTarget& target, const std::string& reason, uint64_t expected, uint64_t actual) {
+    std::cerr << "通道" << target.channel << " 分段校验" << reason << ": " << target.name << std::endl;
+    if (verifyState.problems.size() >= MAX_VERIFY_PROBLEMS) return;
+    json problem;
+    problem["channel"] = target.channel;
+    problem["name"] = target.name;
+    problem["reason"] = reason;
+    if (expected != 0) problem["expected"] = xxh3Hex(expected);
+    if (actual != 0) problem["actual"] = xxh3Hex(actual);
+    verifyState.problems.push_back(problem);
+}
+
+void runVerify(std::vector<VerifyTarget> targets) {
+    setThreadIdleIoPriority();
+    for (const auto& target : targets) {
+        std::string path = target.dirPath + "/" + target.name;
+        struct stat st;
+        SegmentDigest digest;
+        if (stat(path.c_str(), &st) != 0) {
+            std::lock_guard<std::mutex> lock(verifyMutex);
+            verifyState.checked++;
+            verifyState.missing++;
+            continue;
+        }
+        if (st.st_size != target.size) {
+            std::lock_guard<std::mutex> lock(verifyMutex);
+            verifyState.checked++;
+            verifyState.changed++;
+            continue;
+        }
+        bool readOk = hashSegmentFile(path, false, true, digest);
+        uint64_t expected = target.xxh3;
+        bool fromSidecar = expected == 0 && readSegmentSidecar(target.dirPath, target.name, expected);
+        if (readOk && expected == 0) {
+            // 没有基准值：记录本次结果，以后的校验以此为准
+            if (recordSegmentChecksum(target.channel, target.name, digest)) {
+                writeSegmentSidecar(target.dirPath, target.name, digest);
+            }
+        } else if (readOk && fromSidecar && digest.xxh3 == expected) {
+            recordSegmentChecksum(target.channel, target.name, digest);
+        }
+
+        std::lock_guard<std::mutex> lock(verifyMutex);
+        verifyState.checked++;
+        verifyState.bytes += digest.size;
+        if (!readOk) {
+            addVerifyProblem(target, "读取失败", expected, 0);
+        } else if (expected == 0) {
+            verifyState.baselined++;
+        } else if (digest.xxh3 != expected) {
+            addVerifyProblem(target, "不一致", expected, digest.xxh3);
+        } else {
+            verifyState.ok++;
+        }
+    }
+    std::lock_guard<std::mutex> lock(verifyMutex);
+    verifyState.running = false;
+    verifyState.finishedAt = std::time(nullptr);
+    std::cout << "分段校验完成: " << verifyState.ok << " 个一致, " << verifyState.problems.size() << " 个异常" << std::endl;
+}
+
+void startChecksumWorker() {
+    std::thread(checksumWorkerLoop).detach();
+}
+
+// ==================== 关键帧画面分析 ====================
+// 可选的分析阶段：分段关闭后由低优先级的 ffmpeg 只解码其中的关键帧 (-skip_frame nokey)，缩放成
+// 160x90 灰度图经管道读回逐帧计算，结果以列数组写入分段旁的 <分段>.analysis.json：
+//   {"start": 分段开始时间, "times": [相对分段开头的毫秒数...], "activity": [活动度...], "mean": [...], ...}
+// 活动度是与上一个关键帧相比、2x2 下采样亮度的平均绝对差 (0-255)。另按每路的阈值检测黑屏 (亮度均值)、
+// 失焦 (拉普拉斯响应方差，与该路正常画面的基线比较) 和遮挡 (亮度直方图集中在很窄的范围)，
+// 持续超过 min_seconds 即记入检测告警。开启 audio_analysis 时另解码音频，按 0.5 秒窗口计算 RMS 和峰值电平
+// (dBFS) 存为响度曲线，超过 audio_threshold_db 记入检测告警。亮度和音频内核在运行时按 CPU 选择
+// (x86 SSE2/AVX2，ARM NEON)，选用前与标量实现对拍
+const int ANALYSIS_WIDTH = 160;
+const int ANALYSIS_HEIGHT = 90;
+const int64_t ACTIVITY_CONTINUITY_MS = 10000;  // 与上一分段最后一个关键帧相隔不超过此值时接着比较
+const int64_t MAX_ACTIVITY_BUCKETS = 10000;
+const size_t ACTIVITY_PEAKS = 10;
+const int LUMA_HISTOGRAM_BINS = 32;
+const uint32_t SHARPNESS_BASELINE_FRAMES = 30;   // 基线至少由这么多个正常关键帧得出后才判定失焦
+const int AUDIO_SAMPLE_RATE = 16000;
+const int AUDIO_WINDOW_MS = 500;
+const double AUDIO_HYSTERESIS_DB = 6;            // 低于阈值这么多才算安静下来
+const int AUDIO_QUIET_WINDOWS = 4;               // 连续这么多个安静窗口后结束告警
+
+struct LumaKernels {
+    const char* name;
+    void (*downsample)(const uint8_t* src, int width, int height, uint8_t* dst);  // 2x2 取平均
+    uint64_t (*sad)(const uint8_t* a, const uint8_t* b, size_t n);               // 绝对差之和
+    void (*stats)(const uint8_t* p, size_t n, uint64_t& sum, uint64_t& sumSq);   // 亮度和与平方和
+    // 内部像素 4 邻域拉普拉斯响应的和与平方和
+    void (*laplacian)(const uint8_t* p, int width, int height, int64_t& sum, uint64_t& sumSq);
+};
+
+// 先纵向再横向两次四舍五入取平均，与 SIMD 的 avg 指令结果一致
+void lumaDownsampleRow(const uint8_t* r0, const uint8_t* r1, uint8_t* out, int from, int outWidth) {
+    for (int x = from; x < outWidth; x++) {
+        int left = (r0[2 * x] + r1[2 * x] + 1) >> 1;
+        int right = (r0[2 * x + 1] + r1[2 * x + 1] + 1) >> 1;
+        out[x] = (uint8_t)((left + right + 1) >> 1);
+    }
+}
+
+void lumaDownsampleScalar(const uint8_t* src, int width, int height, uint8_t* dst) {
+    for (int y = 0; y + 1 < height; y += 2) {
+        lumaDownsampleRow(src + y * width, src + (y + 1) * width, dst + (y / 2) * (width / 2), 0, width / 2);
+    }
+}
+
+uint64_t lumaSadScalar(const uint8_t* a, const uint8_t* b, size_t n) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < n; i++) total += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+    return total;
+}
+
+void lumaStatsScalar(const uint8_t* p, size_t n, uint64_t& sum, uint64_t& sumSq) {
+    sum = 0;
+    sumSq = 0;
+    for (size_t i = 0; i < n; i++) {
+        sum += p[i];
+        sumSq += p[i] * p[i];
+    }
+}
+
+void laplacianRow(const uint8_t* row, int width, int from, int64_t& sum, uint64_t& sumSq) {
+    for (int x = from; x < width - 1; x++) {
+        int value = 4 * row[x] - row[x - 1] - row[x + 1] - row[x - width] - row[x + width];
+        sum += value;
+        sumSq += value * value;
+    }
+}
+
+void lumaLaplacianScalar(const uint8_t* p, int width, int height, int64_t& sum, uint64_t& sumSq) {
+    sum = 0;
+    sumSq = 0;
+    for (int y = 1; y + 1 < height; y++) laplacianRow(p + y * width, width, 1, sum, sumSq);
+}
+
+#if defined(__x86_64__)
+void lumaDownsampleSse2(const uint8_t* src, int width, int height, uint8_t* dst) {
+    const __m128i low = _mm_set1_epi16(0x00FF);
+    int outWidth = width / 2;
+    for (int y = 0; y + 1 < height; y += 2) {
+        const uint8_t* r0 = src + y * width;
+        const uint8_t* r1 = r0 + width;
+        uint8_t* out = dst + (y / 2) * outWidth;
+        int x = 0;
+        for (; x + 16 <= outWidth; x += 16) {
+            __m128i v0 = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(r0 + 2 * x)),
+                                      _mm_loadu_si128((const __m128i*)(r1 + 2 * x)));
+            __m128i v1 = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(r0 + 2 * x + 16)),
+                                      _mm_loadu_si128((const __m128i*)(r1 + 2 * x + 16)));
+            __m128i h0 = _mm_avg_epu16(_mm_and_si128(v0, low), _mm_srli_epi16(v0, 8));
+            __m128i h1 = _mm_avg_epu16(_mm_and_si128(v1, low), _mm_srli_epi16(v1, 8));
+            _mm_storeu_si128((__m128i*)(out + x), _mm_packus_epi16(h0, h1));
+        }
+        lumaDownsampleRow(r0, r1, out, x, outWidth);
+    }
+}
+
+uint64_t lumaSadSse2(const uint8_t* a, const uint8_t* b, size_t n) {
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(a + i)),
+                                              _mm_loadu_si128((const __m128i*)(b + i))));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    return lanes[0] + lanes[1] + lumaSadScalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2"))) void lumaDownsampleAvx2(const uint8_t* src, int width, int height, uint8_t* dst) {
+    const __m256i low = _mm256_set1_epi16(0x00FF);
+    int outWidth = width / 2;
+    for (int y = 0; y + 1 < height; y += 2) {
+        const uint8_t* r0 = src + y * width;
+        const uint8_t* r1 = r0 + width;
+        uint8_t* out = dst + (y / 2) * outWidth;
+        int x = 0;
+        for (; x + 32 <= outWidth; x += 32) {
+            __m256i v0 = _mm256_avg_epu8(_mm256_loadu_si256((const __m256i*)(r0 + 2 * x)),
+                                         _mm256_loadu_si256((const __m256i*)(r1 + 2 * x)));
+            __m256i v1 = _mm256_avg_epu8(_mm256_loadu_si256((const __m256i*)(r0 + 2 * x + 32)),
+                                         _mm256_loadu_si256((const __m256i*)(r1 + 2 * x + 32)));
+            __m256i h0 = _mm256_avg_epu16(_mm256_and_si256(v0, low), _mm256_srli_epi16(v0, 8));
+            __m256i h1 = _mm256_avg_epu16(_mm256_and_si256(v1, low), _mm256_srli_epi16(v1, 8));
+            // packus 在两个 128 位通道内分别交错，重新排列成顺序
+            __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(h0, h1), 0xD8);
+            _mm256_storeu_si256((__m256i*)(out + x), packed);
+        }
+        lumaDownsampleRow(r0, r1, out, x, outWidth);
+    }
+}
+
+__attribute__((target("avx2"))) uint64_t lumaSadAvx2(const uint8_t* a, const uint8_t* b, size_t n) {
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i*)(a + i)),
+                                                    _mm256_loadu_si256((const __m256i*)(b + i))));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + lumaSadScalar(a + i, b + i, n - i);
+}
+void lumaStatsSse2(const uint8_t* p, size_t n, uint64_t& sum, uint64_t& sumSq) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sumAcc = zero, sqAcc = zero;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        sumAcc = _mm_add_epi64(sumAcc, _mm_sad_epu8(v, zero));
+        __m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+        __m128i sq = _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi));
+        sqAcc = _mm_add_epi64(sqAcc, _mm_add_epi64(_mm_unpacklo_epi32(sq, zero), _mm_unpackhi_epi32(sq, zero)));
+    }
+    uint64_t sums[2], squares[2];
+    _mm_storeu_si128((__m128i*)sums, sumAcc);
+    _mm_storeu_si128((__m128i*)squares, sqAcc);
+    lumaStatsScalar(p + i, n - i, sum, sumSq);
+    sum += sums[0] + sums[1];
+    sumSq += squares[0] + squares[1];
+}
+
+// 每次处理 8 个像素：16 位的响应在 [-1020, 1020]，一行内的平方和不会溢出 32 位，按行累加到 64 位
+void lumaLaplacianSse2(const uint8_t* p, int width, int height, int64_t& sum, uint64_t& sumSq) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    sum = 0;
+    sumSq = 0;
+    for (int y = 1; y + 1 < height; y++) {
+        const uint8_t* row = p + y * width;
+        __m128i rowSum = zero, rowSq = zero;
+        int x = 1;
+        for (; x + 8 < width; x += 8) {
+            __m128i c = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(row + x)), zero);
+            __m128i l = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(row + x - 1)), zero);
+            __m128i r = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(row + x + 1)), zero);
+            __m128i u = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(row + x - width)), zero);
+            __m128i d = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(row + x + width)), zero);
+            __m128i value = _mm_sub_epi16(_mm_slli_epi16(c, 2),
+                                          _mm_add_epi16(_mm_add_epi16(l, r), _mm_add_epi16(u, d)));
+            rowSum = _mm_add_epi32(rowSum, _mm_madd_epi16(value, ones));
+            rowSq = _mm_add_epi32(rowSq, _mm_madd_epi16(value, value));
+        }
+        int32_t sums[4], squares[4];
+        _mm_storeu_si128((__m128i*)sums, rowSum);
+        _mm_storeu_si128((__m128i*)squares, rowSq);
+        for (int k = 0; k < 4; k++) {
+            sum += sums[k];
+            sumSq += (uint32_t)squares[k];
+        }
+        laplacianRow(row, width, x, sum, sumSq);
     }
 }
 
-// 获取正在录制的文件
-std::vector<FileInfo> getCurrentRecordingFiles() {
-    std::vector<FileInfo> allFiles = getVideoFilesDetailed();
-    std::vector<FileInfo> recordingFiles;
-    
-    for (auto& file : allFiles) {
-        if (file.isRecording) {
-            // 根据通道获取对应的录制时长
-            std::string rtspUrl;
-            if (file.channel == "videos1") {
-                rtspUrl = config.rtsp_url1;
-            } else if (file.channel == "videos2") {
-                rtspUrl = config.rtsp_url2;
+__attribute__((target("avx2"))) void lumaStatsAvx2(const uint8_t* p, size_t n, uint64_t& sum, uint64_t& sumSq) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i sumAcc = zero, sqAcc = zero;
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+        sumAcc = _mm256_add_epi64(sumAcc, _mm256_sad_epu8(v, zero));
+        __m256i lo = _mm256_unpacklo_epi8(v, zero), hi = _mm256_unpackhi_epi8(v, zero);
+        __m256i sq = _mm256_add_epi32(_mm256_madd_epi16(lo, lo), _mm256_madd_epi16(hi, hi));
+        sqAcc = _mm256_add_epi64(sqAcc, _mm256_add_epi64(_mm256_unpacklo_epi32(sq, zero),
+                                                         _mm256_unpackhi_epi32(sq, zero)));
+    }
+    uint64_t sums[4], squares[4];
+    _mm256_storeu_si256((__m256i*)sums, sumAcc);
+    _mm256_storeu_si256((__m256i*)squares, sqAcc);
+    lumaStatsScalar(p + i, n - i, sum, sumSq);
+    sum += sums[0] + sums[1] + sums[2] + sums[3];
+    sumSq += squares[0] + squares[1] + squares[2] + squares[3];
+}
+
+__attribute__((target("avx2"))) void lumaLaplacianAvx2(const uint8_t* p, int width, int height, int64_t& sum,
+                                                       uint64_t& sumSq) {
+    const __m256i ones = _mm256_set1_epi16(1);
+    sum = 0;
+    sumSq = 0;
+    for (int y = 1; y + 1 < height; y++) {
+        const uint8_t* row = p + y * width;
+        __m256i rowSum = _mm256_setzero_si256(), rowSq = _mm256_setzero_si256();
+        int x = 1;
+        for (; x + 16 < width; x += 16) {
+            __m256i c = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(row + x)));
+            __m256i l = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(row + x - 1)));
+            __m256i r = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(row + x + 1)));
+            __m256i u = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(row + x - width)));
+            __m256i d = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(row + x + width)));
+            __m256i value = _mm256_sub_epi16(_mm256_slli_epi16(c, 2),
+                                             _mm256_add_epi16(_mm256_add_epi16(l, r), _mm256_add_epi16(u, d)));
+            rowSum = _mm256_add_epi32(rowSum, _mm256_madd_epi16(value, ones));
+            rowSq = _mm256_add_epi32(rowSq, _mm256_madd_epi16(value, value));
+        }
+        int32_t sums[8], squares[8];
+        _mm256_storeu_si256((__m256i*)sums, rowSum);
+        _mm256_storeu_si256((__m256i*)squares, rowSq);
+        for (int k = 0; k < 8; k++) {
+            sum += sums[k];
+            sumSq += (uint32_t)squares[k];
+        }
+        laplacianRow(row, width, x, sum, sumSq);
+    }
+}
+#elif defined(__aarch64__)
+void lumaDownsampleNeon(const uint8_t* src, int width, int height, uint8_t* dst) {
+    int outWidth = width / 2;
+    for (int y = 0; y + 1 < height; y += 2) {
+        const uint8_t* r0 = src + y * width;
+        const uint8_t* r1 = r0 + width;
+        uint8_t* out = dst + (y / 2) * outWidth;
+        int x = 0;
+        for (; x + 16 <= outWidth; x += 16) {
+            uint8x16x2_t a = vld2q_u8(r0 + 2 * x);   // 按奇偶列拆开
+            uint8x16x2_t b = vld2q_u8(r1 + 2 * x);
+            uint8x16_t left = vrhaddq_u8(a.val[0], b.val[0]);
+            uint8x16_t right = vrhaddq_u8(a.val[1], b.val[1]);
+            vst1q_u8(out + x, vrhaddq_u8(left, right));
+        }
+        lumaDownsampleRow(r0, r1, out, x, outWidth);
+    }
+}
+
+uint64_t lumaSadNeon(const uint8_t* a, const uint8_t* b, size_t n) {
+    uint32x4_t acc = vdupq_n_u32(0);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc = vpadalq_u16(acc, vpaddlq_u8(vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i))));
+    }
+    return vaddvq_u32(acc) + lumaSadScalar(a + i, b + i, n - i);
+}
+
+void lumaStatsNeon(const uint8_t* p, size_t n, uint64_t& sum, uint64_t& sumSq) {
+    uint64x2_t sumAcc = vdupq_n_u64(0), sqAcc = vdupq_n_u64(0);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t v = vld1q_u8(p + i);
+        sumAcc = vpadalq_u32(sumAcc, vpaddlq_u16(vpaddlq_u8(v)));
+        uint16x8_t lo = vmull_u8(vget_low_u8(v), vget_low_u8(v));
+        uint16x8_t hi = vmull_high_u8(v, v);
+        sqAcc = vpadalq_u32(sqAcc, vaddq_u32(vpaddlq_u16(lo), vpaddlq_u16(hi)));
+    }
+    lumaStatsScalar(p + i, n - i, sum, sumSq);
+    sum += vaddvq_u64(sumAcc);
+    sumSq += vaddvq_u64(sqAcc);
+}
+
+void lumaLaplacianNeon(const uint8_t* p, int width, int height, int64_t& sum, uint64_t& sumSq) {
+    sum = 0;
+    sumSq = 0;
+    for (int y = 1; y + 1 < height; y++) {
+        const uint8_t* row = p + y * width;
+        int32x4_t rowSum = vdupq_n_s32(0);
+        int64x2_t rowSq = vdupq_n_s64(0);
+        int x = 1;
+        for (; x + 8 < width; x += 8) {
+            int16x8_t c = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(row + x)));
+            uint16x8_t around = vaddq_u16(vaddl_u8(vld1_u8(row + x - 1), vld1_u8(row + x + 1)),
+                                          vaddl_u8(vld1_u8(row + x - width), vld1_u8(row + x + width)));
+            int16x8_t value = vsubq_s16(vshlq_n_s16(c, 2), vreinterpretq_s16_u16(around));
+            rowSum = vpadalq_s16(rowSum, value);
+            rowSq = vpadalq_s32(rowSq, vaddq_s32(vmull_s16(vget_low_s16(value), vget_low_s16(value)),
+                                                 vmull_high_s16(value, value)));
+        }
+        sum += vaddvq_s32(rowSum);
+        sumSq += vaddvq_s64(rowSq);
+        laplacianRow(row, width, x, sum, sumSq);
+    }
+}
+#endif
+
+bool lumaKernelsMatch(const LumaKernels& kernels, const LumaKernels& reference) {
+    // 宽度不是向量长度的整数倍，覆盖尾部的标量路径
+    const int width = 150, height = 12;
+    std::vector<uint8_t> frame(width * height), other(width * height);
+    uint32_t x = 7;
+    for (size_t i = 0; i < frame.size(); i++) {
+        frame[i] = (uint8_t)((x = x * 1103515245 + 12345) >> 16);
+        other[i] = (uint8_t)((x = x * 1103515245 + 12345) >> 16);
+    }
+    std::vector<uint8_t> a(width * height / 4), b(width * height / 4);
+    kernels.downsample(frame.data(), width, height, a.data());
+    reference.downsample(frame.data(), width, height, b.data());
+    uint64_t sum[2], sumSq[2], laplacianSq[2];
+    int64_t laplacianSum[2];
+    kernels.stats(frame.data(), frame.size(), sum[0], sumSq[0]);
+    reference.stats(frame.data(), frame.size(), sum[1], sumSq[1]);
+    kernels.laplacian(frame.data(), width, height, laplacianSum[0], laplacianSq[0]);
+    reference.laplacian(frame.data(), width, height, laplacianSum[1], laplacianSq[1]);
+    return a == b && sum[0] == sum[1] && sumSq[0] == sumSq[1] && laplacianSum[0] == laplacianSum[1] &&
+           laplacianSq[0] == laplacianSq[1] &&
+           kernels.sad(frame.data(), other.data(), frame.size()) == reference.sad(frame.data(), other.data(), frame.size());
+}
+
+const LumaKernels& lumaKernelsForCpu() {
+    static const LumaKernels kernels = [] {
+        LumaKernels scalar = {"scalar", lumaDownsampleScalar, lumaSadScalar, lumaStatsScalar, lumaLaplacianScalar};
+        std::vector<LumaKernels> candidates;
+#if defined(__x86_64__)
+        if (__builtin_cpu_supports("avx2")) {
+            candidates.push_back({"avx2", lumaDownsampleAvx2, lumaSadAvx2, lumaStatsAvx2, lumaLaplacianAvx2});
+        }
+        candidates.push_back({"sse2", lumaDownsampleSse2, lumaSadSse2, lumaStatsSse2, lumaLaplacianSse2});
+#elif defined(__aarch64__)
+        candidates.push_back({"neon", lumaDownsampleNeon, lumaSadNeon, lumaStatsNeon, lumaLaplacianNeon});
+#endif
+        for (const auto& candidate : candidates) {
+            if (lumaKernelsMatch(candidate, scalar)) return candidate;
+            std::cerr << "亮度内核 " << candidate.name << " 自检失败" << std::endl;
+        }
+        return scalar;
+    }();
+    return kernels;
+}
+
+struct PcmKernels {
+    const char* name;
+    void (*levels)(const int16_t* p, size_t n, uint64_t& sumSq, int& peak);   // 平方和与最大绝对值
+};
+
+void pcmLevelsScalar(const int16_t* p, size_t n, uint64_t& sumSq, int& peak) {
+    sumSq = 0;
+    peak = 0;
+    for (size_t i = 0; i < n; i++) {
+        int v = p[i];
+        sumSq += (uint64_t)(v * v);
+        peak = std::max(peak, std::abs(v));
+    }
+}
+
+#if defined(__x86_64__)
+// madd 把相邻两个样本的平方相加，两个都是 -32768 时结果为 2^31，按无符号扩展到 64 位即可
+void pcmLevelsSse2(const int16_t* p, size_t n, uint64_t& sumSq, int& peak) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sq = zero, high = zero, low = zero;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        __m128i m = _mm_madd_epi16(v, v);
+        sq = _mm_add_epi64(sq, _mm_add_epi64(_mm_unpacklo_epi32(m, zero), _mm_unpackhi_epi32(m, zero)));
+        high = _mm_max_epi16(high, v);
+        low = _mm_min_epi16(low, v);
+    }
+    pcmLevelsScalar(p + i, n - i, sumSq, peak);
+    uint64_t squares[2];
+    int16_t highs[8], lows[8];
+    _mm_storeu_si128((__m128i*)squares, sq);
+    _mm_storeu_si128((__m128i*)highs, high);
+    _mm_storeu_si128((__m128i*)lows, low);
+    sumSq += squares[0] + squares[1];
+    for (int k = 0; k < 8; k++) peak = std::max({peak, (int)highs[k], -(int)lows[k]});
+}
+
+__attribute__((target("avx2"))) void pcmLevelsAvx2(const int16_t* p, size_t n, uint64_t& sumSq, int& peak) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i sq = zero, high = zero, low = zero;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+        __m256i m = _mm256_madd_epi16(v, v);
+        sq = _mm256_add_epi64(sq, _mm256_add_epi64(_mm256_unpacklo_epi32(m, zero), _mm256_unpackhi_epi32(m, zero)));
+        high = _mm256_max_epi16(high, v);
+        low = _mm256_min_epi16(low, v);
+    }
+    pcmLevelsScalar(p + i, n - i, sumSq, peak);
+    uint64_t squares[4];
+    int16_t highs[16], lows[16];
+    _mm256_storeu_si256((__m256i*)squares, sq);
+    _mm256_storeu_si256((__m256i*)highs, high);
+    _mm256_storeu_si256((__m256i*)lows, low);
+    sumSq += squares[0] + squares[1] + squares[2] + squares[3];
+    for (int k = 0; k < 16; k++) peak = std::max({peak, (int)highs[k], -(int)lows[k]});
+}
+#elif defined(__aarch64__)
+void pcmLevelsNeon(const int16_t* p, size_t n, uint64_t& sumSq, int& peak) {
+    uint64x2_t sq = vdupq_n_u64(0);
+    int16x8_t high = vdupq_n_s16(0), low = vdupq_n_s16(0);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        int16x8_t v = vld1q_s16(p + i);
+        sq = vpadalq_u32(sq, vreinterpretq_u32_s32(vmull_s16(vget_low_s16(v), vget_low_s16(v))));
+        sq = vpadalq_u32(sq, vreinterpretq_u32_s32(vmull_high_s16(v, v)));
+        high = vmaxq_s16(high, v);
+        low = vminq_s16(low, v);
+    }
+    pcmLevelsScalar(p + i, n - i, sumSq, peak);
+    sumSq += vaddvq_u64(sq);
+    peak = std::max({peak, (int)vmaxvq_s16(high), -(int)vminvq_s16(low)});
+}
+#endif
+
+const PcmKernels& pcmKernelsForCpu() {
+    static const PcmKernels kernels = [] {
+        PcmKernels scalar = {"scalar", pcmLevelsScalar};
+        std::vector<PcmKernels> candidates;
+#if defined(__x86_64__)
+        if (__builtin_cpu_supports("avx2")) candidates.push_back({"avx2", pcmLevelsAvx2});
+        candidates.push_back({"sse2", pcmLevelsSse2});
+#elif defined(__aarch64__)
+        candidates.push_back({"neon", pcmLevelsNeon});
+#endif
+        // 样本数不是向量长度的整数倍，并包含成对的 -32768
+        std::vector<int16_t> sample(1000 + 5);
+        uint32_t x = 11;
+        for (auto& v : sample) v = (int16_t)((x = x * 1103515245 + 12345) >> 16);
+        sample[16] = sample[17] = -32768;
+        uint64_t expectSq;
+        int expectPeak;
+        pcmLevelsScalar(sample.data(), sample.size(), expectSq, expectPeak);
+        for (const auto& candidate : candidates) {
+            uint64_t sumSq;
+            int peak;
+            candidate.levels(sample.data(), sample.size(), sumSq, peak);
+            if (sumSq == expectSq && peak == expectPeak) return candidate;
+            std::cerr << "音频电平内核 " << candidate.name << " 自检失败" << std::endl;
+        }
+        return scalar;
+    }();
+    return kernels;
+}
+
+// 电平换算为 dBFS，静音记为 -90
+double levelDb(double level) {
+    return level < 1 ? -90.0 : 20 * std::log10(level / 32768.0);
+}
+
+// 32 区间亮度直方图。逐像素散列写入无法向量化，交替写 4 组计数，避免相邻像素落入同一区间时
+// 连续读写同一计数器造成的停顿
+void lumaHistogram(const uint8_t* p, size_t n, uint32_t* bins) {
+    uint32_t partial[4][LUMA_HISTOGRAM_BINS] = {};
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        partial[0][p[i] >> 3]++;
+        partial[1][p[i + 1] >> 3]++;
+        partial[2][p[i + 2] >> 3]++;
+        partial[3][p[i + 3] >> 3]++;
+    }
+    for (; i < n; i++) partial[0][p[i] >> 3]++;
+    for (int b = 0; b < LUMA_HISTOGRAM_BINS; b++) {
+        bins[b] = partial[0][b] + partial[1][b] + partial[2][b] + partial[3][b];
+    }
+}
+
+struct KeyframeMetrics {
+    double activity = -1;   // 没有可比较的上一个关键帧时为 -1
+    double mean = 0;
+    double variance = 0;
+    double sharpness = 0;   // 拉普拉斯响应的方差
+    double dominant = 0;    // 相邻两个直方图区间的最大像素比例
+};
+
+KeyframeMetrics measureKeyframe(const LumaKernels& kernels, const uint8_t* frame) {
+    const size_t pixels = ANALYSIS_WIDTH * ANALYSIS_HEIGHT;
+    KeyframeMetrics metrics;
+    uint64_t sum, sumSq;
+    kernels.stats(frame, pixels, sum, sumSq);
+    metrics.mean = (double)sum / pixels;
+    metrics.variance = (double)sumSq / pixels - metrics.mean * metrics.mean;
+
+    int64_t laplacianSum;
+    uint64_t laplacianSq;
+    kernels.laplacian(frame, ANALYSIS_WIDTH, ANALYSIS_HEIGHT, laplacianSum, laplacianSq);
+    const double inner = (ANALYSIS_WIDTH - 2) * (ANALYSIS_HEIGHT - 2);
+    double laplacianMean = laplacianSum / inner;
+    metrics.sharpness = laplacianSq / inner - laplacianMean * laplacianMean;
+
+    uint32_t bins[LUMA_HISTOGRAM_BINS];
+    lumaHistogram(frame, pixels, bins);
+    uint32_t peak = 0;
+    for (int b = 0; b + 1 < LUMA_HISTOGRAM_BINS; b++) peak = std::max(peak, bins[b] + bins[b + 1]);
+    metrics.dominant = (double)peak / pixels;
+    return metrics;
+}
+
+enum TamperKind { TAMPER_BLACK = 0, TAMPER_DEFOCUS = 1, TAMPER_OCCLUSION = 2 };
+const char* TAMPER_NAMES[] = {"black", "defocus", "occlusion"};
+
+struct TamperCondition {
+    bool active = false;    // 已告警，等待恢复
+    int64_t sinceMs = 0;    // 条件开始成立的时间，0 表示当前不成立
+};
+
+// 上一个关键帧的下采样亮度和遮挡检测状态，只由分析线程访问
+struct AnalysisChannelState {
+    std::vector<uint8_t> lastLuma;
+    int64_t lastTimeMs = 0;   // 绝对时间
+    TamperCondition tamper[3];
+    double sharpnessBaseline = 0;
+    uint32_t baselineFrames = 0;
+    int64_t audioEndMs = 0;     // 上一分段音频的结束时间
+    bool loud = false;
+    int64_t loudSinceMs = 0;
+    double loudMaxDb = 0;
+    int quietWindows = 0;
+};
+
+double roundMetric(double value) {
+    return std::round(value * 100) / 100;
+}
+
+// 按时间顺序逐个关键帧更新遮挡检测状态，告警时间为条件开始成立的关键帧时间
+void evaluateTamper(int channel, AnalysisChannelState& state, const TamperConfig& tamper,
+                    const KeyframeMetrics& metrics, int64_t timeMs, const std::string& segment) {
+    bool baselineReady = state.baselineFrames >= SHARPNESS_BASELINE_FRAMES;
+    bool present[3];
+    present[TAMPER_BLACK] = tamper.black_mean > 0 && metrics.mean < tamper.black_mean;
+    present[TAMPER_OCCLUSION] = tamper.occlusion_ratio > 0 && !present[TAMPER_BLACK] &&
+                                metrics.dominant > tamper.occlusion_ratio;
+    present[TAMPER_DEFOCUS] = tamper.defocus_ratio > 0 && baselineReady && !present[TAMPER_BLACK] &&
+                              !present[TAMPER_OCCLUSION] &&
+                              metrics.sharpness < tamper.defocus_ratio * state.sharpnessBaseline;
+    if (!present[TAMPER_BLACK] && !present[TAMPER_OCCLUSION] && !present[TAMPER_DEFOCUS]) {
+        state.sharpnessBaseline = state.baselineFrames == 0
+                                      ? metrics.sharpness
+                                      : state.sharpnessBaseline * 0.95 + metrics.sharpness * 0.05;
+        state.baselineFrames++;
+    }
+
+    for (int kind = TAMPER_BLACK; kind <= TAMPER_OCCLUSION; kind++) {
+        TamperCondition& condition = state.tamper[kind];
+        std::string source = std::string("tamper:") + TAMPER_NAMES[kind];
+        if (!present[kind]) {
+            if (condition.active) {
+                raiseDetection(channel, source, "end",
+                               "恢复正常，持续 " + std::to_string((timeMs - condition.sinceMs) / 1000) + " 秒",
+                               timeMs / 1000, segment);
             }
-            
-            if (!rtspUrl.empty()) {
-                std::string etime = getFfmpegRunningTime(rtspUrl);
-                file.recordingDuration = formatElapsedTime(etime);
+            condition = TamperCondition();
+            continue;
+        }
+        if (condition.sinceMs == 0) condition.sinceMs = timeMs;
+        if (condition.active || timeMs - condition.sinceMs < (int64_t)tamper.min_seconds * 1000) continue;
+        condition.active = true;
+        std::ostringstream note;
+        note << std::fixed << std::setprecision(1);
+        if (kind == TAMPER_BLACK) {
+            note << "画面过暗：亮度均值 " << metrics.mean;
+        } else if (kind == TAMPER_DEFOCUS) {
+            note << "画面失焦：清晰度 " << metrics.sharpness << "，正常基线 " << state.sharpnessBaseline;
+        } else {
+            note << "画面被遮挡：" << metrics.dominant * 100 << "% 的像素集中在很窄的亮度范围";
+        }
+        raiseDetection(channel, source, "start", note.str(), condition.sinceMs / 1000, segment);
+    }
+}
+
+std::mutex analysisMutex;
+std::condition_variable analysisCv;
+std::deque<std::pair<int, std::string>> analysisQueue;
+AnalysisChannelState analysisStates[3];
+
+void queueSegmentAnalysis(int channel, const std::string& name) {
+    uint8_t kind;
+    int64_t start;
+    if (!parseSegmentFileName(name, kind, start) || kind != SEGMENT_NORMAL) return;
+    {
+        std::lock_guard<std::mutex> lock(configMutex);
+        if (!config.keyframe_analysis && !config.audio_analysis) return;
+    }
+    std::lock_guard<std::mutex> lock(analysisMutex);
+    analysisQueue.emplace_back(channel, name);
+    analysisCv.notify_one();
+}
+
+// 以最低调度优先级启动分析用的 ffmpeg，stdout 经管道读回；errFd 非空时 stderr 也经管道读回，否则继承
+pid_t spawnAnalysisDecoder(std::vector<std::string> args, int& outFd, int* errFd) {
+    std::vector<char*> argv;
+    for (auto& arg : args) argv.push_back(&arg[0]);
+    argv.push_back(nullptr);
+
+    int outFds[2], errFds[2] = {-1, -1};
+    if (pipe2(outFds, O_CLOEXEC) != 0) return -1;
+    if (errFd && pipe2(errFds, O_CLOEXEC) != 0) {
+        close(outFds[0]);
+        close(outFds[1]);
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(outFds[1], STDOUT_FILENO);
+        if (errFd) dup2(errFds[1], STDERR_FILENO);
+        setpriority(PRIO_PROCESS, 0, 19);
+        execvp(argv[0], argv.data());
+        _exit(127);
+    }
+    close(outFds[1]);
+    if (errFd) close(errFds[1]);
+    if (pid < 0) {
+        close(outFds[0]);
+        if (errFd) close(errFds[0]);
+        return -1;
+    }
+    outFd = outFds[0];
+    if (errFd) *errFd = errFds[0];
+    return pid;
+}
+
+// 按固定大小的块读取管道直到 EOF，最后不足一块的部分也回调一次，然后关闭管道
+void readPipeBlocks(int fd, std::vector<uint8_t>& block, const std::function<void(size_t)>& onBlock) {
+    size_t filled = 0;
+    ssize_t n;
+    while ((n = read(fd, block.data() + filled, block.size() - filled)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        filled += n;
+        if (filled == block.size()) {
+            onBlock(filled);
+            filled = 0;
+        }
+    }
+    if (filled > 0) onBlock(filled);
+    close(fd);
+}
+
+bool waitAnalysisDecoder(pid_t pid) {
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// 解码分段的关键帧，每帧回调一次 160x90 灰度图；帧时间由 showinfo 打印到 stderr，结束后按顺序返回
+bool decodeKeyframes(const std::string& path, const std::function<void(const uint8_t*)>& onFrame,
+                     std::vector<int64_t>& timesMs) {
+    std::string filter = "scale=" + std::to_string(ANALYSIS_WIDTH) + ":" + std::to_string(ANALYSIS_HEIGHT) +
+                         ",format=gray,showinfo";
+    int outFd, errFd;
+    pid_t pid = spawnAnalysisDecoder({"ffmpeg", "-hide_banner", "-nostdin", "-loglevel", "info",
+                                      "-skip_frame", "nokey", "-i", path, "-an", "-sn", "-vf", filter,
+                                      "-vsync", "0", "-f", "rawvideo", "pipe:1"}, outFd, &errFd);
+    if (pid < 0) return false;
+
+    std::thread stderrReader([&timesMs, errFd] {
+        std::string pending;
+        auto onLine = [&timesMs](std::string& line) {
+            size_t pos = line.find(" pts_time:");
+            if (pos != std::string::npos && line.find("Parsed_showinfo") != std::string::npos) {
+                timesMs.push_back((int64_t)llround(atof(line.c_str() + pos + 10) * 1000));
+            }
+        };
+        while (readPipeLines(errFd, pending, onLine)) {
+        }
+        close(errFd);
+    });
+
+    std::vector<uint8_t> frame(ANALYSIS_WIDTH * ANALYSIS_HEIGHT);
+    readPipeBlocks(outFd, frame, [&](size_t length) {
+        if (length == frame.size()) onFrame(frame.data());
+    });
+    bool ok = waitAnalysisDecoder(pid);
+    stderrReader.join();
+    return ok;
+}
+
+// 解码分段的第一路音频为单声道 16 位 PCM，每 AUDIO_WINDOW_MS 回调一次；分段没有音频时返回 false
+bool decodeAudio(const std::string& path, const std::function<void(const int16_t*, size_t)>& onWindow) {
+    int outFd;
+    pid_t pid = spawnAnalysisDecoder({"ffmpeg", "-hide_banner", "-nostdin", "-loglevel", "quiet", "-i", path,
+                                      "-map", "0:a:0", "-ac", "1", "-ar", std::to_string(AUDIO_SAMPLE_RATE),
+                                      "-f", "s16le", "pipe:1"}, outFd, nullptr);
+    if (pid < 0) return false;
+    std::vector<uint8_t> window(AUDIO_SAMPLE_RATE * AUDIO_WINDOW_MS / 1000 * sizeof(int16_t));
+    bool any = false;
+    readPipeBlocks(outFd, window, [&](size_t length) {
+        if (length < sizeof(int16_t)) return;
+        onWindow(reinterpret_cast<const int16_t*>(window.data()), length / sizeof(int16_t));
+        any = true;
+    });
+    return waitAnalysisDecoder(pid) && any;
+}
+
+// 两个分段的时间是否首尾相接，相接时检测状态接着累计
+bool analysisContiguous(int64_t previousEndMs, int64_t start) {
+    return previousEndMs > 0 && start * 1000 - previousEndMs <= ACTIVITY_CONTINUITY_MS &&
+           start * 1000 >= previousEndMs - ACTIVITY_CONTINUITY_MS;
+}
+
+bool analyzeKeyframes(int channel, AnalysisChannelState& state, const std::string& path, const std::string& name,
+                      int64_t start, json& result) {
+    const LumaKernels& kernels = lumaKernelsForCpu();
+    const size_t lumaBytes = (ANALYSIS_WIDTH / 2) * (ANALYSIS_HEIGHT / 2);
+    TamperConfig tamper;
+    {
+        std::lock_guard<std::mutex> lock(configMutex);
+        tamper = channelTamper(channel);
+    }
+
+    // 分段紧接上一个分析过的分段时，第一个关键帧与上一分段的最后一个关键帧比较，遮挡状态也接着累计
+    std::vector<uint8_t> previous;
+    if (!state.lastLuma.empty() && analysisContiguous(state.lastTimeMs, start)) {
+        previous = state.lastLuma;
+    } else {
+        for (auto& condition : state.tamper) {
+            if (!condition.active) condition.sinceMs = 0;
+        }
+    }
+    std::vector<uint8_t> luma(lumaBytes);
+    std::vector<KeyframeMetrics> frames;
+    std::vector<int64_t> timesMs;
+    bool ok = decodeKeyframes(path, [&](const uint8_t* frame) {
+        KeyframeMetrics metrics = measureKeyframe(kernels, frame);
+        kernels.downsample(frame, ANALYSIS_WIDTH, ANALYSIS_HEIGHT, luma.data());
+        if (!previous.empty()) {
+            metrics.activity = (double)kernels.sad(luma.data(), previous.data(), lumaBytes) / lumaBytes;
+        }
+        frames.push_back(metrics);
+        previous.swap(luma);
+        luma.resize(lumaBytes);
+    }, timesMs);
+    if (!ok || frames.empty()) return false;
+
+    // 帧数与 showinfo 行数不一致时 (进程异常退出) 以较少者为准
+    size_t count = std::min(frames.size(), timesMs.size());
+    result["kernel"] = kernels.name;
+    for (const char* column : {"times", "activity", "mean", "variance", "sharpness", "dominant"}) {
+        result[column] = json::array();
+    }
+    for (size_t i = 0; i < count; i++) {
+        const KeyframeMetrics& metrics = frames[i];
+        result["times"].push_back(timesMs[i]);
+        result["activity"].push_back(metrics.activity < 0 ? json(nullptr) : json(roundMetric(metrics.activity)));
+        result["mean"].push_back(roundMetric(metrics.mean));
+        result["variance"].push_back(roundMetric(metrics.variance));
+        result["sharpness"].push_back(roundMetric(metrics.sharpness));
+        result["dominant"].push_back(roundMetric(metrics.dominant));
+        evaluateTamper(channel, state, tamper, metrics, start * 1000 + timesMs[i], name);
+    }
+    state.lastLuma = previous;
+    state.lastTimeMs = start * 1000 + (count > 0 ? timesMs[count - 1] : 0);
+    return true;
+}
+
+// 窗口 RMS 超过阈值时开始声音事件，降到阈值以下 AUDIO_HYSTERESIS_DB 并持续 AUDIO_QUIET_WINDOWS 个窗口后结束
+void evaluateLoudness(int channel, AnalysisChannelState& state, double thresholdDb, double rmsDb, double peakDb,
+                      int64_t timeMs, const std::string& segment) {
+    if (rmsDb >= thresholdDb) {
+        state.quietWindows = 0;
+        if (state.loud) {
+            state.loudMaxDb = std::max(state.loudMaxDb, rmsDb);
+            return;
+        }
+        state.loud = true;
+        state.loudSinceMs = timeMs;
+        state.loudMaxDb = rmsDb;
+        std::ostringstream note;
+        note << std::fixed << std::setprecision(1) << "声音过大：RMS " << rmsDb << " dBFS，峰值 " << peakDb << " dBFS";
+        raiseDetection(channel, "audio", "start", note.str(), timeMs / 1000, segment);
+        return;
+    }
+    if (!state.loud) return;
+    if (rmsDb < thresholdDb - AUDIO_HYSTERESIS_DB) {
+        state.quietWindows++;
+    } else {
+        state.quietWindows = 0;
+    }
+    if (state.quietWindows < AUDIO_QUIET_WINDOWS) return;
+    int64_t endMs = timeMs - (AUDIO_QUIET_WINDOWS - 1) * AUDIO_WINDOW_MS;
+    std::ostringstream note;
+    note << std::fixed << std::setprecision(1) << "声音恢复，持续 " << (endMs - state.loudSinceMs) / 1000.0
+         << " 秒，最高 RMS " << state.loudMaxDb << " dBFS";
+    raiseDetection(channel, "audio", "end", note.str(), endMs / 1000, segment);
+    state.loud = false;
+    state.quietWindows = 0;
+}
+
+bool analyzeAudio(int channel, AnalysisChannelState& state, const std::string& path, const std::string& name,
+                  int64_t start, json& result) {
+    const PcmKernels& kernels = pcmKernelsForCpu();
+    double thresholdDb;
+    {
+        std::lock_guard<std::mutex> lock(configMutex);
+        thresholdDb = config.audio_threshold_db;
+    }
+    // 与上一分段不相接时 (录制中断)，未结束的声音事件在上一分段末尾结束
+    if (state.loud && !analysisContiguous(state.audioEndMs, start)) {
+        raiseDetection(channel, "audio", "end", "录制中断", state.audioEndMs / 1000, name);
+        state.loud = false;
+        state.quietWindows = 0;
+    }
+
+    json rms = json::array(), peak = json::array();
+    int64_t offsetMs = 0;
+    bool ok = decodeAudio(path, [&](const int16_t* samples, size_t count) {
+        uint64_t sumSq;
+        int peakLevel;
+        kernels.levels(samples, count, sumSq, peakLevel);
+        double rmsDb = levelDb(std::sqrt((double)sumSq / count));
+        double peakDb = levelDb(peakLevel);
+        rms.push_back(roundMetric(rmsDb));
+        peak.push_back(roundMetric(peakDb));
+        evaluateLoudness(channel, state, thresholdDb, rmsDb, peakDb, start * 1000 + offsetMs, name);
+        offsetMs += (int64_t)count * 1000 / AUDIO_SAMPLE_RATE;
+    });
+    if (!ok) return false;
+    result["audio"] = {{"windowMs", AUDIO_WINDOW_MS}, {"kernel", kernels.name}, {"rms", rms}, {"peak", peak}};
+    state.audioEndMs = start * 1000 + offsetMs;
+    return true;
+}
+
+bool analyzeSegment(int channel, const std::string& dirPath, const std::string& name) {
+    uint8_t kind;
+    int64_t start;
+    if (!parseSegmentFileName(name, kind, start)) return false;
+    bool keyframes, audio;
+    {
+        std::lock_guard<std::mutex> lock(configMutex);
+        keyframes = config.keyframe_analysis;
+        audio = config.audio_analysis;
+    }
+    AnalysisChannelState& state = analysisStates[channel];
+    std::string segmentPath = dirPath + "/" + name;
+    json result;
+    result["start"] = start;
+    bool videoOk = keyframes && analyzeKeyframes(channel, state, segmentPath, name, start, result);
+    // 没有音频轨的分段不算失败
+    bool audioOk = audio && analyzeAudio(channel, state, segmentPath, name, start, result);
+    if (!videoOk && !audioOk) return !keyframes;
+
+    std::string path = segmentAnalysisPath(dirPath, name);
+    std::string tmpPath = path + ".tmp";
+    {
+        std::ofstream file(tmpPath, std::ios::trunc);
+        if (!file.is_open()) return false;
+        file << result.dump() << "\n";
+        if (!file.good()) return false;
+    }
+    return rename(tmpPath.c_str(), path.c_str()) == 0;
+}
+
+void analysisWorkerLoop() {
+    setThreadIdleIoPriority();
+    while (true) {
+        std::pair<int, std::string> item;
+        {
+            std::unique_lock<std::mutex> lock(analysisMutex);
+            analysisCv.wait(lock, [] { return !analysisQueue.empty(); });
+            item = analysisQueue.front();
+            analysisQueue.pop_front();
+        }
+        std::string dirPath;
+        {
+            std::lock_guard<std::mutex> lock(catalogMutex);
+            dirPath = channelCatalog(item.first).dirPath;
+        }
+        if (!analyzeSegment(item.first, dirPath, item.second)) {
+            std::cerr << "通道" << item.first << " 分段分析失败: " << item.second << std::endl;
+        }
+    }
+}
+
+void startAnalysisWorker() {
+    std::thread(analysisWorkerLoop).detach();
+}
+
+// 按 bucket 秒汇总 [t0, t1) 内的活动度和响度 (RMS dBFS)：每格取最大值，没有分析结果的格为 null，
+// 另给出活动度最高的几个关键帧
+json queryActivity(int channel, int64_t t0, int64_t t1, int64_t bucket) {
+    std::string dirPath;
+    std::vector<std::string> names;
+    {
+        std::lock_guard<std::mutex> lock(catalogMutex);
+        SegmentCatalog& catalog = channelCatalog(channel);
+        dirPath = catalog.dirPath;
+        const SegmentColumns& rows = catalog.rows;
+        auto range = rows.overlapRange(t0, t1);
+        for (size_t row = range.first; row < range.second; row++) {
+            if (rows.kind[row] != SEGMENT_NORMAL || rows.start[row] + rows.duration[row] <= t0) continue;
+            names.push_back(segmentFileName(rows.kind[row], rows.start[row]));
+        }
+    }
+
+    // bucket 超过整个区间时只有一个桶，先收窄再向上取整，避免 t1 - t0 + bucket 溢出
+    bucket = std::min(bucket, t1 - t0);
+    size_t bucketCount = (size_t)((t1 - t0 + bucket - 1) / bucket);
+    std::vector<double> values(bucketCount, -1);
+    std::vector<double> loudness(bucketCount, -1000);
+    struct Peak {
+        int64_t timeMs;
+        double score;
+        const std::string* name;
+        int64_t start;
+    };
+    std::vector<Peak> peaks;
+    int analyzed = 0;
+    for (const auto& name : names) {
+        std::ifstream file(segmentAnalysisPath(dirPath, name));
+        if (!file.is_open()) continue;
+        json data;
+        try {
+            file >> data;
+        } catch (const std::exception& e) {
+            continue;
+        }
+        analyzed++;
+        int64_t start = data.value("start", 0LL);
+        const json& times = data["times"];
+        const json& activity = data["activity"];
+        for (size_t i = 0; i < times.size() && i < activity.size(); i++) {
+            if (activity[i].is_null()) continue;
+            int64_t timeMs = start * 1000 + times[i].get<int64_t>();
+            if (timeMs < t0 * 1000 || timeMs >= t1 * 1000) continue;
+            double score = activity[i].get<double>();
+            double& value = values[(timeMs / 1000 - t0) / bucket];
+            value = std::max(value, score);
+            if (score > 0) peaks.push_back({timeMs, score, &name, start});
+        }
+        if (data.contains("audio")) {
+            const json& rms = data["audio"]["rms"];
+            int64_t windowMs = data["audio"].value("windowMs", AUDIO_WINDOW_MS);
+            for (size_t i = 0; i < rms.size(); i++) {
+                int64_t timeMs = start * 1000 + (int64_t)i * windowMs;
+                if (timeMs < t0 * 1000 || timeMs >= t1 * 1000) continue;
+                double& value = loudness[(timeMs / 1000 - t0) / bucket];
+                value = std::max(value, rms[i].get<double>());
+            }
+        }
+    }
+    size_t peakCount = std::min(peaks.size(), ACTIVITY_PEAKS);
+    std::partial_sort(peaks.begin(), peaks.begin() + peakCount, peaks.end(),
+                      [](const Peak& a, const Peak& b) { return a.score > b.score; });
+
+    json result;
+    result["channel"] = channelName(channel);
+    result["from"] = t0;
+    result["to"] = t1;
+    result["bucket"] = bucket;
+    result["segments"] = names.size();
+    result["analyzed"] = analyzed;
+    result["kernel"] = lumaKernelsForCpu().name;
+    result["values"] = json::array();
+    for (double value : values) result["values"].push_back(value < 0 ? json(nullptr) : json(value));
+    result["loudness"] = json::array();
+    for (double value : loudness) result["loudness"].push_back(value < -999 ? json(nullptr) : json(value));
+    result["peaks"] = json::array();
+    for (size_t i = 0; i < peakCount; i++) {
+        result["peaks"].push_back({{"time", peaks[i].timeMs / 1000.0}, {"score", peaks[i].score},
+                                   {"name", *peaks[i].name}, {"offset", peaks[i].timeMs / 1000.0 - peaks[i].start}});
+    }
+    return result;
+}
+
+// ==================== 批量删除 ====================
+// 录制状态取自内存中的录制标志和分段索引，不再逐个文件扫描目录或查询进程；
+// 文件直接 unlink，索引的删除记录按通道一次追加
+struct DeleteItem {
+    std::string id;
+    int channel;
+    std::string name;
+    bool success = false;
+    std::string message;
+    int64_t size = 0;
+};
+
+// 分段 ID 即文件列表中的 relativePath: "videos1/<文件名>"
+bool parseSegmentId(const std::string& id, int& channel, std::string& name) {
+    size_t slash = id.find('/');
+    if (slash == std::string::npos) return false;
+    channel = parseChannel(id.substr(0, slash));
+    name = id.substr(slash + 1);
+    return channel != 0 && isSegmentFileName(name) && name.find('/') == std::string::npos;
+}
+
+void deleteSegments(std::vector<DeleteItem>& items) {
+    std::set<std::string> pending = pendingUploadPaths();
+    std::string dirPaths[3];
+    {
+        std::lock_guard<std::mutex> lock(catalogMutex);
+        for (auto& item : items) {
+            if (!item.message.empty()) continue;
+            SegmentCatalog& catalog = channelCatalog(item.channel);
+            dirPaths[item.channel] = catalog.dirPath;
+            int64_t modifyTime;
+            if (!lookupCatalogSegment(catalog, item.name, item.size, modifyTime)) {
+                item.message = "文件不存在";
+            } else if (segmentWriting(item.channel, item.name)) {
+                item.message = "无法删除正在录制的文件";
+            } else if (pending.count(catalog.dirPath + "/" + item.name)) {
+                item.message = "文件尚未上传到S3，暂不能删除";
             } else {
-                file.recordingDuration = "00:00:00";
+                item.success = true;
             }
-            
-            recordingFiles.push_back(file);
         }
     }
-    
-    return recordingFiles;
+
+    std::vector<CatalogEntry> ops[3];
+    for (auto& item : items) {
+        if (!item.success) continue;
+        const std::string& dirPath = dirPaths[item.channel];
+        if (unlink((dirPath + "/" + item.name).c_str()) != 0 && errno != ENOENT) {
+            item.success = false;
+            item.message = std::string("文件删除失败: ") + strerror(errno);
+            continue;
+        }
+        removeSegmentSidecars(dirPath, item.name);
+        item.message = "文件删除成功";
+        ops[item.channel].push_back(makeCatalogEntry(CATALOG_DELETE, item.name, 0, 0));
+    }
+
+    std::lock_guard<std::mutex> lock(catalogMutex);
+    for (int channel = 1; channel <= 2; channel++) {
+        SegmentCatalog& catalog = channelCatalog(channel);
+        if (!ops[channel].empty() && catalog.dirPath == dirPaths[channel]) {
+            appendCatalogJournal(catalog, ops[channel]);
+        }
+    }
+}
+
+// 通道在 [t0, t1) 内开始的全部分段的 ID
+std::vector<std::string> segmentIdsInRange(int channel, int64_t t0, int64_t t1) {
+    std::vector<std::string> ids;
+    std::lock_guard<std::mutex> lock(catalogMutex);
+    const SegmentColumns& rows = channelCatalog(channel).rows;
+    for (size_t row = rows.lowerBound(t0); row < rows.count() && rows.start[row] < t1; row++) {
+        ids.push_back(channelName(channel) + "/" + segmentFileName(rows.kind[row], rows.start[row]));
+    }
+    return ids;
+}
+
+// ==================== 打包下载 (tar / zip) ====================
+// 归档边生成边以 chunked 方式发送，不预先计算也不落盘。文件用一块固定缓冲区顺序读取，
+// 读过的部分随即丢弃页缓存，内存占用与归档大小无关。zip 只存储不压缩：CRC-32 在数据流过时计算，
+// 写在数据后的数据描述符中（通用标志位 3），超过 4GB 的条目或偏移使用 ZIP64 扩展。
+// 每路打包在传输期间占用一个服务线程，同时进行的数量有上限
+const int MAX_ARCHIVE_STREAMS = 2;
+const size_t ARCHIVE_CHUNK = 256 * 1024;
+const uint64_t ZIP_MAX32 = 0xFFFFFFFFu;
+std::atomic<int> archiveStreams(0);
+
+struct ArchiveEntry {
+    std::string path;     // 磁盘上的完整路径
+    std::string name;     // 归档内的名字，即分段 ID
+    int64_t size = 0;
+    std::time_t modifyTime = 0;
+    uint32_t crc = 0;
+    uint64_t offset = 0;  // zip 本地文件头在归档中的偏移
+};
+
+struct ArchiveStream {
+    bool zip = true;
+    std::vector<ArchiveEntry> entries;
+    size_t index = 0;       // 正在发送的条目
+    int fd = -1;
+    int64_t sent = 0;       // 当前条目已发送的数据字节
+    uint64_t written = 0;   // 归档已输出的总字节
+    std::vector<char> buffer;
+
+    ~ArchiveStream() {
+        if (fd >= 0) close(fd);
+        archiveStreams--;
+    }
+};
+
+void putLE(std::string& out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) out += (char)((value >> (8 * i)) & 0xFF);
+}
+
+// DOS 日期时间 (本地时间，2 秒精度)
+void dosDateTime(std::time_t t, uint16_t& date, uint16_t& time) {
+    struct tm tm;
+    localtime_r(&t, &tm);
+    date = (uint16_t)(((std::max(tm.tm_year, 80) - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday);
+    time = (uint16_t)((tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2));
+}
+
+// ustar 头；超过 11 位八进制 (8GB) 的大小用 GNU base-256 编码
+std::string tarHeader(const ArchiveEntry& entry) {
+    char h[512];
+    memset(h, 0, sizeof(h));
+    memcpy(h, entry.name.data(), std::min<size_t>(entry.name.size(), 100));
+    snprintf(h + 100, 8, "%07o", 0644);
+    snprintf(h + 108, 8, "%07o", 0);
+    snprintf(h + 116, 8, "%07o", 0);
+    if ((uint64_t)entry.size < 077777777777ull) {
+        snprintf(h + 124, 12, "%011llo", (unsigned long long)entry.size);
+    } else {
+        h[124] = (char)0x80;
+        for (int i = 0; i < 8; i++) h[135 - i] = (char)(((uint64_t)entry.size >> (8 * i)) & 0xFF);
+    }
+    snprintf(h + 136, 12, "%011llo", (unsigned long long)entry.modifyTime);
+    memset(h + 148, ' ', 8);
+    h[156] = '0';
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    unsigned sum = 0;
+    for (unsigned char c : h) sum += c;
+    snprintf(h + 148, 8, "%06o", sum);
+    h[155] = ' ';
+    return std::string(h, sizeof(h));
+}
+
+bool zipEntryNeeds64(const ArchiveEntry& entry) {
+    return (uint64_t)entry.size >= ZIP_MAX32;
+}
+
+std::string zipLocalHeader(const ArchiveEntry& entry) {
+    bool zip64 = zipEntryNeeds64(entry);
+    uint16_t date, time;
+    dosDateTime(entry.modifyTime, date, time);
+    std::string h;
+    putLE(h, 0x04034b50, 4);
+    putLE(h, zip64 ? 45 : 20, 2);
+    putLE(h, 0x0008, 2);          // CRC 和大小在数据描述符中
+    putLE(h, 0, 2);               // 存储，不压缩
+    putLE(h, time, 2);
+    putLE(h, date, 2);
+    putLE(h, 0, 4);
+    putLE(h, zip64 ? ZIP_MAX32 : 0, 4);
+    putLE(h, zip64 ? ZIP_MAX32 : 0, 4);
+    putLE(h, entry.name.size(), 2);
+    putLE(h, zip64 ? 20 : 0, 2);
+    h += entry.name;
+    if (zip64) {
+        putLE(h, 0x0001, 2);
+        putLE(h, 16, 2);
+        putLE(h, 0, 8);
+        putLE(h, 0, 8);
+    }
+    return h;
+}
+
+std::string zipDataDescriptor(const ArchiveEntry& entry) {
+    int sizeBytes = zipEntryNeeds64(entry) ? 8 : 4;
+    std::string d;
+    putLE(d, 0x08074b50, 4);
+    putLE(d, entry.crc, 4);
+    putLE(d, entry.size, sizeBytes);
+    putLE(d, entry.size, sizeBytes);
+    return d;
+}
+
+// 中央目录、ZIP64 结束记录（需要时）和结束记录
+std::string zipCentralDirectory(const std::vector<ArchiveEntry>& entries, uint64_t cdOffset) {
+    std::string cd;
+    for (const auto& entry : entries) {
+        bool bigSize = zipEntryNeeds64(entry);
+        bool bigOffset = entry.offset >= ZIP_MAX32;
+        std::string extra;
+        if (bigSize) {
+            putLE(extra, entry.size, 8);
+            putLE(extra, entry.size, 8);
+        }
+        if (bigOffset) putLE(extra, entry.offset, 8);
+        if (!extra.empty()) {
+            std::string field;
+            putLE(field, 0x0001, 2);
+            putLE(field, extra.size(), 2);
+            extra = field + extra;
+        }
+        uint16_t date, time;
+        dosDateTime(entry.modifyTime, date, time);
+        putLE(cd, 0x02014b50, 4);
+        putLE(cd, (3 << 8) | 45, 2);   // Unix
+        putLE(cd, extra.empty() ? 20 : 45, 2);
+        putLE(cd, 0x0008, 2);
+        putLE(cd, 0, 2);
+        putLE(cd, time, 2);
+        putLE(cd, date, 2);
+        putLE(cd, entry.crc, 4);
+        putLE(cd, bigSize ? ZIP_MAX32 : entry.size, 4);
+        putLE(cd, bigSize ? ZIP_MAX32 : entry.size, 4);
+        putLE(cd, entry.name.size(), 2);
+        putLE(cd, extra.size(), 2);
+        putLE(cd, 0, 2);
+        putLE(cd, 0, 2);
+        putLE(cd, 0, 2);
+        putLE(cd, (uint32_t)(0100644) << 16, 4);
+        putLE(cd, bigOffset ? ZIP_MAX32 : entry.offset, 4);
+        cd += entry.name;
+        cd += extra;
+    }
+
+    uint64_t cdSize = cd.size();
+    uint64_t count = entries.size();
+    if (count >= 0xFFFF || cdSize >= ZIP_MAX32 || cdOffset >= ZIP_MAX32) {
+        uint64_t zip64End = cdOffset + cdSize;
+        putLE(cd, 0x06064b50, 4);
+        putLE(cd, 44, 8);
+        putLE(cd, 45, 2);
+        putLE(cd, 45, 2);
+        putLE(cd, 0, 4);
+        putLE(cd, 0, 4);
+        putLE(cd, count, 8);
+        putLE(cd, count, 8);
+        putLE(cd, cdSize, 8);
+        putLE(cd, cdOffset, 8);
+        putLE(cd, 0x07064b50, 4);
+        putLE(cd, 0, 4);
+        putLE(cd, zip64End, 8);
+        putLE(cd, 1, 4);
+    }
+    putLE(cd, 0x06054b50, 4);
+    putLE(cd, 0, 2);
+    putLE(cd, 0, 2);
+    putLE(cd, std::min<uint64_t>(count, 0xFFFF), 2);
+    putLE(cd, std::min<uint64_t>(count, 0xFFFF), 2);
+    putLE(cd, std::min<uint64_t>(cdSize, ZIP_MAX32), 4);
+    putLE(cd, std::min<uint64_t>(cdOffset, ZIP_MAX32), 4);
+    putLE(cd, 0, 2);
+    return cd;
+}
+
+bool archiveWrite(ArchiveStream& archive, DataSink& sink, const std::string& data) {
+    archive.written += data.size();
+    return sink.write(data.data(), data.size());
+}
+
+// 每次调用输出一段：条目头、一块文件数据、条目尾或归档结尾。返回 false 时中止响应
+bool archiveStep(ArchiveStream& archive, DataSink& sink) {
+    if (archive.index == archive.entries.size()) {
+        if (archive.zip) {
+            if (!archiveWrite(archive, sink, zipCentralDirectory(archive.entries, archive.written))) return false;
+        } else if (!archiveWrite(archive, sink, std::string(1024, '\0'))) {
+            return false;
+        }
+        sink.done();
+        return true;
+    }
+
+    ArchiveEntry& entry = archive.entries[archive.index];
+    if (archive.fd < 0) {
+        // 打开时的大小写入条目头，此后只发送这么多字节
+        archive.fd = open(entry.path.c_str(), O_RDONLY);
+        struct stat st;
+        if (archive.fd < 0 || fstat(archive.fd, &st) != 0) {
+            std::cerr << "打包下载: 无法读取 " << entry.path << std::endl;
+            return false;
+        }
+        posix_fadvise(archive.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        entry.size = st.st_size;
+        entry.modifyTime = st.st_mtime;
+        entry.offset = archive.written;
+        entry.crc = 0;
+        archive.sent = 0;
+        return archiveWrite(archive, sink, archive.zip ? zipLocalHeader(entry) : tarHeader(entry));
+    }
+
+    if (archive.sent < entry.size) {
+        size_t want = (size_t)std::min<int64_t>(ARCHIVE_CHUNK, entry.size - archive.sent);
+        ssize_t n = pread(archive.fd, archive.buffer.data(), want, archive.sent);
+        if (n <= 0) {
+            std::cerr << "打包下载: 文件在发送期间变短 " << entry.path << std::endl;
+            return false;
+        }
+        if (archive.zip) entry.crc = crc32(archive.buffer.data(), n, entry.crc);
+        posix_fadvise(archive.fd, archive.sent, n, POSIX_FADV_DONTNEED);
+        archive.sent += n;
+        archive.written += n;
+        return sink.write(archive.buffer.data(), n);
+    }
+
+    close(archive.fd);
+    archive.fd = -1;
+    archive.index++;
+    if (archive.zip) return archiveWrite(archive, sink, zipDataDescriptor(entry));
+    size_t padding = (512 - entry.size % 512) % 512;
+    return padding == 0 || archiveWrite(archive, sink, std::string(padding, '\0'));
+}
+
+// 把分段 ID 解析为归档条目；正在写入的分段没有完整的 moov，不能打包
+bool collectArchiveEntries(const std::vector<std::string>& ids, std::vector<ArchiveEntry>& entries, std::string& error) {
+    std::lock_guard<std::mutex> lock(catalogMutex);
+    for (const auto& id : ids) {
+        int channel;
+        std::string name;
+        int64_t size, modifyTime;
+        if (!parseSegmentId(id, channel, name)) {
+            error = "无效的文件ID: " + id;
+            return false;
+        }
+        SegmentCatalog& catalog = channelCatalog(channel);
+        if (!lookupCatalogSegment(catalog, name, size, modifyTime)) {
+            error = "文件不存在: " + id;
+            return false;
+        }
+        if (segmentWriting(channel, name)) {
+            error = "文件正在录制: " + id;
+            return false;
+        }
+        ArchiveEntry entry;
+        entry.path = catalog.dirPath + "/" + name;
+        entry.name = id;
+        entries.push_back(entry);
+    }
+    return true;
+}
+
+// ==================== 转封装下载 (MPEG-TS / Matroska) ====================
+// 由 ffmpeg 以 -c copy 把存储的 MP4 转封装到管道，响应边读边以 chunked 方式发送：不重新编码、不写临时文件，
+// ffmpeg 只按交织顺序缓存少量数据包（不超过一个 GOP）。每路转封装是一个 ffmpeg 进程，同时进行的数量有上限
+const int MAX_REMUX_STREAMS = 2;
+const size_t REMUX_CHUNK = 64 * 1024;
+std::atomic<int> remuxStreams(0);
+
+// 客户端断开或响应被丢弃时由析构函数结束 ffmpeg
+struct RemuxProcess {
+    pid_t pid = -1;
+    int fd = -1;
+    std::vector<char> buffer;
+
+    ~RemuxProcess() {
+        if (fd >= 0) close(fd);
+        if (pid > 0) {
+            kill(pid, SIGKILL);
+            waitpid(pid, nullptr, 0);
+        }
+        remuxStreams--;
+    }
+};
+
+bool startRemux(RemuxProcess& process, const std::string& path, const std::string& container) {
+    std::vector<std::string> args = {"ffmpeg", "-hide_banner", "-loglevel", "error", "-nostdin", "-i", path,
+                                     "-map", "0:v?", "-map", "0:a?", "-c", "copy",
+                                     "-f", container == "ts" ? "mpegts" : "matroska", "pipe:1"};
+    std::vector<char*> argv;
+    for (auto& arg : args) argv.push_back(&arg[0]);
+    argv.push_back(nullptr);
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) return false;
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        execvp(argv[0], argv.data());
+        _exit(127);
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        return false;
+    }
+    process.pid = pid;
+    process.fd = fds[0];
+    process.buffer.resize(REMUX_CHUNK);
+    return true;
+}
+
+// 每次调用转发一块 ffmpeg 输出；ffmpeg 异常退出时中止响应，客户端会看到不完整的传输
+bool remuxStep(RemuxProcess& process, DataSink& sink) {
+    ssize_t n = read(process.fd, process.buffer.data(), process.buffer.size());
+    if (n > 0) return sink.write(process.buffer.data(), n);
+    if (n < 0 && errno == EINTR) return true;
+    int status = 0;
+    waitpid(process.pid, &status, 0);
+    process.pid = -1;
+    if (n < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        std::cerr << "转封装失败，ffmpeg 退出状态 " << status << std::endl;
+        return false;
+    }
+    sink.done();
+    return true;
+}
+
+// ==================== 边录边看 ====================
+// 跟随正在写入的分段：从文件开头读到当前末尾后，由 inotify 的 IN_MODIFY 唤醒继续读取新写入的数据，
+// 分段被关闭（切换到下一个分段或停止录制）后发送剩余数据并结束响应。普通 MP4 的 moov 在关闭时才写入，
+// 只有开启 fragmented_mp4 后录制的分段能在写入过程中播放
+const int MAX_LIVE_STREAMS = 2;
+const size_t LIVE_CHUNK = 64 * 1024;
+const int LIVE_IDLE_SECONDS = 10;   // 这么久没有写入则认为录制已停止
+std::atomic<int> liveStreams(0);
+
+struct LiveTail {
+    int fd = -1;
+    int notifyFd = -1;
+    off_t offset = 0;
+    bool closed = false;
+    std::vector<char> buffer;
+
+    ~LiveTail() {
+        if (fd >= 0) close(fd);
+        if (notifyFd >= 0) close(notifyFd);
+        liveStreams--;
+    }
+};
+
+// 分片 MP4 以 ftyp + 空 moov 开头，普通 MP4 在写入过程中只有 ftyp/free/mdat
+bool mp4HasLeadingMoov(int fd) {
+    uint64_t offset = 0;
+    for (int i = 0; i < 8; i++) {
+        unsigned char header[16];
+        if (pread(fd, header, sizeof(header), offset) < 8) return false;
+        uint64_t size = ((uint64_t)header[0] << 24) | ((uint64_t)header[1] << 16) | ((uint64_t)header[2] << 8) | header[3];
+        std::string type((const char*)header + 4, 4);
+        if (type == "moov") return true;
+        if (type == "mdat") return false;
+        if (size == 1) {
+            size = 0;
+            for (int k = 8; k < 16; k++) size = (size << 8) | header[k];
+        }
+        if (size < 8) return false;
+        offset += size;
+    }
+    return false;
 }
 
-// 检查 ffmpeg 进程是否正在运行
-bool checkFfmpegRunning() {
-    std::string pgrepCommand = "pgrep ffmpeg";
-    FILE *pipe = popen(pgrepCommand.c_str(), "r");
-    if (!pipe) {
+bool openLiveTail(LiveTail& tail, const std::string& path) {
+    tail.fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (tail.fd < 0) return false;
+    tail.notifyFd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (tail.notifyFd < 0 ||
+        inotify_add_watch(tail.notifyFd, path.c_str(), IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
         return false;
     }
-    char buffer[128];
-    std::string result = "";
-    while (fgets(buffer, sizeof(buffer), pipe) != NULL) {
-        result += buffer;
-    }
-    pclose(pipe);
-    
-    // 如果有输出说明有 ffmpeg 进程在运行
-    return !result.empty() && result != "\n";
+    tail.buffer.resize(LIVE_CHUNK);
+    return true;
 }
 
-// Helper function to check if a process is running using its PID file
-bool isProcessRunning(const std::string& pid_file) {
-    std::ifstream file(pid_file);
-    if (!file.is_open()) {
-        return false;
+// 每次调用发送一块新数据；读到当前末尾时等待 inotify 事件，超时用来检查客户端是否断开和录制是否已停止
+bool liveTailStep(LiveTail& tail, DataSink& sink) {
+    ssize_t n = pread(tail.fd, tail.buffer.data(), tail.buffer.size(), tail.offset);
+    if (n > 0) {
+        tail.offset += n;
+        return sink.write(tail.buffer.data(), n);
     }
-    pid_t pid;
-    file >> pid;
-    file.close();
-    // kill with signal 0 is a standard way to check for process existence
-    return (kill(pid, 0) == 0);
+    if (n < 0) return errno == EINTR;
+    if (tail.closed) {
+        sink.done();
+        return true;
+    }
+
+    struct pollfd pfd = {tail.notifyFd, POLLIN, 0};
+    int ready = poll(&pfd, 1, 1000);
+    if (ready > 0) {
+        alignas(struct inotify_event) char events[4096];
+        ssize_t length;
+        while ((length = read(tail.notifyFd, events, sizeof(events))) > 0) {
+            for (char* p = events; p < events + length;) {
+                const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(p);
+                if (event->mask & (IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF)) tail.closed = true;
+                p += sizeof(struct inotify_event) + event->len;
+            }
+        }
+    } else if (ready == 0) {
+        if (!sink.is_writable()) return false;
+        struct stat st;
+        if (fstat(tail.fd, &st) != 0 || std::time(nullptr) - st.st_mtime > LIVE_IDLE_SECONDS) tail.closed = true;
+    }
+    return true;
+}
+
+// ==================== 服务端推送 (Server-Sent Events) ====================
+// 每个推送连接在存续期间占用一个服务线程，数量有上限，超出时提示客户端改用对应的轮询接口
+bool admitEventClient(std::atomic<int>& clients, int maxClients, const std::string& pollPath, Response& res) {
+    if (clients.fetch_add(1) < maxClients) return true;
+    clients--;
+    json error;
+    error["success"] = false;
+    error["message"] = "推送连接数已达上限，请改用 " + pollPath + " 轮询";
+    res.status = 503;
+    res.set_content(error.dump(), "application/json");
+    return false;
+}
+
+// 等待 hasNew 成立后发送 takeEvents 生成的消息，15 秒没有新消息时发送注释行保活。两者都在持有 mutex 时调用，
+// takeEvents 负责推进客户端的位置。每秒检查一次连接，客户端断开后尽快释放服务线程；
+// minIntervalSeconds 大于 0 时每条消息之后至少间隔这么久，合并频繁的变化。连接结束时释放 clients 计数
+void serveEventStream(Response& res, std::mutex& mutex, std::condition_variable& cv, std::atomic<int>& clients,
+                      int minIntervalSeconds, std::function<bool()> hasNew, std::function<std::string()> takeEvents) {
+    res.set_header("Cache-Control", "no-cache");
+    res.set_chunked_content_provider("text/event-stream", [&mutex, &cv, minIntervalSeconds, hasNew, takeEvents](
+                                                              size_t /* offset */, DataSink& sink) {
+        std::string event;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            for (int i = 0; i < 15 && !hasNew(); i++) {
+                if (!sink.is_writable()) return false;
+                cv.wait_for(lock, std::chrono::seconds(1), hasNew);
+            }
+            event = hasNew() ? takeEvents() : ": keepalive\n\n";
+        }
+        if (!sink.write(event.data(), event.size())) return false;
+        if (minIntervalSeconds > 0) std::this_thread::sleep_for(std::chrono::seconds(minIntervalSeconds));
+        return true;
+    }, [&clients](bool /* success */) { clients--; });
 }
 
+const size_t HTTP_SHORT_REQUEST_THREADS = 4;   // 长连接占满后仍留给普通请求的服务线程
+
 int main() {
     std::cout << "视频录制系统启动中..." << std::endl;
     
@@ -525,9 +6689,28 @@ int main() {
     std::cout << "初始化配置..." << std::endl;
     loadConfig();
     std::cout << "配置初始化完成" << std::endl;
+    loadUploadQueue();   // 须在目录对账之前恢复已处理的分段，否则它们会被重新入队
+    startWriterWatch();
+    startCatalog();
+    startSegmentListReaders();
+    startVideoTapReaders();
+    startRecorderWatchdog();
+    startEmergencyMonitor();
+    startUploadWorkers();
+    startChecksumWorker();
+    startAnalysisWorker();
+    loadEventIndex();
+    startGpioWatchers();
     
     std::cout << "创建HTTP服务器..." << std::endl;
     Server svr;
+    // 推送、转封装、跟随播放和打包下载在连接期间各占一个服务线程，线程池在这些上限之外
+    // 再留出处理普通请求的线程，长连接全部占满时 /api/status、/api/stop 等仍能响应
+    svr.new_task_queue = [] {
+        size_t longLived = MAX_SEGMENT_EVENT_CLIENTS + MAX_UPLOAD_EVENT_CLIENTS + MAX_REMUX_STREAMS +
+                           MAX_LIVE_STREAMS + MAX_ARCHIVE_STREAMS;
+        return new ThreadPool(std::max<size_t>(CPPHTTPLIB_THREAD_POOL_COUNT, longLived + HTTP_SHORT_REQUEST_THREADS));
+    };
     
     // 设置请求日志
     svr.set_logger([](const Request& req, const Response& res) {
@@ -565,6 +6748,39 @@ int main() {
         response["tfcard"]["usedSpace"] = tfInfo.usedSpace;
         response["tfcard"]["freeSpace"] = tfInfo.freeSpace;
         response["tfcard"]["usagePercent"] = tfInfo.usagePercent;
+
+        {
+            std::lock_guard<std::mutex> lock(catalogMutex);
+            for (int channel = 1; channel <= 2; channel++) {
+                const SegmentCatalog& catalog = channelCatalog(channel);
+                json catalogJson;
+                catalogJson["segments"] = catalog.rows.count() + catalog.irregular.size();
+                catalogJson["indexBytes"] = catalog.rows.memoryBytes();
+                response["catalog"][channelName(channel)] = catalogJson;
+            }
+        }
+
+        // 录制进程当前写入的分段，没有时为 null
+        for (int channel = 1; channel <= 2; channel++) {
+            WritingSegment segment;
+            json segmentJson = nullptr;
+            if (recorderSegment(channel, segment)) {
+                segmentJson["name"] = segment.name;
+                segmentJson["startTime"] = segment.startTime;
+                segmentJson["bytes"] = segment.bytes;
+                segmentJson["lastWrite"] = segment.lastWrite;
+            }
+            response["writing"][channelName(channel)] = segmentJson;
+        }
+
+        // 各路录制进程的实时统计（帧率、码率、丢帧、时间漂移）、卡住检测和画面冻结检测
+        for (int channel = 1; channel <= 2; channel++) {
+            response["ingest"][channelName(channel)] = ingestStatsToJson(channel);
+            response["watchdog"][channelName(channel)] = watchdogToJson(channel);
+            response["freeze"][channelName(channel)] = freezeToJson(channel);
+            response["audio"][channelName(channel)] = audioDecisionToJson(channel);
+            response["emergency"][channelName(channel)] = emergencyToJson(channel);
+        }
         
         // 添加 Cache-Control 头防止缓存
         res.set_header("Cache-Control", "no-cache, no-store, must-revalidate");
@@ -573,18 +6789,32 @@ int main() {
         res.set_content(response.dump(), "application/json");
     });
     
+    // API: 录制进程日志，tail 为条数，level 为最低级别
+    svr.Get(R"(/api/channels/(\d+)/log)", [](const Request& req, Response& res) {
+        json error;
+        error["success"] = false;
+        int channel = parseChannel(req.matches[1]);
+        int64_t tail = 100;
+        bool tailValid = !req.has_param("tail") || parseIntParam(req.get_param_value("tail"), tail);
+        int level = req.has_param("level") ? parseLogSeverityName(req.get_param_value("level")) : LOG_DEBUG;
+        if (channel == 0 || !tailValid || tail <= 0 || level < 0) {
+            error["message"] = "需要有效的通道、tail (正整数) 和 level (debug/info/warning/error/fatal)";
+            res.status = 400;
+            res.set_content(error.dump(), "application/json");
+            return;
+        }
+        json response = recorderLogToJson(channel, tail, level);
+        response["success"] = true;
+        res.set_content(response.dump(), "application/json");
+    });
+
     // API: 开始录制
     svr.Post("/api/start", [](const Request& req, Response& res) {
         try {
             // 如果前端发送了配置，则使用该配置
             if (!req.body.empty()) {
                 json reqJson = json::parse(req.body);
-                if (reqJson.contains("rtsp_url1")) config.rtsp_url1 = reqJson["rtsp_url1"];
-                if (reqJson.contains("rtsp_url2")) config.rtsp_url2 = reqJson["rtsp_url2"];
-                if (reqJson.contains("save_path1")) config.save_path1 = reqJson["save_path1"];
-                if (reqJson.contains("save_path2")) config.save_path2 = reqJson["save_path2"];
-                if (reqJson.contains("segment_time")) config.segment_time = reqJson["segment_time"];
-                if (reqJson.contains("dual_stream_enabled")) config.dual_stream_enabled = reqJson["dual_stream_enabled"];
+                applyConfigJson(reqJson);
             }
 
             startRecording("", "", "", "");
@@ -610,17 +6840,110 @@ int main() {
         }
     });
     
+    // API: 触发事件录制
+    svr.Post("/api/trigger", [](const Request& req, Response& res) {
+        int channel = parseChannel(req.get_param_value("channel"));
+        if (channel == 0) {
+            json error;
+            error["success"] = false;
+            error["message"] = "无效的通道参数";
+            res.status = 400;
+            res.set_content(error.dump(), "application/json");
+            return;
+        }
+
+        std::string source = req.has_param("source") ? req.get_param_value("source") : "api";
+        std::string message;
+        uint64_t eventId = triggerEvent(channel, source, req.get_param_value("note"), message);
+        json response;
+        response["success"] = eventId != 0;
+        response["message"] = message;
+        response["channel"] = channel;
+        if (eventId != 0) response["event_id"] = eventId;
+        res.set_content(response.dump(), "application/json");
+    });
+
+    // API: 事件列表
+    svr.Get("/api/events", [](const Request& req, Response& res) {
+        int channel = parseChannel(req.get_param_value("channel"));
+        json response;
+        response["success"] = true;
+        response["events"] = json::array();
+        {
+            std::lock_guard<std::mutex> lock(eventMutex);
+            for (const auto& clip : eventIndex) {
+                if (channel == 0 || clip.channel == channel) response["events"].push_back(eventToJson(clip));
+            }
+            for (int ch = 1; ch <= 2; ch++) {
+                if (eventState[ch].open && (channel == 0 || ch == channel)) {
+                    response["events"].push_back(eventToJson(eventState[ch].clip));
+                }
+            }
+        }
+        res.set_content(response.dump(), "application/json");
+    });
+
+    // API: 检测告警记录
+    svr.Get("/api/detections", [](const Request& req, Response& res) {
+        int64_t t0 = 0;
+        int64_t t1 = std::time(nullptr) + 1;
+        if ((req.has_param("from") && !parseTimeParam(req.get_param_value("from"), t0)) ||
+            (req.has_param("to") && !parseTimeParam(req.get_param_value("to"), t1)) || t0 > t1) {
+            json error;
+            error["success"] = false;
+            error["message"] = "无效的时间范围";
+            res.status = 400;
+            res.set_content(error.dump(), "application/json");
+            return;
+        }
+        int channel = parseChannel(req.get_param_value("channel"));
+        json response;
+        response["success"] = true;
+        response["detections"] = loadDetections(channel, req.get_param_value("source"), t0, t1);
+        res.set_content(response.dump(), "application/json");
+    });
+
+    // API: 单个事件，?download=1 时直接返回事件片段
+    svr.Get(R"(/api/events/(\d+))", [](const Request& req, Response& res) {
+        EventClip clip;
+        if (!findEvent(std::stoull(req.matches[1].str()), clip)) {
+            json error;
+            error["success"] = false;
+            error["message"] = "事件不存在";
+            res.status = 404;
+            res.set_content(error.dump(), "application/json");
+            return;
+        }
+
+        if (!req.has_param("download")) {
+            json response = eventToJson(clip);
+            response["success"] = true;
+            res.set_content(response.dump(), "application/json");
+            return;
+        }
+
+        if (clip.status != "saved") {
+            res.status = 409;
+            res.set_content("Event clip not ready", "text/plain");
+            return;
+        }
+        std::string fullPath = channelSavePath(clip.channel) + "/" + clip.fileName;
+        std::ifstream file(fullPath, std::ios::binary);
+        if (!file.is_open()) {
+            res.status = 404;
+            res.set_content("File not found", "text/plain");
+            return;
+        }
+        std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        res.set_header("Content-Disposition", "attachment; filename=\"" + clip.fileName + "\"");
+        res.set_content(content, "video/mp4");
+    });
+    
     // API: 更新配置
     svr.Post("/api/config", [](const Request& req, Response& res) {
         try {
             json reqJson = json::parse(req.body);
-            
-            if (reqJson.contains("rtsp_url1")) config.rtsp_url1 = reqJson["rtsp_url1"];
-            if (reqJson.contains("rtsp_url2")) config.rtsp_url2 = reqJson["rtsp_url2"];
-            if (reqJson.contains("save_path1")) config.save_path1 = reqJson["save_path1"];
-            if (reqJson.contains("save_path2")) config.save_path2 = reqJson["save_path2"];
-            if (reqJson.contains("segment_time")) config.segment_time = reqJson["segment_time"];
-            if (reqJson.contains("dual_stream_enabled")) config.dual_stream_enabled = reqJson["dual_stream_enabled"];
+            applyConfigJson(reqJson);
             
             saveConfig();
             
@@ -636,13 +6959,7 @@ int main() {
     // API: 获取配置
     svr.Get("/api/config", [](const Request& /* req */, Response& res) {
         loadConfig();
-        json response;
-        response["rtsp_url1"] = config.rtsp_url1;
-        response["rtsp_url2"] = config.rtsp_url2;
-        response["save_path1"] = config.save_path1;
-        response["save_path2"] = config.save_path2;
-        response["segment_time"] = config.segment_time;
-        response["dual_stream_enabled"] = config.dual_stream_enabled;
+        json response = configToJson();
         
         res.set_content(response.dump(), "application/json");
     });
@@ -656,17 +6973,7 @@ int main() {
             response["files"] = json::array();
             
             for (const auto& file : files) {
-                json fileJson;
-                fileJson["name"] = file.name;
-                fileJson["fullPath"] = file.fullPath;
-                fileJson["relativePath"] = file.relativePath;
-                fileJson["size"] = file.size;
-                fileJson["sizeStr"] = file.sizeStr;
-                fileJson["modifyTime"] = file.modifyTime;
-                fileJson["timeStr"] = file.timeStr;
-                fileJson["channel"] = file.channel;
-                fileJson["isRecording"] = file.isRecording;
-                response["files"].push_back(fileJson);
+                response["files"].push_back(fileInfoToJson(file));
             }
             
             res.set_content(response.dump(), "application/json");
@@ -678,6 +6985,172 @@ int main() {
         }
     });
     
+    // API: 按时间范围查询分段及覆盖缺口
+    svr.Get("/api/segments", [](const Request& req, Response& res) {
+        int64_t t0 = 0;
+        int64_t t1 = std::time(nullptr);
+        if ((req.has_param("from") && !parseTimeParam(req.get_param_value("from"), t0)) ||
+            (req.has_param("to") && !parseTimeParam(req.get_param_value("to"), t1)) || t0 > t1) {
+            json error;
+            error["success"] = false;
+            error["message"] = "无效的时间范围";
+            res.status = 400;
+            res.set_content(error.dump(), "application/json");
+            return;
+        }
+        int64_t minGap = 2;
+        if (req.has_param("min_gap") && (!parseIntParam(req.get_param_value("min_gap"), minGap) || minGap < 0)) {
+            json error;
+            error["success"] = false;
+            error["message"] = "min_gap 须为非负整数";
+            res.status = 400;
+            res.set_content(error.dump(), "application/json");
+            return;
+        }
+
+        int channel = parseChannel(req.get_param_value("channel"));
+        if (req.has_param("channel") && channel == 0) {
+            json error;
+            error["success"] = false;
+            error["message"] = "无效的通道参数";
+            res.status = 400;
+            res.set_content(error.dump(), "application/json");
+            return;
+        }
+
+        json response;
+        response["success"] = true;
+        response["from"] = t0;
+        response["to"] = t1;
+        response["channels"] = json::array();
+        for (int ch = 1; ch <= 2; ch++) {
+            if (channel == 0 || ch == channel) {
+                response["channels"].push_back(querySegments(ch, t0, t1, minGap));
+            }
+        }
+        res.set_content(response.dump(), "application/json");
+    });
+
+    // API: 关键帧活动度热图
+    svr.Get("/api/activity", [](const Request& req, Response& res) {
+        int64_t t1 = std::time(nullptr);
+        int64_t t0 = t1 - 24 * 3600;
+        int64_t bucket = 60;
+        if ((req.has_param("bucket") && !parseIntParam(req.get_param_value("bucket"), bucket)) ||
+            (req.has_param("from") && !parseTimeParam(req.get_param_value("from"), t0)) ||
+            (req.has_param("to") && !parseTimeParam(req.get_param_value("to"), t1)) || t0 >= t1 || bucket <= 0 ||
+            (t1 - t0) / bucket > MAX_ACTIVITY_BUCKETS) {
+            json error;
+            error["success"] = false;
+            error["message"] = "无效的时间范围或 bucket";
+            res.status = 400;
+            res.set_content(error.dump(), "application/json");
+            return;
+        }
+
+        int channel = parseChannel(req.get_param_value("channel"));
+        if (req.has_param("channel") && channel == 0) {
+            json error;
+            error["success"] = false;
+            error["message"] = "无效的通道参数";
+            res.status = 400;
+            res.set_content(error.dump(), "application/json");
+            return;
+        }
+
+        json response;
+        response["success"] = true;
+        response["channels"] = json::array();
+        for (int ch = 1; ch <= 2; ch++) {
+            if (channel == 0 || ch == channel) {
+                response["channels"].push_back(queryActivity(ch, t0, t1, bucket));
+            }
+        }
+        res.set_content(response.dump(), "application/json");
+    });
+    
+    // API: 分段开关事件推送 (Server-Sent Events)，断线重连时按 Last-Event-ID 补发历史中的事件
+    svr.Get("/api/segments/events", [](const Request& req, Response& res) {
+        int64_t resumeId = -1;
+        if (req.has_header("Last-Event-ID") &&
+            (!parseIntParam(req.get_header_value("Last-Event-ID"), resumeId) || resumeId < 0)) {
+            json error;
+            error["success"] = false;
+            error["message"] = "无效的 Last-Event-ID";
+            res.status = 400;
+            res.set_content(error.dump(), "application/json");
+            return;
+        }
+        if (!admitEventClient(segmentEventClients, MAX_SEGMENT_EVENT_CLIENTS, "/api/segments", res)) return;
+        auto lastId = std::make_shared<uint64_t>(0);
+        {
+            // 事件编号在服务重启后从 0 开始，上次运行留下的更大编号按当前编号处理，否则推送会一直停住
+            std::lock_guard<std::mutex> lock(segmentEventMutex);
+            *lastId = resumeId < 0 ? lastSegmentEventId : std::min<uint64_t>(resumeId, lastSegmentEventId);
+        }
+        serveEventStream(res, segmentEventMutex, segmentEventCv, segmentEventClients, 0,
+                         [lastId] { return lastSegmentEventId > *lastId; },
+                         [lastId] {
+                             std::string event;
+                             for (const auto& item : segmentEvents) {
+                                 if (item.id <= *lastId) continue;
+                                 event += "id: " + std::to_string(item.id) + "\nevent: " + item.type + "\ndata: " +
+                                          segmentEventToJson(item).dump() + "\n\n";
+                             }
+                             *lastId = lastSegmentEventId;
+                             return event;
+                         });
+    });
+
+    // API: 后台重新校验分段，检测TF卡上的静默损坏
+    svr.Post("/api/verify", [](const Request& req, Response& res) {
+        int64_t t0 = 0;
+        int64_t t1 = INT64_MAX;
+        int channel = parseChannel(req.get_param_value("channel"));
+        if ((req.has_param("from") && !parseTimeParam(req.get_param_value("from"), t0)) ||
+            (req.has_param("to") && !parseTimeParam(req.get_param_value("to"), t1)) || t0 > t1 ||
+            (req.has_param("channel") && channel == 0)) {
+            json error;
+            error["success"] = false;
+            error["message"] = "无效的校验范围";
+            res.status = 400;
+            res.set_content(error.dump(), "application/json");
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(verifyMutex);
+        if (verifyState.running) {
+            json error;
+            error["success"] = false;
+            error["message"] = "校验正在进行中";
+            res.status = 409;
+            res.set_content(error.dump(), "application/json");
+            return;
+        }
+        std::vector<VerifyTarget> targets = collectVerifyTargets(channel, t0, t1);
+        verifyState = VerifyState();
+        verifyState.running = true;
+        verifyState.startedAt = std::time(nullptr);
+        verifyState.total = targets.size();
+        std::thread(runVerify, std::move(targets)).detach();
+
+        json response;
+        response["success"] = true;
+        response["message"] = "已开始校验 " + std::to_string(verifyState.total) + " 个分段";
+        res.set_content(response.dump(), "application/json");
+    });
+
+    // API: 校验进度与结果
+    svr.Get("/api/verify", [](const Request& /* req */, Response& res) {
+        json response;
+        response["success"] = true;
+        {
+            std::lock_guard<std::mutex> lock(verifyMutex);
+            response["verify"] = verifyStateToJson();
+        }
+        res.set_content(response.dump(), "application/json");
+    });
+    
     // API: 获取正在录制的文件
     svr.Get("/api/recording-files", [](const Request& /* req */, Response& res) {
         try {
@@ -687,17 +7160,7 @@ int main() {
             response["files"] = json::array();
             
             for (const auto& file : files) {
-                json fileJson;
-                fileJson["name"] = file.name;
-                fileJson["fullPath"] = file.fullPath;
-                fileJson["relativePath"] = file.relativePath;
-                fileJson["size"] = file.size;
-                fileJson["sizeStr"] = file.sizeStr;
-                fileJson["modifyTime"] = file.modifyTime;
-                fileJson["timeStr"] = file.timeStr;
-                fileJson["channel"] = file.channel;
-                fileJson["isRecording"] = file.isRecording;
-                response["files"].push_back(fileJson);
+                response["files"].push_back(fileInfoToJson(file));
             }
             
             res.set_content(response.dump(), "application/json");
@@ -715,8 +7178,11 @@ int main() {
             json reqJson = json::parse(req.body);
             std::string filePath = reqJson["filePath"];
             
-            // 安全检查
-            if (filePath.find(config.save_path1) != 0 && filePath.find(config.save_path2) != 0) {
+            // 安全检查：只允许删除保存目录下的文件
+            size_t slash = filePath.find_last_of('/');
+            std::string dirPath = slash == std::string::npos ? "" : filePath.substr(0, slash);
+            int channel = dirPath == config.save_path1 ? 1 : dirPath == config.save_path2 ? 2 : 0;
+            if (channel == 0) {
                 json error;
                 error["success"] = false;
                 error["message"] = "不允许删除此路径的文件";
@@ -724,33 +7190,17 @@ int main() {
                 return;
             }
             
-            // 检查文件是否正在录制
-            std::vector<FileInfo> recordingFiles = getCurrentRecordingFiles();
-            for (const auto& file : recordingFiles) {
-                if (file.fullPath == filePath) {
-                    json error;
-                    error["success"] = false;
-                    error["message"] = "无法删除正在录制的文件";
-                    res.set_content(error.dump(), "application/json");
-                    return;
-                }
-            }
-            
-            // 删除文件
-            std::string deleteCommand = "echo 'linaro' | sudo -S rm \"" + filePath + "\" 2>/dev/null";
-            int deleteResult = system(deleteCommand.c_str());
-            
-            if (deleteResult == 0) {
-                json response;
-                response["success"] = true;
-                response["message"] = "文件删除成功";
-                res.set_content(response.dump(), "application/json");
-            } else {
-                json error;
-                error["success"] = false;
-                error["message"] = "文件删除失败";
-                res.set_content(error.dump(), "application/json");
-            }
+            DeleteItem item;
+            item.id = filePath;
+            item.channel = channel;
+            item.name = filePath.substr(slash + 1);
+            std::vector<DeleteItem> items = {item};
+            deleteSegments(items);
+
+            json response;
+            response["success"] = items[0].success;
+            response["message"] = items[0].message;
+            res.set_content(response.dump(), "application/json");
         } catch (const std::exception& e) {
             json error;
             error["success"] = false;
@@ -759,6 +7209,145 @@ int main() {
         }
     });
     
+    // API: 批量删除，按 ID 列表或通道+时间范围
+    svr.Post("/api/delete", [](const Request& req, Response& res) {
+        auto fail = [&res](const std::string& message) {
+            json error;
+            error["success"] = false;
+            error["message"] = message;
+            res.status = 400;
+            res.set_content(error.dump(), "application/json");
+        };
+        json reqJson = json::parse(req.body, nullptr, false);
+        if (reqJson.is_discarded() || !reqJson.is_object()) return fail("请求格式错误");
+
+        std::vector<DeleteItem> items;
+        if (reqJson.contains("ids")) {
+            if (!reqJson["ids"].is_array()) return fail("ids 应为数组");
+            for (const auto& id : reqJson["ids"]) {
+                DeleteItem item;
+                item.id = id.is_string() ? id.get<std::string>() : id.dump();
+                if (!id.is_string() || !parseSegmentId(item.id, item.channel, item.name)) {
+                    item.channel = 0;
+                    item.message = "无效的文件ID";
+                }
+                items.push_back(item);
+            }
+        } else {
+            auto timeField = [&reqJson](const char* key, int64_t& out) {
+                if (!reqJson.contains(key)) return false;
+                if (reqJson[key].is_number_integer()) {
+                    out = reqJson[key];
+                    return true;
+                }
+                return reqJson[key].is_string() && parseTimeParam(reqJson[key], out);
+            };
+            // channel 可为 "videos1"/"1" 或整数 1；其他类型直接判为无效，不让 json 的类型异常变成 500
+            int channel = 0;
+            if (reqJson.contains("channel")) {
+                const json& value = reqJson["channel"];
+                if (value.is_string()) {
+                    channel = parseChannel(value.get<std::string>());
+                } else if (value.is_number_integer()) {
+                    channel = parseChannel(std::to_string(value.get<int64_t>()));
+                }
+            }
+            int64_t t0, t1;
+            if (channel == 0 || !timeField("from", t0) || !timeField("to", t1) || t0 > t1) {
+                return fail("需要 ids，或 channel、from、to");
+            }
+            for (const auto& id : segmentIdsInRange(channel, t0, t1)) {
+                DeleteItem item;
+                item.id = id;
+                parseSegmentId(id, item.channel, item.name);
+                items.push_back(item);
+            }
+        }
+
+        deleteSegments(items);
+
+        json response;
+        json results = json::array();
+        size_t deleted = 0;
+        int64_t freedBytes = 0;
+        for (const auto& item : items) {
+            if (item.success) {
+                deleted++;
+                freedBytes += item.size;
+            }
+            results.push_back({{"id", item.id}, {"success", item.success}, {"message", item.message}});
+        }
+        response["success"] = deleted == items.size();
+        response["message"] = "已删除 " + std::to_string(deleted) + " 个文件，失败 " + std::to_string(items.size() - deleted) + " 个";
+        response["deleted"] = deleted;
+        response["failed"] = items.size() - deleted;
+        response["freedBytes"] = freedBytes;
+        response["results"] = results;
+        res.set_content(response.dump(), "application/json");
+    });
+    
+    // API: 打包下载多个分段。选择较多时用表单 POST 提交 ids，避免 URL 过长
+    auto archiveHandler = [](const Request& req, Response& res) {
+        auto fail = [&res](int status, const std::string& message) {
+            json error;
+            error["success"] = false;
+            error["message"] = message;
+            res.status = status;
+            res.set_content(error.dump(), "application/json");
+        };
+        std::string format = req.has_param("format") ? req.get_param_value("format") : "zip";
+        if (format != "zip" && format != "tar") return fail(400, "format 只支持 zip 或 tar");
+
+        std::vector<std::string> ids;
+        if (req.has_param("ids")) {
+            std::stringstream ss(req.get_param_value("ids"));
+            std::string id;
+            while (std::getline(ss, id, ',')) {
+                if (!id.empty()) ids.push_back(id);
+            }
+        } else {
+            int channel = parseChannel(req.get_param_value("channel"));
+            int64_t t0, t1;
+            if (channel == 0 || !parseTimeParam(req.get_param_value("from"), t0) ||
+                !parseTimeParam(req.get_param_value("to"), t1) || t0 > t1) {
+                return fail(400, "需要 ids，或 channel、from、to");
+            }
+            // 按时间范围打包时跳过仍在写入的分段
+            std::lock_guard<std::mutex> lock(catalogMutex);
+            SegmentCatalog& catalog = channelCatalog(channel);
+            const SegmentColumns& rows = catalog.rows;
+            for (size_t row = rows.lowerBound(t0); row < rows.count() && rows.start[row] < t1; row++) {
+                std::string name = segmentFileName(rows.kind[row], rows.start[row]);
+                if (!segmentWriting(channel, name)) {
+                    ids.push_back(channelName(channel) + "/" + name);
+                }
+            }
+        }
+        if (ids.empty()) return fail(404, "没有可打包的文件");
+
+        if (++archiveStreams > MAX_ARCHIVE_STREAMS) {
+            archiveStreams--;
+            return fail(503, "同时进行的打包下载过多");
+        }
+        auto archive = std::make_shared<ArchiveStream>();
+        std::string error;
+        if (!collectArchiveEntries(ids, archive->entries, error)) return fail(404, error);
+        archive->zip = format == "zip";
+        archive->buffer.resize(ARCHIVE_CHUNK);
+
+        char fileName[64];
+        std::time_t now = std::time(nullptr);
+        std::strftime(fileName, sizeof(fileName), "segments_%Y%m%d_%H%M%S", std::localtime(&now));
+        res.set_header("Content-Disposition", std::string("attachment; filename=\"") + fileName + "." + format + "\"");
+        res.set_header("Cache-Control", "no-cache");
+        res.set_chunked_content_provider(archive->zip ? "application/zip" : "application/x-tar",
+                                         [archive](size_t /* offset */, DataSink& sink) {
+                                             return archiveStep(*archive, sink);
+                                         });
+    };
+    svr.Get("/api/archive", archiveHandler);
+    svr.Post("/api/archive", archiveHandler);
+    
     // API: 视频预览（支持Range请求）
     svr.Get("/api/preview/(.*)", [](const Request& req, Response& res) {
         try {
@@ -775,6 +7364,45 @@ int main() {
                 return;
             }
             
+            // 转封装为其他容器，流式输出，不支持 Range
+            if (req.has_param("container")) {
+                std::string container = req.get_param_value("container");
+                struct stat st;
+                if (container != "ts" && container != "mkv") {
+                    res.status = 400;
+                    res.set_content("container must be ts or mkv", "text/plain");
+                    return;
+                }
+                if (stat(fullPath.c_str(), &st) != 0) {
+                    res.status = 404;
+                    res.set_content("File not found", "text/plain");
+                    return;
+                }
+                if (++remuxStreams > MAX_REMUX_STREAMS) {
+                    remuxStreams--;
+                    res.status = 503;
+                    res.set_content("Too many remux streams", "text/plain");
+                    return;
+                }
+                auto process = std::make_shared<RemuxProcess>();
+                if (!startRemux(*process, fullPath, container)) {
+                    res.status = 500;
+                    res.set_content("Remux failed to start", "text/plain");
+                    return;
+                }
+                if (req.has_param("download")) {
+                    std::string fileName = relativePath.substr(relativePath.find_last_of('/') + 1);
+                    fileName = fileName.substr(0, fileName.find_last_of('.')) + "." + container;
+                    res.set_header("Content-Disposition", "attachment; filename=\"" + fileName + "\"");
+                }
+                res.set_header("Cache-Control", "no-cache");
+                res.set_chunked_content_provider(container == "ts" ? "video/mp2t" : "video/x-matroska",
+                                                 [process](size_t /* offset */, DataSink& sink) {
+                                                     return remuxStep(*process, sink);
+                                                 });
+                return;
+            }
+            
             std::ifstream file(fullPath, std::ios::binary | std::ios::ate);
             if (!file.is_open()) {
                 res.status = 404;
@@ -853,6 +7481,51 @@ int main() {
         }
     });
 
+    // API: 跟随播放正在录制的分段
+    svr.Get("/api/live-file/(.*)", [](const Request& req, Response& res) {
+        json error;
+        error["success"] = false;
+        int channel = parseChannel(req.matches[1]);
+        if (channel == 0) {
+            error["message"] = "无效的通道参数";
+            res.status = 400;
+            res.set_content(error.dump(), "application/json");
+            return;
+        }
+        WritingSegment segment;
+        if (!recorderSegment(channel, segment)) {
+            error["message"] = "通道" + std::to_string(channel) + " 没有正在录制的分段";
+            res.status = 404;
+            res.set_content(error.dump(), "application/json");
+            return;
+        }
+        if (++liveStreams > MAX_LIVE_STREAMS) {
+            liveStreams--;
+            error["message"] = "同时跟随播放的连接过多";
+            res.status = 503;
+            res.set_content(error.dump(), "application/json");
+            return;
+        }
+        auto tail = std::make_shared<LiveTail>();
+        if (!openLiveTail(*tail, channelSavePath(channel) + "/" + segment.name)) {
+            error["message"] = "无法打开分段: " + std::string(strerror(errno));
+            res.status = 500;
+            res.set_content(error.dump(), "application/json");
+            return;
+        }
+        if (!mp4HasLeadingMoov(tail->fd)) {
+            error["message"] = "分段 " + segment.name + " 不是分片 MP4，开启 fragmented_mp4 后录制的分段才能边录边看";
+            res.status = 409;
+            res.set_content(error.dump(), "application/json");
+            return;
+        }
+        res.set_header("Cache-Control", "no-cache");
+        res.set_header("X-Segment-Name", segment.name);
+        res.set_chunked_content_provider("video/mp4", [tail](size_t /* offset */, DataSink& sink) {
+            return liveTailStep(*tail, sink);
+        });
+    });
+
     // API: 上传文件到S3
     svr.Post("/api/upload-to-s3", [](const Request& req, Response& res) {
         try {
@@ -871,25 +7544,14 @@ int main() {
                 return;
             }
             
-            // 构建Python脚本命令, 并重定向stderr到stdout
-            std::string pythonCmd = "python3 /data/tra50/demo/upload_to_s3.py \"" + filePath + "\" \"" + fileName + "\" 2>&1";
-            
-            // 执行Python脚本
-            CommandResult cmd_result = executeCommandWithStatus(pythonCmd);
+            // 加入上传队列后立即返回，由后台工作线程执行上传
+            uint64_t jobId = enqueueUpload(filePath, fileName);
             
             json response;
-            if (cmd_result.exit_status == 0) {
-                response["success"] = true;
-                response["message"] = "文件上传到S3成功: " + fileName;
-            } else {
-                response["success"] = false;
-                // 从命令输出中移除换行符
-                if (!cmd_result.output.empty() && cmd_result.output.back() == '\n') {
-                    cmd_result.output.pop_back();
-                }
-                response["message"] = "上传失败: " + (cmd_result.output.empty() ? "未知错误" : cmd_result.output);
-            }
-            
+            response["success"] = true;
+            response["message"] = "已加入上传队列: " + fileName;
+            response["job_id"] = jobId;
+            res.status = 202;
             res.set_content(response.dump(), "application/json");
             
         } catch (const std::exception& e) {
@@ -901,6 +7563,64 @@ int main() {
         }
     });
     
+    // API: 上传任务列表，status 可选，逗号分隔，如 status=queued,active,failed
+    svr.Get("/api/uploads", [](const Request& req, Response& res) {
+        std::set<std::string> statuses;
+        std::stringstream ss(req.get_param_value("status"));
+        std::string item;
+        while (std::getline(ss, item, ',')) {
+            if (!item.empty()) statuses.insert(item);
+        }
+        json response;
+        response["success"] = true;
+        response["jobs"] = json::array();
+        std::lock_guard<std::mutex> lock(uploadMutex);
+        for (const auto& job : uploadJobs) {
+            if (statuses.empty() || statuses.count(job.second.status)) response["jobs"].push_back(uploadJobToJson(job.second));
+        }
+        response["summary"] = uploadSummaryJson();
+        response["version"] = uploadVersion;
+        res.set_header("Cache-Control", "no-cache");
+        res.set_content(response.dump(), "application/json");
+    });
+    
+    // API: 上传进度推送 (Server-Sent Events)。首条消息为全部任务，之后最多每秒一条，只含变化的任务
+    svr.Get("/api/uploads/events", [](const Request& /* req */, Response& res) {
+        if (!admitEventClient(uploadEventClients, MAX_UPLOAD_EVENT_CLIENTS, "/api/uploads", res)) return;
+        auto lastVersion = std::make_shared<uint64_t>(0);
+        serveEventStream(res, uploadMutex, uploadChangedCv, uploadEventClients, 1,
+                         [lastVersion] { return uploadVersion != *lastVersion; },
+                         [lastVersion] {
+                             json message;
+                             message["jobs"] = json::array();
+                             for (const auto& job : uploadJobs) {
+                                 if (job.second.version > *lastVersion) message["jobs"].push_back(uploadJobToJson(job.second));
+                             }
+                             message["summary"] = uploadSummaryJson();
+                             message["version"] = uploadVersion;
+                             *lastVersion = uploadVersion;
+                             return "data: " + message.dump() + "\n\n";
+                         });
+    });
+    
+    // API: 查询上传任务
+    svr.Get(R"(/api/uploads/(\d+))", [](const Request& req, Response& res) {
+        uint64_t jobId = std::stoull(req.matches[1].str());
+        std::lock_guard<std::mutex> lock(uploadMutex);
+        auto it = uploadJobs.find(jobId);
+        if (it == uploadJobs.end()) {
+            json error;
+            error["success"] = false;
+            error["message"] = "上传任务不存在";
+            res.status = 404;
+            res.set_content(error.dump(), "application/json");
+            return;
+        }
+        json response = uploadJobToJson(it->second);
+        response["success"] = true;
+        res.set_content(response.dump(), "application/json");
+    });
+    
     // API: 获取系统监控信息
     svr.Get("/api/system-monitor", [](const Request& /* req */, Response& res) {
         try {
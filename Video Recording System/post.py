@@ -1,10 +1,11 @@
+import os
 import boto3
 from botocore.client import Config
 
 class S3Uploader:
     def __init__(self):
-        self.aws_access_key = "ePj9RapAJI31j36ZL4sZ"
-        self.aws_secret_key = "amryv0sppaWgWLDE9K46tGj5leMYiAe7zd3rfV0g"
+        self.aws_access_key = os.environ.get("VRS_S3_ACCESS_KEY", "")
+        self.aws_secret_key = os.environ.get("VRS_S3_SECRET_KEY", "")
         self.bucket_name = "test"
         self.s3_endpoint = "http://101.37.202.178:9001"
         
@@ -65,6 +65,9 @@ class VideoRecorderApp {
         if (this.currentPage === 'files') {
             this.stopFileManagementMonitoring();
         }
+        if (this.currentPage === 'upload') {
+            stopUploadQueueUpdates();
+        }
         
         // 隐藏所有页面
         document.querySelectorAll('.content-page').forEach(page => {
@@ -90,6 +93,7 @@ class VideoRecorderApp {
                 break;
             case 'upload':
                 refreshLocalFilesForUpload();
+                startUploadQueueUpdates();
                 break;
             case 'recording':
                 refreshRecordingFiles();
@@ -1204,6 +1208,22 @@ async function downloadFile(relativePath) {
     }
 }
 
+// 打包下载：用表单 POST 提交 ID 列表，浏览器直接接收流式生成的 zip
+function downloadArchive(ids) {
+    const form = document.createElement('form');
+    form.method = 'POST';
+    form.action = '/api/archive';
+    form.style.display = 'none';
+    const input = document.createElement('input');
+    input.type = 'hidden';
+    input.name = 'ids';
+    input.value = ids.join(',');
+    form.appendChild(input);
+    document.body.appendChild(form);
+    form.submit();
+    form.remove();
+}
+
 // 删除文件
 async function deleteFile(filePath, fileName, showConfirm = true) {
     try {
@@ -1448,6 +1468,20 @@ function updateSelectedFileCountAndButtons() {
     }
 }
 
+// 批量删除：ID 为文件的 relativePath，服务端一次处理并返回逐项结果
+async function deleteFilesBatch(ids) {
+    const response = await fetch('/api/delete', {
+        method: 'POST',
+        headers: { 'Content-Type': 'application/json' },
+        body: JSON.stringify({ ids })
+    });
+    const result = await response.json();
+    if (!result.results) {
+        throw new Error(result.message || '删除失败');
+    }
+    return result;
+}
+
 async function deleteSingleFile(filePath, fileName) {
     if (await deleteFile(filePath, fileName, true)) {
         refreshFileManagementList();
@@ -1482,10 +1516,11 @@ async function deleteSelectedFiles() {
     }
     
     let successCount = 0;
-    for (const cb of checkboxes) {
-        if (await deleteFile(cb.dataset.filepath, cb.dataset.filename, false)) {
-            successCount++;
-        }
+    try {
+        const result = await deleteFilesBatch(Array.from(checkboxes, cb => cb.dataset.relativepath));
+        successCount = result.deleted || 0;
+    } catch (error) {
+        console.error('批量删除失败:', error);
     }
     
     const errorCount = checkboxes.length - successCount;
@@ -1537,8 +1572,12 @@ function downloadSelectedFiles() {
         window.app.showToast('开始下载', `正在下载 ${checkboxes.length} 个文件...`, 'info', 2000);
     }
     
-    // 批量下载文件
-    checkboxes.forEach(cb => downloadFile(cb.dataset.relativepath));
+    // 多个文件打包成一个 zip 下载
+    if (checkboxes.length > 1) {
+        downloadArchive(Array.from(checkboxes, cb => cb.dataset.relativepath));
+    } else {
+        downloadFile(checkboxes[0].dataset.relativepath);
+    }
     
     // 延迟恢复按钮状态，给下载一些时间开始
     setTimeout(() => {
@@ -1654,6 +1693,114 @@ function updateUploadButtonStatus() {
     }
 }
 
+// --- 上传队列：通过 /api/uploads/events 增量推送，连接失败时退回轮询 ---
+const uploadQueueJobs = new Map();
+let uploadEventSource = null;
+let uploadQueuePollTimer = null;
+
+function startUploadQueueUpdates() {
+    if (uploadEventSource || uploadQueuePollTimer) return;
+    uploadQueueJobs.clear();
+    uploadEventSource = new EventSource('/api/uploads/events');
+    uploadEventSource.onmessage = (event) => applyUploadQueueUpdate(JSON.parse(event.data));
+    uploadEventSource.onerror = () => {
+        // 断线时浏览器会自动重连（服务端重新发送全部任务）；被拒绝时改为轮询
+        if (uploadEventSource && uploadEventSource.readyState === EventSource.CLOSED) {
+            uploadEventSource = null;
+            pollUploadQueue();
+            uploadQueuePollTimer = setInterval(pollUploadQueue, 3000);
+        }
+    };
+}
+
+function stopUploadQueueUpdates() {
+    if (uploadEventSource) {
+        uploadEventSource.close();
+        uploadEventSource = null;
+    }
+    if (uploadQueuePollTimer) {
+        clearInterval(uploadQueuePollTimer);
+        uploadQueuePollTimer = null;
+    }
+}
+
+async function pollUploadQueue() {
+    try {
+        const response = await fetch('/api/uploads');
+        const data = await response.json();
+        if (!data.success) return;
+        uploadQueueJobs.clear();
+        applyUploadQueueUpdate(data);
+    } catch (error) {
+        console.error('获取上传队列失败:', error);
+    }
+}
+
+function applyUploadQueueUpdate(data) {
+    data.jobs.forEach(job => uploadQueueJobs.set(job.id, job));
+    renderUploadQueue(data.summary);
+}
+
+function formatEta(seconds) {
+    if (seconds < 0) return '-';
+    if (seconds < 60) return `${seconds} 秒`;
+    if (seconds < 3600) return `${Math.floor(seconds / 60)} 分 ${seconds % 60} 秒`;
+    return `${Math.floor(seconds / 3600)} 小时 ${Math.floor((seconds % 3600) / 60)} 分`;
+}
+
+function renderUploadQueue(summary) {
+    const tbody = document.getElementById('upload-queue-body');
+    const summaryEl = document.getElementById('upload-queue-summary');
+    if (!tbody) return;
+
+    if (summaryEl && summary) {
+        const limit = summary.bandwidthLimit > 0 ? ` / 限速 ${formatFileSize(summary.bandwidthLimit)}/s` : '';
+        summaryEl.textContent = `进行中 ${summary.active}，排队 ${summary.queued}，失败 ${summary.failed}，` +
+            `待传 ${formatFileSize(summary.pendingBytes)}，总速率 ${formatFileSize(summary.rate)}/s${limit}`;
+    }
+
+    // 进行中、排队、失败的任务在前，已完成的只显示最近 20 个
+    const order = { active: 0, queued: 1, failed: 2, done: 3 };
+    const jobs = Array.from(uploadQueueJobs.values()).sort((a, b) => order[a.status] - order[b.status] || b.id - a.id);
+    const visible = jobs.filter(job => job.status !== 'done').concat(jobs.filter(job => job.status === 'done').slice(0, 20));
+    if (visible.length === 0) {
+        tbody.innerHTML = '<tr><td colspan="7" class="text-center text-muted py-4">暂无上传任务</td></tr>';
+        return;
+    }
+
+    const statusText = { queued: '排队中', active: '上传中', done: '已完成', failed: '失败' };
+    const statusClass = { queued: 'bg-secondary', active: 'bg-primary', done: 'bg-success', failed: 'bg-danger' };
+    tbody.innerHTML = visible.map(job => {
+        const percent = job.size > 0 ? Math.min(100, Math.floor(job.bytesSent * 100 / job.size)) : 0;
+        const retries = job.attempts + job.partRetries;
+        return `<tr title="${job.message || ''}">
+            <td>${job.id}${job.automatic ? ' <span class="badge bg-info">自动</span>' : ''}</td>
+            <td>${job.objectName}</td>
+            <td><span class="badge ${statusClass[job.status] || 'bg-secondary'}">${statusText[job.status] || job.status}</span></td>
+            <td>
+                <div class="progress" style="height: 16px;">
+                    <div class="progress-bar" role="progressbar" style="width: ${percent}%;">${percent}%</div>
+                </div>
+                <small class="text-muted">${formatFileSize(job.bytesSent)} / ${formatFileSize(job.size)}</small>
+            </td>
+            <td>${job.status === 'active' ? formatFileSize(job.rate) + '/s' : '-'}</td>
+            <td>${formatEta(job.eta)}</td>
+            <td>${retries}</td>
+        </tr>`;
+    }).join('');
+}
+
+// 轮询上传任务直到结束
+async function waitForUploadJob(jobId) {
+    while (true) {
+        const response = await fetch(`/api/uploads/${jobId}`);
+        const job = await response.json();
+        if (!job.success) throw new Error(job.message || '上传任务不存在');
+        if (job.status === 'done' || job.status === 'failed') return job;
+        await new Promise(resolve => setTimeout(resolve, 1000));
+    }
+}
+
 async function uploadSelectedFilesToS3() {
     const checkboxes = document.querySelectorAll('#upload-file-list-body .file-checkbox:checked');
     if (checkboxes.length === 0 || !confirm(`您确定要上传选中的 ${checkboxes.length} 个文件到 S3 吗？`)) return;
@@ -1673,12 +1820,16 @@ async function uploadSelectedFilesToS3() {
                 body: JSON.stringify({ filePath: cb.dataset.filepath, fileName: cb.dataset.filename })
             });
             const result = await response.json();
-            if (response.ok && result.success) {
-                successCount++;
-                if (window.app) window.app.addLog(`文件 ${cb.dataset.filename} 上传成功。`, 'success');
-            } else {
+            if (!response.ok || !result.success) {
                 throw new Error(result.message || '未知错误');
             }
+            if (window.app) window.app.addLog(`文件 ${cb.dataset.filename} 已加入上传队列 (任务 ${result.job_id})。`, 'info');
+            const job = await waitForUploadJob(result.job_id);
+            if (job.status !== 'done') {
+                throw new Error(job.message || '未知错误');
+            }
+            successCount++;
+            if (window.app) window.app.addLog(`文件 ${cb.dataset.filename} 上传成功。`, 'success');
         } catch (err) {
             errors.push(`<li>${cb.dataset.filename}: ${err.message}</li>`);
             if (window.app) window.app.addLog(`上传文件 ${cb.dataset.filename} 失败: ${err.message}`, 'error');
@@ -2295,26 +2446,16 @@ async function deleteSelectedVideos() {
     let successCount = 0;
     const errors = [];
     
-    for (const checkbox of checkboxes) {
-        try {
-            const filePath = checkbox.dataset.filepath;
-            const fileName = checkbox.dataset.filename;
-            
-            const response = await fetch('/api/delete-file', {
-                method: 'POST',
-                headers: { 'Content-Type': 'application/json' },
-                body: JSON.stringify({ filePath, fileName })
-            });
-            
-            const result = await response.json();
-            if (response.ok && result.success) {
-                successCount++;
-            } else {
-                throw new Error(result.message || '删除失败');
+    try {
+        const result = await deleteFilesBatch(Array.from(checkboxes, cb => cb.dataset.relativepath));
+        successCount = result.deleted || 0;
+        (result.results || []).forEach(item => {
+            if (!item.success) {
+                errors.push(`${item.id.split('/').pop()}: ${item.message}`);
             }
-        } catch (error) {
-            errors.push(`${checkbox.dataset.filename}: ${error.message}`);
-        }
+        });
+    } catch (error) {
+        errors.push(error.message);
     }
     
     let message = `删除操作完成。成功: ${successCount} 个，失败: ${errors.length} 个`;
@@ -2335,12 +2476,12 @@ function downloadSelectedVideos() {
         return;
     }
     
-    checkboxes.forEach(checkbox => {
-        const relativePath = checkbox.dataset.relativepath;
-        if (relativePath) {
-            downloadFile(relativePath);
-        }
-    });
+    const ids = Array.from(checkboxes, checkbox => checkbox.dataset.relativepath).filter(Boolean);
+    if (ids.length > 1) {
+        downloadArchive(ids);
+    } else if (ids.length === 1) {
+        downloadFile(ids[0]);
+    }
 }
 
 // 全选/取消全选视频